@@ -1,15 +1,140 @@
 // NOTE: improve memory stack, clean up repeats, do/includ DRY, and clean up code overall
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <stddef.h>
+#include <errno.h>
+#include <stdarg.h>
+#include "shredder.h"
+
+// the JIT needs x86-64 and mmap/mprotect (and computed goto for the engine hook)
+#if defined(__x86_64__) && defined(__unix__) && defined(__GNUC__) && !defined(SHREDDER_NO_JIT)
+#define HAVE_JIT 1
+#include <sys/mman.h>
+#else
+#define HAVE_JIT 0
+#endif
+
+// batch mode needs POSIX threads and open_memstream (--stream fopencookie too)
+#if defined(__unix__) && !defined(SHREDDER_NO_THREADS)
+#define HAVE_BATCH 1
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#else
+#define HAVE_BATCH 0
+#endif
+
+// the loader maps regular files instead of copying them, BANK maps bank files over memory
+#if defined(__unix__) && !defined(SHREDDER_NO_MMAP)
+#define HAVE_MMAP 1
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#define HAVE_MMAP 0
+#endif
+
+// clones share memory copy-on-write through a memfd
+#if defined(__linux__) && HAVE_MMAP && !defined(SHREDDER_NO_MEMFD)
+#define HAVE_MEMFD 1
+#include <unistd.h>
+#else
+#define HAVE_MEMFD 0
+#endif
+
+// --serve parks sessions waiting for input on epoll
+#if defined(__linux__) && HAVE_BATCH && !defined(SHREDDER_NO_EPOLL)
+#define HAVE_SERVE 1
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#else
+#define HAVE_SERVE 0
+#endif
+
+// --perf-counters samples perf_event_open counters (or a profiling timer)
+#if defined(__linux__) && !defined(SHREDDER_NO_PERF)
+#define HAVE_PERF 1
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <time.h>
+#include <linux/perf_event.h>
+#else
+#define HAVE_PERF 0
+#endif
+
+// hex decoding 16 (SSE2) or 32 (AVX2, build with -mavx2) characters at a time
+#if defined(__SSE2__) && defined(__GNUC__) && !defined(SHREDDER_NO_SIMD)
+#define HAVE_SIMD_HEX 1
+#ifdef __AVX2__
+#include <immintrin.h>
+#define HEX_BLOCK 32U
+#else
+#include <emmintrin.h>
+#define HEX_BLOCK 16U
+#endif
+#else
+#define HAVE_SIMD_HEX 0
+#endif
 
  // Configuration & Constants
 #define MEMORY_SIZE       65536U    
 #define STACK_SIZE        64U       
-#define MAX_INSTRUCTIONS  1000000U  
+#define DATA_STACK_SIZE   256U       // PUSH/POP values, separate from the call stack
+#define MAX_INSTRUCTIONS  1000000U   // default budget, see shred_vm_set_limit()
 #define MAX_FILENAME_LEN  256U
+#define BANK_WINDOW_SHIFT 12U        // BANK maps files over 4K windows of memory
+#define BANK_WINDOWS      (MEMORY_SIZE >> BANK_WINDOW_SHIFT)
+
+ // .shbin image: 16 byte header, then the raw bytes that go at address 0.
+ // All fields little-endian.
+ //   0  "SHBN"     magic
+ //   4  version    SHBIN_VERSION
+ //   5  flags      SHBIN_FIXED_CODE or 0
+ //   6  entry      16-bit start address
+ //   8  length     32-bit image length, at most MEMORY_SIZE
+ //  12  checksum   32-bit FNV-1a of the image bytes
+#define SHBIN_MAGIC       "SHBN"
+#define SHBIN_VERSION     1U
+#define SHBIN_HEADER_LEN  16U
+#define SHBIN_FIXED_CODE  0x01U    // aot_analyze() proved no store reaches code, all of it in the image
+
+ // Snapshot file: everything shred_vm_run() needs to carry on. Memory sits at
+ // a page boundary so a restore can map it copy-on-write instead of reading it.
+ //   0  "SHSN"     magic
+ //   4  version    SNAP_VERSION
+ //   5  flags      reserved, 0
+ //   6  status     shred_status
+ //   7  overflow   overflow flag
+ //   8  ip         32-bit
+ //  12  entry      32-bit
+ //  16  count      64-bit instruction count
+ //  24  sp         16-bit stack pointer
+ //  26  dsp        16-bit data stack pointer
+ //  28  checksum   32-bit FNV-1a of bytes 6-27, both stacks and memory
+ //  32  call stack STACK_SIZE 16-bit entries
+ //  SNAP_DATA_OFFSET    data stack, DATA_STACK_SIZE 16-bit entries
+ //  SNAP_MEMORY_OFFSET  memory, MEMORY_SIZE bytes
+#define SNAP_MAGIC          "SHSN"
+#define SNAP_VERSION        3U
+#define SNAP_DATA_OFFSET    (32U + STACK_SIZE * 2U)
+#define SNAP_HEADER_LEN     (SNAP_DATA_OFFSET + DATA_STACK_SIZE * 2U)
+#define SNAP_MEMORY_OFFSET  4096U
 
 // Core Opcodes (0x00-0x0F) 
 #define OP_NOP      0x00 
@@ -50,14 +175,189 @@
 #define OP_JZ16     0x1D
 #define OP_RUN16    0x1E
 
- // Global VM State
-static uint8_t  memory[MEMORY_SIZE];        // Unified 64K memory 
-static uint16_t call_stack[STACK_SIZE];     // 16-bit return addresses 
-static uint16_t stack_pointer = 0;          // Stack pointer 
-static uint8_t  overflow_flag = 0;          // Arithmetic overflow flag 
-static uint32_t instruction_count = 0;      // Instruction counter 
-static int      debug_mode = 0;
-static int      trace_mode = 0;
+// Data Stack Opcodes (0x1F-0x20)
+#define OP_PUSH     0x1F
+#define OP_POP      0x20
+
+// 16-bit Word Opcodes (0x28-0x30), numbered as in v0.0.2. A word is two
+// bytes, high byte first like a 16-bit operand. v0.0.2's 8-bit boolean and
+// compare opcodes (0x21-0x27) aren't implemented.
+#define OP_PUSH16_MEM   0x28
+#define OP_POP16_MEM    0x29
+#define OP_BAND16   0x2A
+#define OP_BOR16    0x2B
+#define OP_BXOR16   0x2C
+#define OP_BNOT16   0x2D
+#define OP_BNAND16  0x2E
+#define OP_LT16_CMP     0x2F
+#define OP_GT16_CMP     0x30
+
+// Structured Control Flow Opcodes (0x31-0x36)
+#define OP_IF       0x31
+#define OP_THEN     0x32
+#define OP_ELSE     0x33
+#define OP_ELSEIF   0x34
+#define OP_FOR      0x35
+#define OP_ERROR    0x36
+
+// Block Memory Opcodes (0x37-0x39, after the range v0.0.2 uses)
+#define OP_BCOPY    0x37
+#define OP_BFILL    0x38
+#define OP_BCMP     0x39
+
+// Banked Memory Opcodes (0x3A-0x3B)
+#define OP_BANK     0x3A
+#define OP_BANKLEN  0x3B
+
+ // Opcode table: mnemonic + encoded length in bytes (length 0 = unknown opcode)
+typedef struct {
+    const char *name;
+    uint8_t     length;
+} op_info;
+
+static const op_info op_table[256] = {
+    [OP_NOP]     = {"NOP", 1},     [OP_POKE]    = {"POKE", 3},
+    [OP_MOVE]    = {"MOVE", 3},    [OP_NOT]     = {"NOT", 2},
+    [OP_NAND]    = {"NAND", 4},    [OP_JMP]     = {"JMP", 2},
+    [OP_JZ]      = {"JZ", 3},      [OP_RUN]     = {"RUN", 2},
+    [OP_HALT]    = {"HALT", 1},    [OP_AND]     = {"AND", 4},
+    [OP_OR]      = {"OR", 4},      [OP_XOR]     = {"XOR", 4},
+    [OP_INC]     = {"INC", 2},     [OP_DEC]     = {"DEC", 2},
+    [OP_CMP]     = {"CMP", 4},     [OP_COMMENT] = {"COMMENT", 2},
+    [OP_PUTC]    = {"PUTC", 2},    [OP_PUTN]    = {"PUTN", 2},
+    [OP_GETC]    = {"GETC", 2},    [OP_RET]     = {"RET", 1},
+    [OP_ADD]     = {"ADD", 4},     [OP_SUB]     = {"SUB", 4},
+    [OP_MUL]     = {"MUL", 4},     [OP_DIV]     = {"DIV", 4},
+    [OP_SHL]     = {"SHL", 4},     [OP_SHR]     = {"SHR", 4},
+    [OP_POKE16]  = {"POKE16", 4},  [OP_MOVE16]  = {"MOVE16", 5},
+    [OP_JMP16]   = {"JMP16", 3},   [OP_JZ16]    = {"JZ16", 4},
+    [OP_RUN16]   = {"RUN16", 3},
+    [OP_PUSH]    = {"PUSH", 2},    [OP_POP]     = {"POP", 2},
+    [OP_PUSH16_MEM] = {"PUSH16", 3}, [OP_POP16_MEM] = {"POP16", 3},
+    [OP_BAND16]  = {"BAND16", 7},  [OP_BOR16]   = {"BOR16", 7},
+    [OP_BXOR16]  = {"BXOR16", 7},  [OP_BNOT16]  = {"BNOT16", 3},
+    [OP_BNAND16] = {"BNAND16", 7},
+    [OP_LT16_CMP] = {"LT16", 6},   [OP_GT16_CMP] = {"GT16", 6},
+    [OP_IF]      = {"IF", 2},      [OP_THEN]    = {"THEN", 1},
+    [OP_ELSE]    = {"ELSE", 1},    [OP_ELSEIF]  = {"ELSEIF", 2},
+    [OP_FOR]     = {"FOR", 2},     [OP_ERROR]   = {"ERROR", 2},
+    [OP_BCOPY]   = {"BCOPY", 7},   [OP_BFILL]   = {"BFILL", 6},
+    [OP_BCMP]    = {"BCMP", 8},
+    [OP_BANK]    = {"BANK", 5},    [OP_BANKLEN] = {"BANKLEN", 4},
+};
+#define MAX_INSN_LEN      8U
+
+// computed goto is a GNU extension, everything else gets the switch fallback
+#if defined(__GNUC__) && !defined(SHREDDER_NO_COMPUTED_GOTO)
+#define HAVE_COMPUTED_GOTO 1
+#else
+#define HAVE_COMPUTED_GOTO 0
+#undef  HAVE_JIT
+#define HAVE_JIT 0
+#endif
+
+// stop GCC from merging the per-handler dispatch jumps back into a single one
+#if HAVE_COMPUTED_GOTO && !defined(__clang__)
+#define NO_CROSSJUMP __attribute__((optimize("no-crossjumping", "no-gcse")))
+#else
+#define NO_CROSSJUMP
+#endif
+
+ // for the per-instruction hooks, which GCC won't inline into the engines on its own
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+ // Decoded instruction cache entry, see decode_insn()
+#define CODE_PAGE_SHIFT   8U
+#define CODE_PAGE_COUNT   (MEMORY_SIZE >> CODE_PAGE_SHIFT)
+
+#define CODE_DECODED      0x01     // code_bytes[]: covered by a decoded instruction
+#define CODE_JIT          0x02     // code_bytes[]: covered by a compiled block
+#define CODE_CTRL         0x04     // code_bytes[]: inside a resolved IF/FOR, see ctrl_lookup()
+
+#define H_DECODE          0        // handler id for "not decoded yet"
+#define H_OP(op)          ((op) + 1)
+ // superinstructions, see fuse_insn(): ids after the 256 opcodes
+#define H_DEC_JZ          (H_OP(256) + 0)
+#define H_DEC_JZ16        (H_OP(256) + 1)
+#define H_CMP_JZ          (H_OP(256) + 2)
+#define H_CMP_JZ16        (H_OP(256) + 3)
+#define H_INC_JMP         (H_OP(256) + 4)
+#define H_INC_JMP16       (H_OP(256) + 5)
+#define H_COUNT           (H_OP(256) + 6)
+
+typedef struct {
+    uint16_t a, b, c, x;   // operands, widened to 16 bits; x is a fused branch's target
+    uint16_t handler;      // H_DECODE, H_OP(opcode) or a superinstruction
+    uint8_t  opcode;
+    uint8_t  length;       // a superinstruction covers both instructions
+    uint8_t  spare[4];     // keeps entries 16 bytes so indexing is a shift
+} decoded_insn;
+
+ // IF/ELSEIF/ELSE/THEN/FOR side table entry, one per clause address
+typedef struct {
+    uint32_t gen;          // current while it equals ctrl_table.gen, 0 = never resolved
+    uint16_t opener;       // the IF or FOR the clause belongs to
+    uint16_t next;         // IF/ELSEIF: the next clause, where a false condition goes
+    uint16_t end;          // the THEN closing the construct
+    uint16_t spare;
+} ctrl_entry;
+
+typedef struct {
+    uint32_t   gen;        // bumped by every store onto a resolved construct
+    ctrl_entry at[MEMORY_SIZE];
+} ctrl_table;
+
+typedef struct jit_state jit_state;
+typedef struct exec_profile exec_profile;
+typedef struct exec_trace exec_trace;
+typedef struct exec_perf exec_perf;
+typedef struct bank_state bank_state;
+
+ // VM State
+ // Everything one VM owns, so a process can run as many as it wants
+struct shred_vm {
+    uint8_t      *memory;                 // Unified 64K memory
+    int           cow_fd;                 // memfd clones map memory from, -1 if none (see shred_vm_clone)
+    uint16_t      call_stack[STACK_SIZE]; // 16-bit return addresses
+    uint16_t      stack_pointer;          // Stack pointer
+    uint16_t      data_stack[DATA_STACK_SIZE]; // PUSH/POP values, bytes are zero-extended
+    uint16_t      data_pointer;           // Data stack pointer
+    uint8_t       overflow_flag;          // Arithmetic overflow flag
+    uint64_t      instruction_count;      // Instruction counter
+    uint64_t      max_instructions;       // fault past this many, UINT64_MAX = no limit
+    uint32_t      ip;                     // where the next shred_vm_run() starts
+    uint32_t      entry;                  // where shred_vm_reset() puts ip
+    uint32_t      image_len;              // bytes the last load put in memory
+    int           fixed_code;             // no store can reach code (SHBIN_FIXED_CODE), skip the checks
+    shred_status  status;                 // SHRED_PAUSED while there is more to run
+    int           debug_mode;
+    int           trace_mode;
+    int           engine;
+    int           fuse;                   // decode superinstructions, see shred_vm_set_fusion()
+    FILE         *in, *out, *err;         // GETC / PUTC, PUTN and debug output / faults
+    int           in_fed;                 // GETC reads fed input, see shred_vm_feed_input()
+    int           in_closed;              // no more will be fed, GETC reads 0 once it's all read
+    const uint8_t *in_next, *in_end;      // fed input not read yet, in in_buf or lent by the host
+    uint8_t      *in_buf;                 // what shred_vm_feed_input() copied
+    size_t        in_cap;
+    char         *out_buf;                // PUTC/PUTN output not written to out yet
+    uint32_t      out_len, out_cap;
+    int           out_mode;               // SHRED_OUTPUT_*
+
+    decoded_insn *decode_cache;           // MEMORY_SIZE + 1 entries (ip == MEMORY_SIZE has a slot), see decode_cache_alloc()
+    uint8_t       code_pages[CODE_PAGE_COUNT / 8]; // bit set = page holds code bytes
+    uint8_t      *code_bytes;             // CODE_* flags per byte, NULL until something is marked
+    jit_state    *jit;                    // allocated the first time a block is compiled
+    exec_profile *profile;                // counters for shred_vm_set_profile(), NULL when off
+    exec_trace   *trace;                  // ring for shred_vm_set_trace(), NULL when off
+    exec_perf    *perf;                   // samples for shred_vm_set_perf_counters(), NULL when off
+    ctrl_table   *ctrl;                   // IF/FOR targets, allocated when the first one runs
+    bank_state   *banks;                  // attached bank files and BANK windows, NULL until one is attached
+};
 
  // Helper: Check operand availability
  // Returns 1 if ip + needed <= MEMORY_SIZE
@@ -72,294 +372,1559 @@ static int is_valid_address(uint32_t addr) {
     return addr < MEMORY_SIZE;
 }
 
+ // 16-bit address operand k of insn
+static uint32_t operand16(const uint8_t *insn, uint32_t k) {
+    return ((uint32_t)insn[k] << 8) | insn[k + 1];
+}
+
+ // Operands covering more than one byte: BCOPY/BFILL/BCMP work on
+ // [addr, addr + len), the word ops and BANKLEN on [addr, addr + 1]. The
+ // whole range is checked here once instead of byte by byte; BANK needs a
+ // window that exists. insn has all its operands.
+ // Returns 1 for every other opcode
+static int operands_fit(const uint8_t *insn) {
+    switch (insn[0]) {
+        case OP_BFILL:   // dest, len
+            return operand16(insn, 1) + operand16(insn, 3) <= MEMORY_SIZE;
+        case OP_BCOPY:
+        case OP_BCMP:
+            return operand16(insn, 1) + operand16(insn, 5) <= MEMORY_SIZE &&
+                   operand16(insn, 3) + operand16(insn, 5) <= MEMORY_SIZE;
+        case OP_PUSH16_MEM: case OP_POP16_MEM: case OP_BNOT16:
+            return operand16(insn, 1) + 2 <= MEMORY_SIZE;
+        case OP_BANKLEN:   // file, dest
+            return operand16(insn, 2) + 2 <= MEMORY_SIZE;
+        case OP_BANK:      // window, file, page
+            return insn[1] < BANK_WINDOWS;
+        case OP_LT16_CMP: case OP_GT16_CMP:
+            return operand16(insn, 1) + 2 <= MEMORY_SIZE && operand16(insn, 3) + 2 <= MEMORY_SIZE;
+        case OP_BAND16: case OP_BOR16: case OP_BXOR16: case OP_BNAND16:
+            return operand16(insn, 1) + 2 <= MEMORY_SIZE && operand16(insn, 3) + 2 <= MEMORY_SIZE &&
+                   operand16(insn, 5) + 2 <= MEMORY_SIZE;
+        default:
+            return 1;
+    }
+}
+
+ // the word at [addr, addr + 1]; operands_fit() made sure both bytes are there
+static ALWAYS_INLINE uint16_t load_word(const uint8_t *memory, uint32_t addr) {
+    return (uint16_t)((memory[addr] << 8) | memory[addr + 1]);
+}
+
+ // The bytes an instruction stores to: returns the first address and sets
+ // *len, or -1 if it doesn't store. insn has its operands and passed
+ // operands_fit(). A THEN closing a FOR isn't in here, its store depends on the FOR.
+ // BANK counts as a store to its whole window, whose bytes it replaces
+static int32_t store_span(const uint8_t *insn, uint32_t *len) {
+    const uint8_t *p = insn + 1;
+    *len = 1;
+    switch (insn[0]) {
+        case OP_POKE: case OP_NOT: case OP_INC: case OP_DEC: case OP_GETC: case OP_POP:
+            return p[0];
+        case OP_MOVE:
+            return p[1];
+        case OP_NAND: case OP_AND: case OP_OR: case OP_XOR: case OP_CMP:
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_SHL: case OP_SHR:
+            return p[2];
+        case OP_LT16_CMP: case OP_GT16_CMP:
+            return p[4];
+        case OP_BCMP:
+            return p[6];
+        case OP_POKE16:
+            return (int32_t)operand16(insn, 1);
+        case OP_MOVE16:
+            return (int32_t)operand16(insn, 3);
+        case OP_POP16_MEM: case OP_BNOT16:
+            *len = 2;
+            return (int32_t)operand16(insn, 1);
+        case OP_BAND16: case OP_BOR16: case OP_BXOR16: case OP_BNAND16:
+            *len = 2;
+            return (int32_t)operand16(insn, 5);
+        case OP_BCOPY:
+            *len = operand16(insn, 5);
+            return (int32_t)operand16(insn, 3);
+        case OP_BFILL:
+            *len = operand16(insn, 3);
+            return (int32_t)operand16(insn, 1);
+        case OP_BANKLEN:
+            *len = 2;
+            return (int32_t)operand16(insn, 2);
+        case OP_BANK:
+            *len = 1U << BANK_WINDOW_SHIFT;
+            return (int32_t)((uint32_t)insn[1] << BANK_WINDOW_SHIFT);
+        default:
+            return -1;
+    }
+}
+
+ // The next ELSEIF/ELSE/THEN of the same construct after the IF/FOR or clause
+ // at from, skipping nested IF/FOR ... THEN. The code in between has to be
+ // straight instructions; -1 if it runs into anything else or off the end
+static int32_t ctrl_next_clause(const uint8_t *memory, uint32_t from) {
+    uint32_t depth = 0;
+    uint32_t q = from + op_table[memory[from]].length;
+    while (q < MEMORY_SIZE) {
+        uint8_t op = memory[q];
+        uint32_t len = op_table[op].length;
+        if (op == OP_COMMENT && q + 1 < MEMORY_SIZE) len = 2 + memory[q + 1];
+        if (len == 0 || q + len > MEMORY_SIZE) return -1;
+        if (op == OP_IF || op == OP_FOR) {
+            depth++;
+        } else if (op == OP_THEN) {
+            if (depth == 0) return (int32_t)q;
+            depth--;
+        } else if ((op == OP_ELSE || op == OP_ELSEIF) && depth == 0) {
+            return (int32_t)q;
+        }
+        q += len;
+    }
+    return -1;
+}
+
+ // The THEN closing the IF/FOR at opener, after checking the clauses between
+ // are in order (ELSEIFs, then at most one ELSE, none at all in a FOR).
+ // Returns -1 with *bad set to the clause out of place, or to opener if
+ // there is no THEN
+static int32_t ctrl_match(const uint8_t *memory, uint32_t opener, uint32_t *bad) {
+    uint8_t prev = memory[opener];
+    int32_t k = (int32_t)opener;
+    for (;;) {
+        k = ctrl_next_clause(memory, (uint32_t)k);
+        if (k < 0) {
+            *bad = opener;
+            return -1;
+        }
+        uint8_t op = memory[k];
+        if (op == OP_THEN) return k;
+        if (memory[opener] == OP_FOR || prev == OP_ELSE) {
+            *bad = (uint32_t)k;
+            return -1;
+        }
+        prev = op;
+    }
+}
+
+ // The closest IF/FOR before ip that the clause at ip belongs to, -1 if none.
+ // For clauses no IF/FOR has claimed yet, e.g. in a restored snapshot
+static int32_t ctrl_claimant(const uint8_t *memory, uint32_t ip) {
+    for (uint32_t a = ip; a-- > 0;) {
+        if (memory[a] != OP_IF && memory[a] != OP_FOR) continue;
+        int32_t k = ctrl_next_clause(memory, a);
+        while (k >= 0 && (uint32_t)k < ip && memory[k] != OP_THEN) k = ctrl_next_clause(memory, (uint32_t)k);
+        uint32_t bad;
+        if (k == (int32_t)ip && ctrl_match(memory, a, &bad) >= 0) return (int32_t)a;
+    }
+    return -1;
+}
+
+ // BAND16/BOR16/BXOR16/BNAND16 on two words
+static ALWAYS_INLINE uint16_t word_op(uint8_t opcode, uint16_t a, uint16_t b) {
+    switch (opcode) {
+        case OP_BAND16: return a & b;
+        case OP_BOR16:  return a | b;
+        case OP_BXOR16: return a ^ b;
+        default:        return (uint16_t)~(a & b);   // BNAND16
+    }
+}
+
+ // Program output (PUTC/PUTN)
+ // Collected in out_buf and written in one go, when depends on out_mode.
+ // Debug output goes straight to the stream, so debug mode flushes every time.
+ // shred_vm_run() flushes before returning, so it's empty between runs.
+static void out_flush(shred_vm *vm) {
+    if (vm->out_len) {
+        fwrite(vm->out_buf, 1, vm->out_len, vm->out);
+        vm->out_len = 0;
+    }
+    fflush(vm->out);
+}
+
+static void out_write(shred_vm *vm, const char *bytes, uint32_t n) {
+    if (vm->out_len + n > vm->out_cap) out_flush(vm);
+    memcpy(vm->out_buf + vm->out_len, bytes, n);
+    vm->out_len += n;
+    if (vm->out_mode == SHRED_OUTPUT_INTERACTIVE || vm->debug_mode || vm->out_len == vm->out_cap ||
+        (vm->out_mode == SHRED_OUTPUT_LINE && bytes[n - 1] == '\n')) {
+        out_flush(vm);
+    }
+}
+
+static void out_putn(shred_vm *vm, uint8_t value) {
+    char digits[3];
+    uint32_t n = 3;
+    do {
+        digits[--n] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    out_write(vm, digits + n, 3 - n);
+}
+
+ // fault message, after whatever output the program produced before it
+static void vm_error(shred_vm *vm, const char *fmt, ...) {
+    va_list args;
+    out_flush(vm);
+    va_start(args, fmt);
+    vfprintf(vm->err, fmt, args);
+    va_end(args);
+}
+
+ // Program input (GETC)
+ // From the in stream, or from bytes the host feeds in (shred_vm_feed_input).
+ // A fed VM never blocks: a GETC with nothing to read doesn't run, and the
+ // engines return SHRED_WAITING with ip still on it.
+static ALWAYS_INLINE int input_waits(const shred_vm *vm) {
+    return vm->in_fed && vm->in_next == vm->in_end && !vm->in_closed;
+}
+
+ // the byte GETC stores, 0 at end of input; input_waits() was checked first
+static uint8_t in_getc(shred_vm *vm) {
+    if (vm->in_fed) return (vm->in_next < vm->in_end) ? *vm->in_next++ : 0;
+    out_flush(vm);   // prompts have to be visible before we block
+    int ch = vm->in ? getc(vm->in) : EOF;
+    return (ch == EOF) ? 0 : (uint8_t)ch;
+}
+
  // Stack Operations
- static int push_stack(uint16_t return_addr) {
-    if (stack_pointer >= STACK_SIZE) {
-        fprintf(stderr, "CPU Fault: Stack overflow (max depth: %u) at instruction %u\n",
-                (unsigned)STACK_SIZE, (unsigned)instruction_count);
+ static int push_stack(shred_vm *vm, uint16_t return_addr) {
+    if (vm->stack_pointer >= STACK_SIZE) {
+        vm_error(vm, "CPU Fault: Stack overflow (max depth: %u) at instruction %llu\n",
+                (unsigned)STACK_SIZE, (unsigned long long)vm->instruction_count);
         return 0;
     }
-    call_stack[stack_pointer++] = return_addr;
-    if (trace_mode) {
-        printf("  [STACK] Push 0x%04X (SP=%u)\n", return_addr, (unsigned)stack_pointer);
+    vm->call_stack[vm->stack_pointer++] = return_addr;
+    if (vm->trace_mode) {
+        fprintf(vm->out, "  [STACK] Push 0x%04X (SP=%u)\n", return_addr, (unsigned)vm->stack_pointer);
     }
     return 1;
 }
 
-static int pop_stack(uint16_t *out_addr) {
-    if (stack_pointer == 0) {
-        fprintf(stderr, "CPU Fault: Stack underflow at instruction %u\n",
-                (unsigned)instruction_count);
+static int push_data(shred_vm *vm, uint16_t value) {
+    if (vm->data_pointer >= DATA_STACK_SIZE) {
+        vm_error(vm, "CPU Fault: Data stack overflow (max depth: %u) at instruction %llu\n",
+                (unsigned)DATA_STACK_SIZE, (unsigned long long)vm->instruction_count);
         return 0;
     }
-    *out_addr = call_stack[--stack_pointer];
-    if (trace_mode) {
-        printf("  [STACK] Pop 0x%04X (SP=%u)\n", *out_addr, (unsigned)stack_pointer);
+    vm->data_stack[vm->data_pointer++] = value;
+    if (vm->trace_mode) {
+        fprintf(vm->out, "  [DATA] Push 0x%04X (DSP=%u)\n", value, (unsigned)vm->data_pointer);
     }
     return 1;
 }
 
- // Load Program from .shred file
- // Returns 0 on success, -1 on error
-static int load_program(const char *filename) {
-    if (!filename || strlen(filename) >= MAX_FILENAME_LEN) {
-        fprintf(stderr, "Error: Invalid filename\n");
-        return -1;
+static int pop_data(shred_vm *vm, uint16_t *out_value) {
+    if (vm->data_pointer == 0) {
+        vm_error(vm, "CPU Fault: Data stack underflow at instruction %llu\n",
+                (unsigned long long)vm->instruction_count);
+        return 0;
+    }
+    *out_value = vm->data_stack[--vm->data_pointer];
+    if (vm->trace_mode) {
+        fprintf(vm->out, "  [DATA] Pop 0x%04X (DSP=%u)\n", *out_value, (unsigned)vm->data_pointer);
     }
+    return 1;
+}
 
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        fprintf(stderr, "Error: Cannot open file '%s'\n", filename);
-        perror("fopen");
+static int pop_stack(shred_vm *vm, uint16_t *out_addr) {
+    if (vm->stack_pointer == 0) {
+        vm_error(vm, "CPU Fault: Stack underflow at instruction %llu\n",
+                (unsigned long long)vm->instruction_count);
+        return 0;
+    }
+    *out_addr = vm->call_stack[--vm->stack_pointer];
+    if (vm->trace_mode) {
+        fprintf(vm->out, "  [STACK] Pop 0x%04X (SP=%u)\n", *out_addr, (unsigned)vm->stack_pointer);
+    }
+    return 1;
+}
+
+ // Execution profile
+ // Plain counters indexed by address, bumped once per instruction from the
+ // engines' dispatch and only formatted when someone asks for the report.
+ // The per-instruction part is one increment and two checks; block lengths
+ // come from the instruction count when a block ends, and per-opcode totals
+ // from the per-address hits (split up only if code overwrites an opcode).
+ // A block is a straight run of instructions starting after a jump, call or
+ // return, so a loop body shows up as one block entered once per iteration.
+#define PROFILE_NO_FRAME  0xFFFFFFFFU   // call stack slot the profile didn't see pushed
+
+typedef struct {
+    uint64_t hits;            // instructions run at this address
+    uint64_t taken;           // JZ/JZ16 here that jumped
+    uint64_t block_entries;   // blocks starting here
+    uint64_t block_insns;     // instructions run in them
+} profile_slot;
+
+struct exec_profile {
+    profile_slot slots[MEMORY_SIZE];
+    uint8_t  opcode_at[MEMORY_SIZE];      // last opcode run at each address
+    uint64_t op_counted[MEMORY_SIZE];     // hits already added to ops[]
+    uint64_t ops[256];                    // per opcode, for hits from before code changed
+    uint64_t calls[MEMORY_SIZE];          // RUN/RUN16 to each target
+    uint64_t inclusive[MEMORY_SIZE];      // instructions from those calls up to their return
+    uint32_t frame_target[STACK_SIZE];    // call target per call stack slot
+    uint64_t frame_start[STACK_SIZE];     // instruction count at that call
+    uint32_t block;                       // start of the block running now
+    uint64_t block_base;                  // instruction count before it, or before this run
+    int      new_block;                   // the last instruction transferred control
+};
+
+ // what profile_insn() does after each opcode that ends a block
+#define FLOW_JUMP   1   // JMP, JMP16, COMMENT, IF/ELSEIF/ELSE/THEN/FOR
+#define FLOW_JZ     2   // JZ, condition address at ip + 2
+#define FLOW_JZ16   3   // JZ16, condition address at ip + 3
+#define FLOW_CALL   4   // RUN, RUN16, HALT, RET
+static const uint8_t profile_flow[256] = {
+    [OP_JMP] = FLOW_JUMP, [OP_JMP16] = FLOW_JUMP, [OP_COMMENT] = FLOW_JUMP,
+    [OP_JZ] = FLOW_JZ, [OP_JZ16] = FLOW_JZ16,
+    [OP_RUN] = FLOW_CALL, [OP_RUN16] = FLOW_CALL, [OP_HALT] = FLOW_CALL, [OP_RET] = FLOW_CALL,
+    [OP_IF] = FLOW_JUMP, [OP_THEN] = FLOW_JUMP, [OP_ELSE] = FLOW_JUMP, [OP_ELSEIF] = FLOW_JUMP,
+    [OP_FOR] = FLOW_JUMP,
+};
+
+ // the VM's instruction count jumped to count (enabled, reset, restored);
+ // calls already on its stack weren't seen, so they aren't timed
+static void profile_restart(exec_profile *p, uint64_t count) {
+    for (uint32_t i = 0; i < STACK_SIZE; i++) p->frame_target[i] = PROFILE_NO_FRAME;
+    p->block_base = count;
+    p->new_block = 1;
+}
+
+ // instructions up to count belong to the current block
+static ALWAYS_INLINE void profile_close_block(exec_profile *p, uint64_t count) {
+    p->slots[p->block].block_insns += count - p->block_base;
+    p->block_base = count;
+}
+
+ // code at ip changed since it last ran: book its hits so far to the old opcode
+static void profile_new_opcode(exec_profile *p, uint32_t ip, uint8_t opcode) {
+    p->ops[p->opcode_at[ip]] += p->slots[ip].hits - p->op_counted[ip];
+    p->op_counted[ip] = p->slots[ip].hits;
+    p->opcode_at[ip] = opcode;
+}
+
+ // the call or return at ip is about to run
+static void profile_call(exec_profile *p, const uint8_t *memory, uint32_t ip, uint32_t sp, uint64_t count) {
+    uint8_t opcode = memory[ip];
+    if (opcode == OP_RUN || opcode == OP_RUN16) {
+        if (!ensure_operands(ip, op_table[opcode].length)) return;   // it's about to fault
+        uint32_t target = (opcode == OP_RUN) ? memory[ip + 1]
+                                             : ((uint32_t)memory[ip + 1] << 8) | memory[ip + 2];
+        p->calls[target]++;
+        if (sp < STACK_SIZE) {
+            p->frame_target[sp] = target;
+            p->frame_start[sp] = count;
+        }
+    } else if (sp > 0 && p->frame_target[sp - 1] != PROFILE_NO_FRAME) {
+        p->inclusive[p->frame_target[sp - 1]] += count - p->frame_start[sp - 1];
+        p->frame_target[sp - 1] = PROFILE_NO_FRAME;
+    }
+}
+
+ // count the instruction at ip (opcode memory[ip]) before it runs; count
+ // already includes it. The threaded handlers pass a constant opcode, so each
+ // one only keeps the parts that apply to it.
+static ALWAYS_INLINE void profile_insn(exec_profile *p, const uint8_t *memory, uint32_t ip, uint8_t opcode,
+                                       uint32_t sp, uint64_t count) {
+    if (p->opcode_at[ip] != opcode) profile_new_opcode(p, ip, opcode);
+    p->slots[ip].hits++;
+    if (p->new_block) {
+        p->new_block = 0;
+        p->block = ip;
+        p->slots[ip].block_entries++;
+    }
+
+    uint8_t flow = profile_flow[opcode];
+    if (!flow) return;
+    profile_close_block(p, count);
+    p->new_block = 1;
+    if (flow == FLOW_CALL) {
+        profile_call(p, memory, ip, sp, count);
+    } else if (flow != FLOW_JUMP) {
+        uint32_t cond = ip + ((flow == FLOW_JZ) ? 2 : 3);
+        if (cond < MEMORY_SIZE && memory[memory[cond]] == 0) p->slots[ip].taken++;
+    }
+}
+
+ // Performance counters
+ // Where the time goes, per opcode and per RUN/RUN16 target. perf_event_open
+ // counts cycles, branch misses and L1 data cache read misses for the thread
+ // running the VM, and every perf_period[] events the kernel sends SIGPROF;
+ // the handler books that many events to the opcode the engine said it was
+ // running and to the call target it's in. The engines only store the opcode
+ // (through the same hooks as profiling), so dispatch keeps its usual branch
+ // pattern and the counts are samples, not exact. Without a PMU (containers,
+ // most VMs) the same sampling runs on the kernel's task clock in
+ // nanoseconds, and where perf_event_open isn't allowed at all on an
+ // ITIMER_PROF timer.
+#define PERF_EVENTS         3
+#define PERF_CYCLES         0   // or nanoseconds of CPU time, see perf_source
+#define PERF_BRANCH_MISSES  1
+#define PERF_L1D_MISSES     2
+#define PERF_OUTSIDE        MEMORY_SIZE   // self[] slot for code not inside any call
+
+#define PERF_SOURCE_PMU     0   // hardware counters
+#define PERF_SOURCE_CLOCK   1   // perf_event_open task clock, ns
+#define PERF_SOURCE_TIMER   2   // setitimer(ITIMER_PROF), ns
+
+#define PERF_CLOCK_PERIOD   100000U    // ns between samples on the task clock
+#define PERF_TIMER_PERIOD   1000U      // us between ITIMER_PROF samples (the kernel rounds up to its tick)
+
+#if HAVE_PERF
+static const struct {
+    uint32_t type;
+    uint64_t config;
+    uint64_t period;
+} perf_pmu_events[PERF_EVENTS] = {
+    [PERF_CYCLES]        = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 200003 },
+    [PERF_BRANCH_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, 20011 },
+    [PERF_L1D_MISSES]    = { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), 20011 },
+};
+
+struct exec_perf {
+    volatile uint8_t  opcode;                  // running now, read by the signal handler
+    volatile uint32_t depth;                   // call stack slots frames[] covers
+    volatile uint32_t frames[STACK_SIZE];      // RUN/RUN16 target per call stack slot
+    uint64_t executed[256];                    // instructions per opcode while counting
+    uint64_t calls[MEMORY_SIZE];               // RUN/RUN16 to each target
+    uint64_t by_opcode[PERF_EVENTS][256];      // events booked to each opcode
+    uint64_t self[PERF_EVENTS][MEMORY_SIZE + 1]; // to the innermost call target, or PERF_OUTSIDE
+    uint64_t inclusive[MEMORY_SIZE];           // PERF_CYCLES to every target on the call stack
+    uint32_t seen[MEMORY_SIZE];                // sample that last added to inclusive[]
+    uint32_t samples;
+    int      source;                           // PERF_SOURCE_*
+    int      fd[PERF_EVENTS];                  // -1 where the event isn't there
+    uint64_t period[PERF_EVENTS];
+    uint64_t timer_ns;                         // PERF_SOURCE_TIMER: CPU time while counting
+    struct timespec timer_start, timer_last;   // this run's start, the last sample
+    struct sigaction old_action;
+};
+
+static exec_perf *perf_owner;                  // counters are per process, one VM has them
+static exec_perf *volatile perf_running;       // perf_owner while shred_vm_run() is in an engine
+
+ // the VM's call stack changed under the hooks (reset, restore)
+static void perf_restart(exec_perf *p, uint32_t sp) {
+    for (uint32_t i = 0; i < STACK_SIZE; i++) p->frames[i] = PROFILE_NO_FRAME;
+    p->depth = sp;
+}
+
+ // the call or return at ip is about to run
+static void perf_call(exec_perf *p, const uint8_t *memory, uint32_t ip, uint8_t opcode, uint32_t sp) {
+    if (opcode == OP_RUN || opcode == OP_RUN16) {
+        if (!ensure_operands(ip, op_table[opcode].length) || sp >= STACK_SIZE) return;   // it's about to fault
+        uint32_t target = (opcode == OP_RUN) ? memory[ip + 1]
+                                             : ((uint32_t)memory[ip + 1] << 8) | memory[ip + 2];
+        p->calls[target]++;
+        p->frames[sp] = target;
+        p->depth = sp + 1;
+    } else if (sp > 0) {
+        p->depth = sp - 1;
+    }
+}
+
+ // the instruction at ip is about to run
+static ALWAYS_INLINE void perf_insn(exec_perf *p, const uint8_t *memory, uint32_t ip, uint8_t opcode, uint32_t sp) {
+    p->executed[opcode]++;
+    p->opcode = opcode;
+    if (profile_flow[opcode] == FLOW_CALL) perf_call(p, memory, ip, opcode, sp);
+}
+
+static uint64_t perf_elapsed_ns(const struct timespec *from, const struct timespec *to) {
+    return (uint64_t)(to->tv_sec - from->tv_sec) * 1000000000ULL + (uint64_t)to->tv_nsec - (uint64_t)from->tv_nsec;
+}
+
+ // SIGPROF: a counter passed its period, or the profiling timer went off
+static void perf_signal(int sig, siginfo_t *info, void *context) {
+    exec_perf *p = perf_running;
+    uint32_t e = PERF_CYCLES;
+    (void)sig;
+    (void)context;
+    uint64_t n;
+    if (!p) return;
+    if (p->source == PERF_SOURCE_TIMER) {
+        // the timer fires on the kernel's tick, so book the CPU time since the last one
+        struct timespec now;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+        n = perf_elapsed_ns(&p->timer_last, &now);
+        p->timer_last = now;
+    } else {
+        while (e < PERF_EVENTS && p->fd[e] != info->si_fd) e++;
+        if (e == PERF_EVENTS) return;
+        ioctl(p->fd[e], PERF_EVENT_IOC_REFRESH, 1);   // good for one more overflow
+        n = p->period[e];
+    }
+
+    uint32_t depth = p->depth < STACK_SIZE ? p->depth : STACK_SIZE;
+    uint32_t target = depth ? p->frames[depth - 1] : PERF_OUTSIDE;
+    p->by_opcode[e][p->opcode] += n;
+    if (target != PROFILE_NO_FRAME) p->self[e][target] += n;
+    if (e != PERF_CYCLES) return;
+
+    // once per target, however deep it recursed
+    uint32_t sample = ++p->samples;
+    for (uint32_t i = 0; i < depth; i++) {
+        uint32_t t = p->frames[i];
+        if (t == PROFILE_NO_FRAME || p->seen[t] == sample) continue;
+        p->seen[t] = sample;
+        p->inclusive[t] += n;
+    }
+}
+
+static int perf_open_event(uint32_t type, uint64_t config, uint64_t period) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.sample_period = period;
+    attr.wakeup_events = 1;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0) return -1;
+    struct f_owner_ex owner = { F_OWNER_TID, (pid_t)syscall(SYS_gettid) };
+    if (fcntl(fd, F_SETFL, O_ASYNC) != 0 || fcntl(fd, F_SETSIG, SIGPROF) != 0 ||
+        fcntl(fd, F_SETOWN_EX, &owner) != 0) {
+        close(fd);
         return -1;
     }
+    return fd;
+}
+
+ // what an event counted while enabled, scaled up if the PMU was shared
+static uint64_t perf_total(const exec_perf *p, uint32_t e) {
+    if (p->source == PERF_SOURCE_TIMER) return e == PERF_CYCLES ? p->timer_ns : 0;
+    uint64_t v[3];
+    if (p->fd[e] < 0 || read(p->fd[e], v, sizeof(v)) != (ssize_t)sizeof(v)) return 0;
+    if (v[2] && v[2] < v[1]) return (uint64_t)((double)v[0] * (double)v[1] / (double)v[2]);
+    return v[0];
+}
+
+static void perf_close(exec_perf *p) {
+    if (!p) return;
+    for (uint32_t e = 0; e < PERF_EVENTS; e++) {
+        if (p->fd[e] >= 0) close(p->fd[e]);
+    }
+    sigaction(SIGPROF, &p->old_action, NULL);
+    if (perf_owner == p) perf_owner = NULL;
+    free(p);
+}
+
+static exec_perf *perf_open(FILE *err) {
+    if (perf_owner) {
+        fprintf(err, "Error: Another VM in this process has the performance counters\n");
+        return NULL;
+    }
+    exec_perf *p = calloc(1, sizeof(exec_perf));
+    if (!p) {
+        fprintf(err, "Error: Out of memory for the performance counters\n");
+        return NULL;
+    }
+    for (uint32_t e = 0; e < PERF_EVENTS; e++) p->fd[e] = -1;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = perf_signal;
+    action.sa_flags = SA_SIGINFO | SA_RESTART;   // the VM's own reads and writes carry on
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, &p->old_action) != 0) {
+        fprintf(err, "Error: Cannot catch SIGPROF: %s\n", strerror(errno));
+        free(p);
+        return NULL;
+    }
+
+    // the PMU if there's one (the miss counters are optional), else the task clock, else a timer
+    p->source = PERF_SOURCE_PMU;
+    for (uint32_t e = 0; e < PERF_EVENTS; e++) {
+        p->period[e] = perf_pmu_events[e].period;
+        p->fd[e] = perf_open_event(perf_pmu_events[e].type, perf_pmu_events[e].config, p->period[e]);
+        if (e == PERF_CYCLES && p->fd[e] < 0) break;
+    }
+    if (p->fd[PERF_CYCLES] < 0) {
+        p->source = PERF_SOURCE_CLOCK;
+        p->period[PERF_CYCLES] = PERF_CLOCK_PERIOD;
+        p->fd[PERF_CYCLES] = perf_open_event(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, PERF_CLOCK_PERIOD);
+    }
+    if (p->fd[PERF_CYCLES] < 0) {
+        p->source = PERF_SOURCE_TIMER;
+        p->period[PERF_CYCLES] = PERF_TIMER_PERIOD * 1000ULL;
+    }
+    perf_owner = p;
+    return p;
+}
+
+ // counting only while an engine runs, not while the host does its own thing
+static void perf_start(exec_perf *p, uint32_t sp) {
+    p->depth = sp;
+    perf_running = p;
+    if (p->source == PERF_SOURCE_TIMER) {
+        struct itimerval timer = { { 0, PERF_TIMER_PERIOD }, { 0, PERF_TIMER_PERIOD } };
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &p->timer_start);
+        p->timer_last = p->timer_start;
+        setitimer(ITIMER_PROF, &timer, NULL);
+        return;
+    }
+    for (uint32_t e = 0; e < PERF_EVENTS; e++) {
+        if (p->fd[e] >= 0) ioctl(p->fd[e], PERF_EVENT_IOC_REFRESH, 1);
+    }
+}
+
+static void perf_stop(exec_perf *p) {
+    if (p->source == PERF_SOURCE_TIMER) {
+        struct itimerval off;
+        struct timespec now;
+        memset(&off, 0, sizeof(off));
+        setitimer(ITIMER_PROF, &off, NULL);
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+        p->timer_ns += perf_elapsed_ns(&p->timer_start, &now);
+    } else {
+        for (uint32_t e = 0; e < PERF_EVENTS; e++) {
+            if (p->fd[e] >= 0) ioctl(p->fd[e], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+    perf_running = NULL;
+}
+#else
+static void perf_restart(exec_perf *p, uint32_t sp) { (void)p; (void)sp; }
+static ALWAYS_INLINE void perf_insn(exec_perf *p, const uint8_t *memory, uint32_t ip, uint8_t opcode, uint32_t sp) {
+    (void)p; (void)memory; (void)ip; (void)opcode; (void)sp;
+}
+static void perf_close(exec_perf *p) { (void)p; }
+static void perf_start(exec_perf *p, uint32_t sp) { (void)p; (void)sp; }
+static void perf_stop(exec_perf *p) { (void)p; }
+#endif
+
+ // Hex digit value + 1, 0 for anything else
+static const uint8_t hex_digit[256] = {
+    ['0'] = 1,  ['1'] = 2,  ['2'] = 3,  ['3'] = 4,  ['4'] = 5,
+    ['5'] = 6,  ['6'] = 7,  ['7'] = 8,  ['8'] = 9,  ['9'] = 10,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+};
 
-    memset(memory, 0, MEMORY_SIZE);
+#if HAVE_SIMD_HEX
+ // Classify HEX_BLOCK characters: bit n of each mask is character n.
+ // nib[] gets every character's nibble value (only meaningful for hex digits)
+#ifdef __AVX2__
+typedef __m256i hex_vec;
+#define HV_LOAD(p)      _mm256_loadu_si256((const __m256i *)(p))
+#define HV_SET1(c)      _mm256_set1_epi8((char)(c))
+#define HV_EQ(a, b)     _mm256_cmpeq_epi8(a, b)
+#define HV_GT(a, b)     _mm256_cmpgt_epi8(a, b)
+#define HV_AND(a, b)    _mm256_and_si256(a, b)
+#define HV_OR(a, b)     _mm256_or_si256(a, b)
+#define HV_ADD(a, b)    _mm256_add_epi8(a, b)
+#define HV_MASK(a)      ((uint32_t)_mm256_movemask_epi8(a))
+#define HV_STORE(p, a)  _mm256_storeu_si256((__m256i *)(p), a)
+#else
+typedef __m128i hex_vec;
+#define HV_LOAD(p)      _mm_loadu_si128((const __m128i *)(p))
+#define HV_SET1(c)      _mm_set1_epi8((char)(c))
+#define HV_EQ(a, b)     _mm_cmpeq_epi8(a, b)
+#define HV_GT(a, b)     _mm_cmpgt_epi8(a, b)
+#define HV_AND(a, b)    _mm_and_si128(a, b)
+#define HV_OR(a, b)     _mm_or_si128(a, b)
+#define HV_ADD(a, b)    _mm_add_epi8(a, b)
+#define HV_MASK(a)      ((uint32_t)_mm_movemask_epi8(a))
+#define HV_STORE(p, a)  _mm_storeu_si128((__m128i *)(p), a)
+#endif
 
+ // signed compares are fine here: bytes >= 0x80 come out negative and
+ // fail every range test, same as isxdigit/isspace in the C locale
+static inline hex_vec hex_classify(const char *text, uint32_t *hex, uint32_t *space, uint32_t *newline) {
+    hex_vec v = HV_LOAD(text);
+    hex_vec lower = HV_OR(v, HV_SET1(0x20));
+    hex_vec digit = HV_AND(HV_GT(v, HV_SET1('0' - 1)), HV_GT(HV_SET1('9' + 1), v));
+    hex_vec alpha = HV_AND(HV_GT(lower, HV_SET1('a' - 1)), HV_GT(HV_SET1('f' + 1), lower));
+    hex_vec ctrl = HV_AND(HV_GT(v, HV_SET1('\t' - 1)), HV_GT(HV_SET1('\r' + 1), v));
+    hex_vec nl = HV_EQ(v, HV_SET1('\n'));
+    *hex = HV_MASK(HV_OR(digit, alpha));
+    *space = HV_MASK(HV_OR(ctrl, HV_EQ(v, HV_SET1(' '))));
+    *newline = HV_MASK(nl);
+    // '0'-'9' -> low nibble, 'A'-'F'/'a'-'f' -> low nibble + 9
+    return HV_ADD(HV_AND(v, HV_SET1(0x0F)), HV_AND(HV_GT(v, HV_SET1(0x40)), HV_SET1(9)));
+}
+
+ // HEX_BLOCK nibbles -> HEX_BLOCK/2 bytes, high nibble first
+static inline void hex_pack(hex_vec nib, uint8_t *dst) {
+#ifdef __AVX2__
+    __m256i r = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(nib, _mm256_set1_epi16(0x00FF)), 4),
+                                _mm256_srli_epi16(nib, 8));
+    r = _mm256_permute4x64_epi64(_mm256_packus_epi16(r, r), 0xD8);
+    _mm_storeu_si128((__m128i *)dst, _mm256_castsi256_si128(r));
+#else
+    __m128i r = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(nib, _mm_set1_epi16(0x00FF)), 4),
+                             _mm_srli_epi16(nib, 8));
+    _mm_storel_epi64((__m128i *)dst, _mm_packus_epi16(r, r));
+#endif
+}
+#endif
+
+ // Parse .shred hex text into memory, starting at address 0
+ // Returns the number of bytes loaded, or -1 on error
+static int32_t parse_program(shred_vm *vm, const char *text, size_t len) {
+    uint8_t *memory = vm->memory;
     uint32_t addr = 0;
-    int ch;
-    int in_comment = 0;
-    char hex_buf[3] = {0};
-    int hex_pos = 0;
+    int high = -1;              // first digit of a byte still waiting for its second
     uint32_t line = 1, col = 0;
+    size_t i = 0;
 
-    while ((ch = fgetc(file)) != EOF) {
+    while (i < len) {
+#if HAVE_SIMD_HEX
+        // Fast path: a block with only hex digits and whitespace
+        if (len - i >= HEX_BLOCK) {
+            uint32_t hex, space, newline;
+            const uint32_t full = (uint32_t)(((uint64_t)1 << HEX_BLOCK) - 1);
+            hex_vec nib = hex_classify(text + i, &hex, &space, &newline);
+
+            if (hex == full && high < 0 && MEMORY_SIZE - addr >= HEX_BLOCK / 2) {
+                hex_pack(nib, memory + addr);
+                addr += HEX_BLOCK / 2;
+                col += HEX_BLOCK;
+                i += HEX_BLOCK;
+                continue;
+            }
+
+            uint32_t plain = hex | space;
+            uint32_t run = (plain == full) ? HEX_BLOCK : (uint32_t)__builtin_ctz(~plain);
+            if (run > 0) {
+                uint8_t nibbles[HEX_BLOCK];
+                uint32_t in_run = (uint32_t)(((uint64_t)1 << run) - 1);
+                HV_STORE(nibbles, nib);
+                for (uint32_t m = hex & in_run; m; m &= m - 1) {
+                    uint8_t value = nibbles[__builtin_ctz(m)];
+                    if (high < 0) {
+                        high = value;
+                        continue;
+                    }
+                    if (addr >= MEMORY_SIZE) {
+                        fprintf(vm->err, "Warning: Memory full at %u bytes, truncating\n",
+                                (unsigned)MEMORY_SIZE);
+                        return (int32_t)addr;
+                    }
+                    memory[addr++] = (uint8_t)((high << 4) | value);
+                    high = -1;
+                }
+                newline &= in_run;
+                if (newline) {
+                    line += (uint32_t)__builtin_popcount(newline);
+                    col = run - 1 - (31U - (uint32_t)__builtin_clz(newline));
+                } else {
+                    col += run;
+                }
+                i += run;
+                continue;
+            }
+            // a comment or a bad character, the scalar code below deals with it
+        }
+#endif
+        int ch = (unsigned char)text[i++];
         col++;
 
         // Handle comments 
         if (ch == ';' || ch == '#') {
-            in_comment = 1;
+            const char *end = memchr(text + i, '\n', len - i);
+            if (!end) break;
+            i = (size_t)(end - text);   // the newline itself is counted next time round
             continue;
         }
         if (ch == '\n') {
-            in_comment = 0;
             line++;
             col = 0;
             continue;
         }
-        if (in_comment) continue;
 
         // skip whitespace
-        if (isspace((unsigned char)ch)) continue;
+        if (isspace(ch)) continue;
 
         // process hex digits
-        if (isxdigit((unsigned char)ch)) {
-            hex_buf[hex_pos++] = (char)ch;
-
-            if (hex_pos == 2) {
-                hex_buf[2] = '\0';
-                unsigned int byte_val = 0;
-                if (sscanf(hex_buf, "%x", &byte_val) != 1 || byte_val > 0xFF) {
-                    fprintf(stderr, "Error: Invalid hex '%s' at line %u, col %u\n",
-                            hex_buf, (unsigned)line, (unsigned)col);
-                    fclose(file);
-                    return -1;
-                }
-                if (addr >= MEMORY_SIZE) {
-                    fprintf(stderr, "Warning: Memory full at %u bytes, truncating\n",
-                            (unsigned)MEMORY_SIZE);
-                    break;
-                }
-                memory[addr++] = (uint8_t)byte_val;
-                hex_pos = 0;
+        if (hex_digit[ch]) {
+            int value = hex_digit[ch] - 1;
+            if (high < 0) {
+                high = value;
+                continue;
             }
+            if (addr >= MEMORY_SIZE) {
+                fprintf(vm->err, "Warning: Memory full at %u bytes, truncating\n",
+                        (unsigned)MEMORY_SIZE);
+                return (int32_t)addr;
+            }
+            memory[addr++] = (uint8_t)((high << 4) | value);
+            high = -1;
         } else {
-            fprintf(stderr, "Error: Invalid character 0x%02X at line %u, col %u\n",
-                    (unsigned char)ch, (unsigned)line, (unsigned)col);
-            fclose(file);
+            fprintf(vm->err, "Error: Invalid character 0x%02X at line %u, col %u\n",
+                    (unsigned)ch, (unsigned)line, (unsigned)col);
             return -1;
         }
     }
 
-    fclose(file);
+    if (high >= 0) {
+        fprintf(vm->err, "Error: Incomplete hex byte at end of file\n");
+        return -1;
+    }
+
+    return (int32_t)addr;
+}
+
+ // Whole file as one block of text: mapped if it's a regular file, read
+ // into a malloc'd buffer otherwise (pipes, or no mmap). NULL if out of memory
+static char *slurp_file(FILE *file, size_t *len, int *mapped) {
+    *mapped = 0;
+#if HAVE_MMAP
+    struct stat st;
+    if (fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+        (uint64_t)st.st_size <= SIZE_MAX) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+        if (map != MAP_FAILED) {
+            madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+            *len = (size_t)st.st_size;
+            *mapped = 1;
+            return map;
+        }
+    }
+#endif
+
+    size_t cap = 4096, got;
+    char *text = malloc(cap);
+    *len = 0;
+    while (text && (got = fread(text + *len, 1, cap - *len, file)) > 0) {
+        *len += got;
+        if (*len == cap) {
+            char *bigger = realloc(text, cap * 2);
+            if (!bigger) {
+                free(text);
+                return NULL;
+            }
+            text = bigger;
+            cap *= 2;
+        }
+    }
+    return text;
+}
+
+static void release_file(char *text, size_t len, int mapped) {
+#if HAVE_MMAP
+    if (mapped) {
+        munmap(text, len);
+        return;
+    }
+#endif
+    (void)len;
+    (void)mapped;
+    free(text);
+}
+
+ // FNV-1a, the .shbin and snapshot checksum; start with FNV_SEED, and pass
+ // the result back in to continue over another piece
+#define FNV_SEED  2166136261U
+static uint32_t fnv1a(uint32_t hash, const uint8_t *bytes, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        hash = (hash ^ bytes[i]) * 16777619U;
+    }
+    return hash;
+}
+
+static uint32_t get_le16(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8);
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+    return get_le16(p) | (get_le16(p + 2) << 16);
+}
+
+static void put_le16(uint8_t *p, uint32_t value) {
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+}
+
+static void put_le32(uint8_t *p, uint32_t value) {
+    put_le16(p, value);
+    put_le16(p + 2, value >> 16);
+}
+
+static uint64_t get_le64(const uint8_t *p) {
+    return (uint64_t)get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
 
-    if (hex_pos != 0) {
-        fprintf(stderr, "Error: Incomplete hex byte at end of file\n");
+static void put_le64(uint8_t *p, uint64_t value) {
+    put_le32(p, (uint32_t)value);
+    put_le32(p + 4, (uint32_t)(value >> 32));
+}
+
+static int is_shbin(const char *data, size_t len) {
+    return len >= 4 && memcmp(data, SHBIN_MAGIC, 4) == 0;
+}
+
+static int fixed_code_image(const uint8_t *memory, uint32_t entry, uint32_t image_len);
+
+ // Check a .shbin image and copy it into memory
+ // Returns the number of bytes loaded, or -1 on error
+static int32_t parse_shbin(shred_vm *vm, const uint8_t *data, size_t len, const char *source) {
+    if (len < SHBIN_HEADER_LEN) {
+        fprintf(vm->err, "Error: '%s' is too short for a .shbin header\n", source);
+        return -1;
+    }
+    if (data[4] != SHBIN_VERSION) {
+        fprintf(vm->err, "Error: '%s' is .shbin version %u, this build reads version %u\n",
+                source, (unsigned)data[4], (unsigned)SHBIN_VERSION);
+        return -1;
+    }
+    if (data[5] & ~SHBIN_FIXED_CODE) {
+        fprintf(vm->err, "Error: '%s' uses unknown .shbin flags 0x%02X\n", source, (unsigned)data[5]);
         return -1;
     }
 
-    if (debug_mode) {
-        printf("Loaded %u bytes (0x%04X) from '%s'\n", (unsigned)addr, (unsigned)addr, filename);
+    uint32_t entry = get_le16(data + 6);
+    uint32_t length = get_le32(data + 8);
+    if (length > MEMORY_SIZE || length != len - SHBIN_HEADER_LEN) {
+        fprintf(vm->err, "Error: '%s' has a bad image length (%lu)\n", source, (unsigned long)length);
+        return -1;
+    }
+    if (fnv1a(FNV_SEED, data + SHBIN_HEADER_LEN, length) != get_le32(data + 12)) {
+        fprintf(vm->err, "Error: '%s' failed its checksum, the file is damaged\n", source);
+        return -1;
     }
 
+    memcpy(vm->memory, data + SHBIN_HEADER_LEN, length);
+    vm->entry = entry;
+    vm->ip = entry;
+    // the flag is only a hint: the header isn't checksummed, and a file
+    // marked by hand would let stores skip the self-modification checks
+    vm->fixed_code = (data[5] & SHBIN_FIXED_CODE) && fixed_code_image(vm->memory, entry, length);
+    return (int32_t)length;
+}
+
+ // Write memory[0..image_len) as a .shbin image
+ // Returns 0 on success, -1 on error
+static int save_shbin(const shred_vm *vm, const char *filename) {
+    uint8_t header[SHBIN_HEADER_LEN];
+    memcpy(header, SHBIN_MAGIC, 4);
+    header[4] = SHBIN_VERSION;
+    header[5] = fixed_code_image(vm->memory, vm->entry, vm->image_len) ? SHBIN_FIXED_CODE : 0;
+    put_le16(header + 6, vm->entry);
+    put_le32(header + 8, vm->image_len);
+    put_le32(header + 12, fnv1a(FNV_SEED, vm->memory, vm->image_len));
+
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        fprintf(vm->err, "Error: Cannot open '%s' for writing\n", filename);
+        fprintf(vm->err, "fopen: %s\n", strerror(errno));
+        return -1;
+    }
+    int ok = fwrite(header, 1, SHBIN_HEADER_LEN, file) == SHBIN_HEADER_LEN &&
+             fwrite(vm->memory, 1, vm->image_len, file) == vm->image_len;
+    if (fclose(file) != 0) ok = 0;
+    if (!ok) {
+        fprintf(vm->err, "Error: Failed writing '%s': %s\n", filename, strerror(errno));
+        return -1;
+    }
     return 0;
 }
 
- // debug: print current instruction n stuf
-static void debug_instruction(uint32_t ip, uint8_t opcode) {
-    if (!debug_mode && !trace_mode) return;
-    if (ip >= MEMORY_SIZE) {
-        printf("[%04X] <OUT OF BOUNDS>\n", (unsigned)ip);
-        return;
+ // Load Program from a .shred or .shbin file (told apart by the magic)
+ // Returns 0 on success, -1 on error
+static int load_program(shred_vm *vm, const char *filename) {
+    if (!filename || strlen(filename) >= MAX_FILENAME_LEN) {
+        fprintf(vm->err, "Error: Invalid filename\n");
+        return -1;
+    }
+
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        fprintf(vm->err, "Error: Cannot open file '%s'\n", filename);
+        fprintf(vm->err, "fopen: %s\n", strerror(errno));
+        return -1;
+    }
+
+    size_t len;
+    int mapped;
+    char *text = slurp_file(file, &len, &mapped);
+    fclose(file);
+    if (!text) {
+        fprintf(vm->err, "Error: Out of memory reading '%s'\n", filename);
+        return -1;
+    }
+
+    int32_t loaded;
+    if (is_shbin(text, len)) {
+        loaded = parse_shbin(vm, (const uint8_t *)text, len, filename);
+    } else {
+        vm->entry = vm->ip = 0;
+        loaded = parse_program(vm, text, len);
+    }
+    release_file(text, len, mapped);
+    if (loaded < 0) return -1;
+    vm->image_len = (uint32_t)loaded;
+
+    if (vm->debug_mode) {
+        fprintf(vm->out, "Loaded %u bytes (0x%04X) from '%s'\n", (unsigned)loaded, (unsigned)loaded, filename);
     }
 
-    printf("[%04X] ", (unsigned)ip);
-    uint32_t avail = MEMORY_SIZE - ip;
+    return 0;
+}
+
+ // Disassemble one instruction, no newline. insn points at the opcode byte,
+ // avail is how many bytes of it are there (fewer than its length = truncated)
+static void print_instruction(FILE *out, const uint8_t *insn, uint32_t avail) {
+    uint8_t opcode = insn[0];
 // possibly the worst code ive written ever {down arrow}
     switch (opcode) {
-        case OP_NOP:     printf("NOP\n"); break;
+        case OP_NOP:     fprintf(out, "NOP"); break;
         case OP_POKE:
-            if (avail >= 3) printf("POKE [%02X] <- %02X\n", memory[ip+1], memory[ip+2]);
-            else printf("POKE <truncated>\n");
+            if (avail >= 3) fprintf(out, "POKE [%02X] <- %02X", insn[1], insn[2]);
+            else fprintf(out, "POKE <truncated>");
             break;
         case OP_MOVE:
-            if (avail >= 3) printf("MOVE [%02X] -> [%02X]\n", memory[ip+1], memory[ip+2]);
-            else printf("MOVE <truncated>\n");
+            if (avail >= 3) fprintf(out, "MOVE [%02X] -> [%02X]", insn[1], insn[2]);
+            else fprintf(out, "MOVE <truncated>");
             break;
         case OP_NOT:
-            if (avail >= 2) printf("NOT [%02X]\n", memory[ip+1]);
-            else printf("NOT <truncated>\n");
+            if (avail >= 2) fprintf(out, "NOT [%02X]", insn[1]);
+            else fprintf(out, "NOT <truncated>");
             break;
         case OP_NAND:
-            if (avail >= 4) printf("NAND [%02X] [%02X] -> [%02X]\n", memory[ip+1], memory[ip+2], memory[ip+3]);
-            else printf("NAND <truncated>\n");
+            if (avail >= 4) fprintf(out, "NAND [%02X] [%02X] -> [%02X]", insn[1], insn[2], insn[3]);
+            else fprintf(out, "NAND <truncated>");
             break;
         case OP_JMP:
-            if (avail >= 2) printf("JMP %02X\n", memory[ip+1]);
-            else printf("JMP <truncated>\n");
+            if (avail >= 2) fprintf(out, "JMP %02X", insn[1]);
+            else fprintf(out, "JMP <truncated>");
             break;
         case OP_JZ:
-            if (avail >= 3) printf("JZ %02X if [%02X]==0\n", memory[ip+1], memory[ip+2]);
-            else printf("JZ <truncated>\n");
+            if (avail >= 3) fprintf(out, "JZ %02X if [%02X]==0", insn[1], insn[2]);
+            else fprintf(out, "JZ <truncated>");
             break;
         case OP_RUN:
-            if (avail >= 2) printf("RUN %02X\n", memory[ip+1]);
-            else printf("RUN <truncated>\n");
+            if (avail >= 2) fprintf(out, "RUN %02X", insn[1]);
+            else fprintf(out, "RUN <truncated>");
             break;
-        case OP_HALT:    printf("HALT\n"); break;
+        case OP_HALT:    fprintf(out, "HALT"); break;
         case OP_AND:
-            if (avail >= 4) printf("AND [%02X] [%02X] -> [%02X]\n", memory[ip+1], memory[ip+2], memory[ip+3]);
-            else printf("AND <truncated>\n");
+            if (avail >= 4) fprintf(out, "AND [%02X] [%02X] -> [%02X]", insn[1], insn[2], insn[3]);
+            else fprintf(out, "AND <truncated>");
             break;
         case OP_OR:
-            if (avail >= 4) printf("OR [%02X] [%02X] -> [%02X]\n", memory[ip+1], memory[ip+2], memory[ip+3]);
-            else printf("OR <truncated>\n");
+            if (avail >= 4) fprintf(out, "OR [%02X] [%02X] -> [%02X]", insn[1], insn[2], insn[3]);
+            else fprintf(out, "OR <truncated>");
             break;
         case OP_XOR:
-            if (avail >= 4) printf("XOR [%02X] [%02X] -> [%02X]\n", memory[ip+1], memory[ip+2], memory[ip+3]);
-            else printf("XOR <truncated>\n");
+            if (avail >= 4) fprintf(out, "XOR [%02X] [%02X] -> [%02X]", insn[1], insn[2], insn[3]);
+            else fprintf(out, "XOR <truncated>");
             break;
         case OP_INC:
-            if (avail >= 2) printf("INC [%02X]\n", memory[ip+1]);
-            else printf("INC <truncated>\n");
+            if (avail >= 2) fprintf(out, "INC [%02X]", insn[1]);
+            else fprintf(out, "INC <truncated>");
             break;
         case OP_DEC:
-            if (avail >= 2) printf("DEC [%02X]\n", memory[ip+1]);
-            else printf("DEC <truncated>\n");
+            if (avail >= 2) fprintf(out, "DEC [%02X]", insn[1]);
+            else fprintf(out, "DEC <truncated>");
             break;
         case OP_CMP:
-            if (avail >= 4) printf("CMP [%02X] [%02X] -> [%02X]\n", memory[ip+1], memory[ip+2], memory[ip+3]);
-            else printf("CMP <truncated>\n");
+            if (avail >= 4) fprintf(out, "CMP [%02X] [%02X] -> [%02X]", insn[1], insn[2], insn[3]);
+            else fprintf(out, "CMP <truncated>");
             break;
         case OP_COMMENT:
-            if (avail >= 2) printf("COMMENT (len=%u)\n", (unsigned)memory[ip+1]);
-            else printf("COMMENT <truncated>\n");
+            if (avail >= 2) fprintf(out, "COMMENT (len=%u)", (unsigned)insn[1]);
+            else fprintf(out, "COMMENT <truncated>");
             break;
         case OP_PUTC:
-            if (avail >= 2) printf("PUTC [%02X]\n", memory[ip+1]);
-            else printf("PUTC <truncated>\n");
+            if (avail >= 2) fprintf(out, "PUTC [%02X]", insn[1]);
+            else fprintf(out, "PUTC <truncated>");
             break;
         case OP_PUTN:
-            if (avail >= 2) printf("PUTN [%02X]\n", memory[ip+1]);
-            else printf("PUTN <truncated>\n");
+            if (avail >= 2) fprintf(out, "PUTN [%02X]", insn[1]);
+            else fprintf(out, "PUTN <truncated>");
             break;
         case OP_GETC:
-            if (avail >= 2) printf("GETC -> [%02X]\n", memory[ip+1]);
-            else printf("GETC <truncated>\n");
+            if (avail >= 2) fprintf(out, "GETC -> [%02X]", insn[1]);
+            else fprintf(out, "GETC <truncated>");
             break;
-        case OP_RET:     printf("RET\n"); break;
+        case OP_RET:     fprintf(out, "RET"); break;
         case OP_ADD:
-            if (avail >= 4) printf("ADD [%02X] [%02X] -> [%02X]\n", memory[ip+1], memory[ip+2], memory[ip+3]);
-            else printf("ADD <truncated>\n");
+            if (avail >= 4) fprintf(out, "ADD [%02X] [%02X] -> [%02X]", insn[1], insn[2], insn[3]);
+            else fprintf(out, "ADD <truncated>");
             break;
         case OP_SUB:
-            if (avail >= 4) printf("SUB [%02X] [%02X] -> [%02X]\n", memory[ip+1], memory[ip+2], memory[ip+3]);
-            else printf("SUB <truncated>\n");
+            if (avail >= 4) fprintf(out, "SUB [%02X] [%02X] -> [%02X]", insn[1], insn[2], insn[3]);
+            else fprintf(out, "SUB <truncated>");
             break;
         case OP_MUL:
-            if (avail >= 4) printf("MUL [%02X] [%02X] -> [%02X]\n", memory[ip+1], memory[ip+2], memory[ip+3]);
-            else printf("MUL <truncated>\n");
+            if (avail >= 4) fprintf(out, "MUL [%02X] [%02X] -> [%02X]", insn[1], insn[2], insn[3]);
+            else fprintf(out, "MUL <truncated>");
             break;
         case OP_DIV:
-            if (avail >= 4) printf("DIV [%02X] [%02X] -> [%02X]\n", memory[ip+1], memory[ip+2], memory[ip+3]);
-            else printf("DIV <truncated>\n");
+            if (avail >= 4) fprintf(out, "DIV [%02X] [%02X] -> [%02X]", insn[1], insn[2], insn[3]);
+            else fprintf(out, "DIV <truncated>");
             break;
         case OP_SHL:
-            if (avail >= 4) printf("SHL [%02X] [%02X] -> [%02X]\n", memory[ip+1], memory[ip+2], memory[ip+3]);
-            else printf("SHL <truncated>\n");
+            if (avail >= 4) fprintf(out, "SHL [%02X] [%02X] -> [%02X]", insn[1], insn[2], insn[3]);
+            else fprintf(out, "SHL <truncated>");
             break;
         case OP_SHR:
-            if (avail >= 4) printf("SHR [%02X] [%02X] -> [%02X]\n", memory[ip+1], memory[ip+2], memory[ip+3]);
-            else printf("SHR <truncated>\n");
+            if (avail >= 4) fprintf(out, "SHR [%02X] [%02X] -> [%02X]", insn[1], insn[2], insn[3]);
+            else fprintf(out, "SHR <truncated>");
             break;
         case OP_POKE16:
-            if (avail >= 4) printf("POKE16 [%02X%02X] <- %02X\n", memory[ip+1], memory[ip+2], memory[ip+3]);
-            else printf("POKE16 <truncated>\n");
+            if (avail >= 4) fprintf(out, "POKE16 [%02X%02X] <- %02X", insn[1], insn[2], insn[3]);
+            else fprintf(out, "POKE16 <truncated>");
             break;
         case OP_MOVE16:
-            if (avail >= 5) printf("MOVE16 [%02X%02X] -> [%02X%02X]\n", memory[ip+1], memory[ip+2], memory[ip+3], memory[ip+4]);
-            else printf("MOVE16 <truncated>\n");
+            if (avail >= 5) fprintf(out, "MOVE16 [%02X%02X] -> [%02X%02X]", insn[1], insn[2], insn[3], insn[4]);
+            else fprintf(out, "MOVE16 <truncated>");
             break;
         case OP_JMP16:
-            if (avail >= 3) printf("JMP16 %02X%02X\n", memory[ip+1], memory[ip+2]);
-            else printf("JMP16 <truncated>\n");
+            if (avail >= 3) fprintf(out, "JMP16 %02X%02X", insn[1], insn[2]);
+            else fprintf(out, "JMP16 <truncated>");
             break;
         case OP_JZ16:
-            if (avail >= 4) printf("JZ16 %02X%02X if [%02X]==0\n", memory[ip+1], memory[ip+2], memory[ip+3]);
-            else printf("JZ16 <truncated>\n");
+            if (avail >= 4) fprintf(out, "JZ16 %02X%02X if [%02X]==0", insn[1], insn[2], insn[3]);
+            else fprintf(out, "JZ16 <truncated>");
             break;
         case OP_RUN16:
-            if (avail >= 3) printf("RUN16 %02X%02X\n", memory[ip+1], memory[ip+2]);
-            else printf("RUN16 <truncated>\n");
+            if (avail >= 3) fprintf(out, "RUN16 %02X%02X", insn[1], insn[2]);
+            else fprintf(out, "RUN16 <truncated>");
             break;
-        default:
-            printf("UNKNOWN 0x%02X\n", opcode);
+        case OP_PUSH:
+            if (avail >= 2) fprintf(out, "PUSH [%02X]", insn[1]);
+            else fprintf(out, "PUSH <truncated>");
+            break;
+        case OP_POP:
+            if (avail >= 2) fprintf(out, "POP -> [%02X]", insn[1]);
+            else fprintf(out, "POP <truncated>");
+            break;
+        case OP_PUSH16_MEM:
+            if (avail >= 3) fprintf(out, "PUSH16 [%02X%02X]", insn[1], insn[2]);
+            else fprintf(out, "PUSH16 <truncated>");
+            break;
+        case OP_POP16_MEM:
+            if (avail >= 3) fprintf(out, "POP16 -> [%02X%02X]", insn[1], insn[2]);
+            else fprintf(out, "POP16 <truncated>");
+            break;
+        case OP_BAND16:
+        case OP_BOR16:
+        case OP_BXOR16:
+        case OP_BNAND16:
+            if (avail >= 7) fprintf(out, "%s [%02X%02X] [%02X%02X] -> [%02X%02X]", op_table[opcode].name,
+                                    insn[1], insn[2], insn[3], insn[4], insn[5], insn[6]);
+            else fprintf(out, "%s <truncated>", op_table[opcode].name);
+            break;
+        case OP_BNOT16:
+            if (avail >= 3) fprintf(out, "BNOT16 [%02X%02X]", insn[1], insn[2]);
+            else fprintf(out, "BNOT16 <truncated>");
+            break;
+        case OP_LT16_CMP:
+        case OP_GT16_CMP:
+            if (avail >= 6) fprintf(out, "%s [%02X%02X] [%02X%02X] -> [%02X]", op_table[opcode].name,
+                                    insn[1], insn[2], insn[3], insn[4], insn[5]);
+            else fprintf(out, "%s <truncated>", op_table[opcode].name);
+            break;
+        case OP_IF:
+        case OP_ELSEIF:
+        case OP_FOR:
+            if (avail >= 2) fprintf(out, "%s [%02X]", op_table[opcode].name, insn[1]);
+            else fprintf(out, "%s <truncated>", op_table[opcode].name);
+            break;
+        case OP_THEN:    fprintf(out, "THEN"); break;
+        case OP_ELSE:    fprintf(out, "ELSE"); break;
+        case OP_ERROR:
+            if (avail >= 2) fprintf(out, "ERROR %02X", insn[1]);
+            else fprintf(out, "ERROR <truncated>");
+            break;
+        case OP_BCOPY:
+            if (avail >= 7) fprintf(out, "BCOPY [%02X%02X] -> [%02X%02X] len=%02X%02X",
+                                    insn[1], insn[2], insn[3], insn[4], insn[5], insn[6]);
+            else fprintf(out, "BCOPY <truncated>");
+            break;
+        case OP_BFILL:
+            if (avail >= 6) fprintf(out, "BFILL [%02X%02X] len=%02X%02X <- %02X",
+                                    insn[1], insn[2], insn[3], insn[4], insn[5]);
+            else fprintf(out, "BFILL <truncated>");
+            break;
+        case OP_BCMP:
+            if (avail >= 8) fprintf(out, "BCMP [%02X%02X] [%02X%02X] len=%02X%02X -> [%02X]",
+                                    insn[1], insn[2], insn[3], insn[4], insn[5], insn[6], insn[7]);
+            else fprintf(out, "BCMP <truncated>");
+            break;
+        case OP_BANK:
+            if (avail >= 5) fprintf(out, "BANK %02X <- file %02X page %02X%02X", insn[1], insn[2], insn[3], insn[4]);
+            else fprintf(out, "BANK <truncated>");
+            break;
+        case OP_BANKLEN:
+            if (avail >= 4) fprintf(out, "BANKLEN file %02X -> [%02X%02X]", insn[1], insn[2], insn[3]);
+            else fprintf(out, "BANKLEN <truncated>");
+            break;
+        default:
+            fprintf(out, "UNKNOWN 0x%02X", opcode);
             break;
     }
-}
-
- // mem/addr Dump
-static void dump_memory(uint32_t start, uint32_t end) {
-    if (start >= MEMORY_SIZE) start = 0;
-    if (end >= MEMORY_SIZE) end = MEMORY_SIZE - 1;
-    if (start > end) {
-        uint32_t tmp = start; start = end; end = tmp;
-    }
+}
 
-    printf("\n--- Memory Dump (0x%04X-0x%04X) ---\n", (unsigned)start, (unsigned)end);
-    for (uint32_t i = start; i <= end; i++) {
-        if ((i - start) % 16 == 0) printf("\n%04X: ", (unsigned)i);
-        printf("%02X ", memory[i]);
+ // debug: print current instruction n stuf
+static void debug_instruction(const shred_vm *vm, uint32_t ip) {
+    if (!vm->debug_mode && !vm->trace_mode) return;
+    if (ip >= MEMORY_SIZE) {
+        fprintf(vm->out, "[%04X] <OUT OF BOUNDS>\n", (unsigned)ip);
+        return;
     }
-    printf("\n");
+
+    fprintf(vm->out, "[%04X] ", (unsigned)ip);
+    print_instruction(vm->out, vm->memory + ip, MEMORY_SIZE - ip);
+    fputc('\n', vm->out);
 }
 
- // da engine
-static void execute(uint16_t start_addr) {
-    if (!is_valid_address(start_addr)) {
-        fprintf(stderr, "Error: Start address 0x%04X out of bounds\n", start_addr);
+ // Binary trace
+ // A ring of fixed-size records, one per instruction, written as it runs and
+ // decoded later by shred_trace_decode(). Where there is mmap the ring is the
+ // file itself (MAP_SHARED), so whatever ran before a crash is still on disk;
+ // otherwise it's a malloc'd copy written out when tracing stops.
+ //
+ // File: 32 byte header, then capacity records of TRACE_RECORD_LEN bytes
+ //   0  "SHTR"          4  u16 version       6  u16 record size
+ //   8  u32 capacity    12 u32 reserved      16 u64 records written (head)
+ //   24 u64 reserved
+ // Record, little endian, slot head % capacity, at the TR_* offsets:
+ //   0  u64 instruction count   8  u16 ip   10 u16 address written (the first
+ //   byte, for block stores)    12 u8 call stack depth   13 u8 value written
+ //   14 u8 TRACE_* flags        16 MAX_INSN_LEN bytes from ip: opcode, operands
+ //   and whatever follows (0 past the end of memory)
+#define TRACE_MAGIC           "SHTR"
+#define TRACE_VERSION         2U
+#define TRACE_HEADER_LEN      32U
+#define TRACE_RECORD_LEN      24U
+
+#define TR_COUNT              0
+#define TR_IP                 8
+#define TR_ADDR               10
+#define TR_SP                 12
+#define TR_VALUE              13
+#define TR_FLAGS              14
+#define TR_INSN               16
+#define TRACE_RECORDS_DEFAULT (1U << 20)
+#define TRACE_RECORDS_MAX     (1U << 26)
+
+#define TRACE_WROTE           0x01   // address/value are valid
+#define TRACE_FAULT           0x02   // the instruction faulted instead of finishing
+#define TRACE_OVERFLOW        0x04   // overflow flag as it was before the instruction
+
+ // trace_dest[]: which operand an opcode stores to; byte offset from the
+ // opcode, DEST16 for a big-endian 16-bit address, 0 if it doesn't store
+ // (a THEN counting down its FOR's counter isn't recorded)
+#define DEST16  0x80
+static const uint8_t trace_dest[256] = {
+    [OP_POKE] = 1, [OP_MOVE] = 2, [OP_NOT] = 1, [OP_NAND] = 3,
+    [OP_AND] = 3, [OP_OR] = 3, [OP_XOR] = 3, [OP_INC] = 1, [OP_DEC] = 1, [OP_CMP] = 3,
+    [OP_GETC] = 1, [OP_ADD] = 3, [OP_SUB] = 3, [OP_MUL] = 3, [OP_DIV] = 3, [OP_SHL] = 3, [OP_SHR] = 3,
+    [OP_POKE16] = DEST16 | 1, [OP_MOVE16] = DEST16 | 3,
+    [OP_POP] = 1, [OP_LT16_CMP] = 5, [OP_GT16_CMP] = 5,
+    // word and block stores: the first byte
+    [OP_POP16_MEM] = DEST16 | 1, [OP_BNOT16] = DEST16 | 1,
+    [OP_BAND16] = DEST16 | 5, [OP_BOR16] = DEST16 | 5, [OP_BXOR16] = DEST16 | 5, [OP_BNAND16] = DEST16 | 5,
+    [OP_BCOPY] = DEST16 | 3, [OP_BFILL] = DEST16 | 1, [OP_BCMP] = 7,
+    [OP_BANKLEN] = DEST16 | 2,
+};
+
+struct exec_trace {
+    uint8_t  *file;          // header + ring, mapped or malloc'd
+    size_t    file_len;
+    int       mapped;
+    char     *path;          // where the malloc'd copy goes
+    uint32_t  mask;          // capacity - 1
+    uint64_t  head;          // records written so far
+    uint8_t  *pending;       // last record, its value is read once it has run
+};
+
+ // the instruction in the pending record has finished: its store is in memory now
+static ALWAYS_INLINE void trace_settle(exec_trace *t, const uint8_t *memory) {
+    if (t->pending) {
+        if (t->pending[TR_FLAGS] & TRACE_WROTE) t->pending[TR_VALUE] = memory[get_le16(t->pending + TR_ADDR)];
+        t->pending = NULL;
+    }
+}
+
+ // record the instruction at ip before it runs; count already includes it
+static ALWAYS_INLINE void trace_insn(exec_trace *t, const uint8_t *memory, uint32_t ip, uint8_t opcode,
+                                     uint32_t sp, uint8_t overflow, uint64_t count) {
+    trace_settle(t, memory);
+    uint8_t *r = t->file + TRACE_HEADER_LEN + (size_t)(t->head & t->mask) * TRACE_RECORD_LEN;
+    uint8_t flags = overflow ? TRACE_OVERFLOW : 0;
+
+    put_le64(r + TR_COUNT, count);
+    put_le16(r + TR_IP, ip);
+    if (ip + MAX_INSN_LEN <= MEMORY_SIZE) {
+        memcpy(r + TR_INSN, memory + ip, MAX_INSN_LEN);
+    } else {
+        memset(r + TR_INSN, 0, MAX_INSN_LEN);
+        memcpy(r + TR_INSN, memory + ip, MEMORY_SIZE - ip);
+    }
+
+    uint8_t dest = trace_dest[opcode];
+    uint32_t addr = 0;
+    if (dest) {
+        uint32_t k = dest & ~DEST16;
+        if (ip + k + ((dest & DEST16) ? 1 : 0) < MEMORY_SIZE) {   // else it's about to fault as truncated
+            const uint8_t *op = r + TR_INSN + k;
+            addr = (dest & DEST16) ? ((uint32_t)op[0] << 8) | op[1] : op[0];
+            flags |= TRACE_WROTE;
+        }
+        // an empty block stores nothing
+        if (opcode == OP_BCOPY && (r[TR_INSN + 5] | r[TR_INSN + 6]) == 0) flags &= ~TRACE_WROTE;
+        if (opcode == OP_BFILL && (r[TR_INSN + 3] | r[TR_INSN + 4]) == 0) flags &= ~TRACE_WROTE;
+    }
+    put_le16(r + TR_ADDR, addr);
+    r[TR_SP] = (uint8_t)sp;
+    r[TR_VALUE] = 0;
+    r[TR_FLAGS] = flags;
+
+    put_le64(t->file + 16, ++t->head);
+    t->pending = r;
+}
+
+ // shred_vm_run() is returning; faulted says the last record never finished
+static void trace_end_run(exec_trace *t, const uint8_t *memory, int faulted) {
+    if (faulted && t->pending) {
+        t->pending[TR_FLAGS] = (uint8_t)((t->pending[TR_FLAGS] & ~TRACE_WROTE) | TRACE_FAULT);
+        t->pending = NULL;
+    }
+    trace_settle(t, memory);
+}
+
+static void trace_close(exec_trace *t, FILE *err) {
+    if (!t) return;
+#if HAVE_MMAP
+    if (t->mapped) {
+        munmap(t->file, t->file_len);
+        free(t);
         return;
     }
+#endif
+    FILE *file = fopen(t->path, "wb");
+    if (!file) {
+        fprintf(err, "Error: Cannot open '%s' for writing\n", t->path);
+        fprintf(err, "fopen: %s\n", strerror(errno));
+    } else {
+        int ok = fwrite(t->file, 1, t->file_len, file) == t->file_len;
+        if (fclose(file) != 0) ok = 0;
+        if (!ok) fprintf(err, "Error: Failed writing '%s': %s\n", t->path, strerror(errno));
+    }
+    free(t->path);
+    free(t->file);
+    free(t);
+}
+
+static exec_trace *trace_open(const char *filename, uint32_t records, FILE *err) {
+    uint32_t capacity = 1;
+    while (capacity < records) capacity <<= 1;
+
+    exec_trace *t = calloc(1, sizeof(exec_trace));
+    if (!t) return NULL;
+    t->mask = capacity - 1;
+    t->file_len = TRACE_HEADER_LEN + (size_t)capacity * TRACE_RECORD_LEN;
+
+#if HAVE_MMAP
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(err, "Error: Cannot open '%s' for writing\n", filename);
+        fprintf(err, "open: %s\n", strerror(errno));
+        free(t);
+        return NULL;
+    }
+    if (ftruncate(fd, (off_t)t->file_len) == 0) {
+        void *map = mmap(NULL, t->file_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+            t->file = map;
+            t->mapped = 1;
+        }
+    }
+    close(fd);
+#endif
+    if (!t->mapped) {
+        t->file = calloc(1, t->file_len);
+        t->path = malloc(strlen(filename) + 1);
+        if (!t->file || !t->path) {
+            fprintf(err, "Error: Out of memory for a %u record trace\n", (unsigned)capacity);
+            free(t->file);
+            free(t->path);
+            free(t);
+            return NULL;
+        }
+        strcpy(t->path, filename);
+    }
+
+    memcpy(t->file, TRACE_MAGIC, 4);
+    put_le16(t->file + 4, TRACE_VERSION);
+    put_le16(t->file + 6, TRACE_RECORD_LEN);
+    put_le32(t->file + 8, capacity);
+    return t;
+}
+
+ // Oldest record first, in the same mnemonics as -t, plus the store it made
+int shred_trace_decode(const char *filename, FILE *out) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot open file '%s'\n", filename);
+        fprintf(stderr, "fopen: %s\n", strerror(errno));
+        return -1;
+    }
+    size_t len;
+    int mapped;
+    uint8_t *data = (uint8_t *)slurp_file(file, &len, &mapped);
+    fclose(file);
+    if (!data) {
+        fprintf(stderr, "Error: Out of memory reading '%s'\n", filename);
+        return -1;
+    }
+
+    uint32_t capacity = (len >= TRACE_HEADER_LEN) ? get_le32(data + 8) : 0;
+    if (len < TRACE_HEADER_LEN || memcmp(data, TRACE_MAGIC, 4) != 0) {
+        fprintf(stderr, "Error: '%s' is not a Shredder trace\n", filename);
+        release_file((char *)data, len, mapped);
+        return -1;
+    }
+    if (get_le16(data + 4) != TRACE_VERSION || get_le16(data + 6) != TRACE_RECORD_LEN) {
+        fprintf(stderr, "Error: '%s' is trace version %u, this build reads version %u\n",
+                filename, (unsigned)get_le16(data + 4), (unsigned)TRACE_VERSION);
+        release_file((char *)data, len, mapped);
+        return -1;
+    }
+    if (capacity == 0 || (capacity & (capacity - 1)) ||
+        (len - TRACE_HEADER_LEN) / TRACE_RECORD_LEN < capacity) {
+        fprintf(stderr, "Error: '%s' is truncated\n", filename);
+        release_file((char *)data, len, mapped);
+        return -1;
+    }
+
+    uint64_t head = get_le64(data + 16);
+    uint64_t first = (head > capacity) ? head - capacity : 0;
+    fprintf(out, "; %llu instructions traced", (unsigned long long)head);
+    if (first) fprintf(out, ", the last %u kept", (unsigned)capacity);
+    fputc('\n', out);
+
+    for (uint64_t n = first; n < head; n++) {
+        const uint8_t *r = data + TRACE_HEADER_LEN + (size_t)(n & (capacity - 1)) * TRACE_RECORD_LEN;
+        uint32_t ip = get_le16(r + TR_IP);
+        uint8_t flags = r[TR_FLAGS];
+
+        fprintf(out, "%10llu SP=%02u OF=%u [%04X] ", (unsigned long long)get_le64(r + TR_COUNT), (unsigned)r[TR_SP],
+                (flags & TRACE_OVERFLOW) ? 1U : 0U, (unsigned)ip);
+        print_instruction(out, r + TR_INSN, (ip + MAX_INSN_LEN <= MEMORY_SIZE) ? MAX_INSN_LEN : MEMORY_SIZE - ip);
+        if (flags & TRACE_WROTE) {
+            fprintf(out, "  ; [%04X] = %02X", (unsigned)get_le16(r + TR_ADDR), r[TR_VALUE]);
+        }
+        if (flags & TRACE_FAULT) fprintf(out, "  ; fault");
+        fputc('\n', out);
+    }
+
+    release_file((char *)data, len, mapped);
+    if (ferror(out)) return -1;
+    return 0;
+}
+
+ // Structured control flow
+ // IF [c] ... {ELSEIF [c] ...} [ELSE ...] THEN and FOR [c] ... THEN are matched
+ // up the first time the IF or FOR runs: ctrl_lookup() scans the construct
+ // once and records every clause's next clause and closing THEN in vm->ctrl,
+ // so after that they cost a table lookup, like a JZ16. A store onto any byte
+ // of a resolved construct bumps the table's generation, which makes every
+ // entry stale; each is resolved again the next time it runs (stale clauses
+ // remember their IF/FOR for that), so self-modifying code still works. A
+ // clause no IF/FOR has claimed, say in a restored snapshot or a clone, looks
+ // for the closest one it belongs to with ctrl_claimant().
+static ctrl_entry *ctrl_lookup(shred_vm *vm, uint32_t ip);
+
+ // the entry for the IF/FOR or clause at ip, NULL after a fault
+static ALWAYS_INLINE ctrl_entry *ctrl_get(shred_vm *vm, uint32_t ip) {
+    ctrl_table *t = vm->ctrl;
+    if (t && t->at[ip].gen == t->gen) return &t->at[ip];
+    return ctrl_lookup(vm, ip);
+}
+
+ // where a false IF goes: into the first later ELSEIF whose condition holds,
+ // else past the ELSE or THEN
+static ALWAYS_INLINE uint32_t ctrl_false(const ctrl_table *t, const uint8_t *memory, const ctrl_entry *e) {
+    uint32_t k = e->next;
+    while (memory[k] == OP_ELSEIF && memory[memory[k + 1]] == 0) k = t->at[k].next;
+    return (memory[k] == OP_ELSEIF) ? k + 2 : k + 1;
+}
+
+ // code under a resolved IF/FOR changed: every entry goes stale
+static void ctrl_forget(shred_vm *vm) {
+    ctrl_table *t = vm->ctrl;
+    if (!t) return;
+    if (++t->gen == 0) {
+        // wrapped; keep the openers, but nothing may look current
+        for (uint32_t i = 0; i < MEMORY_SIZE; i++) {
+            if (t->at[i].gen) t->at[i].gen = 1;
+        }
+        t->gen = 2;
+    }
+}
+
+ // execute() has no store hooks, so it checks here before each instruction
+static void ctrl_check_store(shred_vm *vm, uint32_t ip) {
+    if (!vm->code_bytes) return;   // nothing resolved yet
+    const uint8_t *insn = &vm->memory[ip];
+    uint32_t len = op_table[insn[0]].length;
+    if (len == 0 || !ensure_operands(ip, len) || !operands_fit(insn)) return;   // it's about to fault
+    int32_t target = store_span(insn, &len);
+    for (uint32_t k = 0; target >= 0 && k < len; k++) {
+        if (vm->code_bytes[target + k] & CODE_CTRL) {
+            ctrl_forget(vm);
+            return;
+        }
+    }
+}
 
-    uint32_t ip = start_addr;
+static int bank_switch(shred_vm *vm, uint32_t ip);
+static uint16_t bank_length(const shred_vm *vm, uint32_t file);
+
+ // da engine
+ // Runs from vm->ip until HALT, a fault, or stop instructions have been counted
+static shred_status execute(shred_vm *vm, uint64_t stop) {
+    uint8_t *memory = vm->memory;
+    uint32_t ip = vm->ip;
     int running = 1;
+    shred_status status = SHRED_FAULT;   // every way out but HALT and the step budget is a fault
+    exec_profile *const profile = vm->profile;
+    exec_trace *const tracer = vm->trace;
+    exec_perf *const perf = vm->perf;
 
     while (running) {
         // instruction limit check
-        if (++instruction_count > MAX_INSTRUCTIONS) {
-            fprintf(stderr, "CPU Fault: Instruction limit exceeded (%u), possible infinite loop\n",
-                    (unsigned)MAX_INSTRUCTIONS);
-            return;
+        if (++vm->instruction_count > stop) {
+            if (vm->instruction_count <= vm->max_instructions) {
+                vm->instruction_count--;
+                vm->ip = ip;
+                return SHRED_PAUSED;
+            }
+            vm_error(vm, "CPU Fault: Instruction limit exceeded (%llu), possible infinite loop\n",
+                    (unsigned long long)vm->max_instructions);
+            vm->ip = ip;
+            return SHRED_FAULT;
         }
 
         // bounds check
         if (!is_valid_address(ip)) {
-            fprintf(stderr, "CPU Fault: IP 0x%04X out of bounds\n", (unsigned)ip);
-            return;
+            vm_error(vm, "CPU Fault: IP 0x%04X out of bounds\n", (unsigned)ip);
+            vm->ip = ip;
+            return SHRED_FAULT;
         }
 
         uint8_t opcode = memory[ip];
-        debug_instruction(ip, opcode);
+        if (opcode == OP_GETC && input_waits(vm)) {
+            // runs once there is input, nothing has seen it yet
+            vm->instruction_count--;
+            vm->ip = ip;
+            return SHRED_WAITING;
+        }
+        debug_instruction(vm, ip);
+        if (profile) profile_insn(profile, memory, ip, opcode, vm->stack_pointer, vm->instruction_count);
+        if (tracer) trace_insn(tracer, memory, ip, opcode, vm->stack_pointer, vm->overflow_flag, vm->instruction_count);
+        if (perf) perf_insn(perf, memory, ip, opcode, vm->stack_pointer);
+        if (vm->ctrl && !vm->fixed_code) ctrl_check_store(vm, ip);
 
         switch (opcode) {
             case OP_NOP:
@@ -368,7 +1933,7 @@ static void execute(uint16_t start_addr) {
 
             case OP_POKE: {
                 if (!ensure_operands(ip, 3)) {
-                    fprintf(stderr, "CPU Fault: POKE truncated at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: POKE truncated at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 uint8_t addr = memory[ip + 1];
@@ -380,7 +1945,7 @@ static void execute(uint16_t start_addr) {
 
             case OP_MOVE: {
                 if (!ensure_operands(ip, 3)) {
-                    fprintf(stderr, "CPU Fault: MOVE truncated at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: MOVE truncated at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 uint8_t src = memory[ip + 1];
@@ -392,7 +1957,7 @@ static void execute(uint16_t start_addr) {
 
             case OP_NOT: {
                 if (!ensure_operands(ip, 2)) {
-                    fprintf(stderr, "CPU Fault: NOT truncated at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: NOT truncated at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 uint8_t addr = memory[ip + 1];
@@ -403,7 +1968,7 @@ static void execute(uint16_t start_addr) {
 
             case OP_NAND: {
                 if (!ensure_operands(ip, 4)) {
-                    fprintf(stderr, "CPU Fault: NAND truncated at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: NAND truncated at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 uint8_t a = memory[ip + 1];
@@ -416,7 +1981,7 @@ static void execute(uint16_t start_addr) {
 
             case OP_JMP: {
                 if (!ensure_operands(ip, 2)) {
-                    fprintf(stderr, "CPU Fault: JMP truncated at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: JMP truncated at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 uint8_t addr = memory[ip + 1];
@@ -426,7 +1991,7 @@ static void execute(uint16_t start_addr) {
 
             case OP_JZ: {
                 if (!ensure_operands(ip, 3)) {
-                    fprintf(stderr, "CPU Fault: JZ truncated at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: JZ truncated at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 uint8_t addr = memory[ip + 1];
@@ -441,11 +2006,11 @@ static void execute(uint16_t start_addr) {
 
             case OP_RUN: {
                 if (!ensure_operands(ip, 2)) {
-                    fprintf(stderr, "CPU Fault: RUN truncated at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: RUN truncated at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 uint8_t addr = memory[ip + 1];
-                if (!push_stack((uint16_t)(ip + 2))) {
+                if (!push_stack(vm, (uint16_t)(ip + 2))) {
                     running = 0; break;
                 }
                 ip = addr;
@@ -453,13 +2018,14 @@ static void execute(uint16_t start_addr) {
             }
 
             case OP_HALT: {
-                if (stack_pointer > 0) {
+                if (vm->stack_pointer > 0) {
                     uint16_t ret_addr;
-                    if (!pop_stack(&ret_addr)) {
+                    if (!pop_stack(vm, &ret_addr)) {
                         running = 0; break;
                     }
                     ip = ret_addr;
                 } else {
+                    status = SHRED_HALTED;
                     running = 0;
                 }
                 break;
@@ -467,7 +2033,7 @@ static void execute(uint16_t start_addr) {
 
             case OP_AND: {
                 if (!ensure_operands(ip, 4)) {
-                    fprintf(stderr, "CPU Fault: AND truncated at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: AND truncated at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 uint8_t a = memory[ip + 1];
@@ -480,7 +2046,7 @@ static void execute(uint16_t start_addr) {
 
             case OP_OR: {
                 if (!ensure_operands(ip, 4)) {
-                    fprintf(stderr, "CPU Fault: OR truncated at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: OR truncated at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 uint8_t a = memory[ip + 1];
@@ -493,7 +2059,7 @@ static void execute(uint16_t start_addr) {
 
             case OP_XOR: {
                 if (!ensure_operands(ip, 4)) {
-                    fprintf(stderr, "CPU Fault: XOR truncated at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: XOR truncated at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 uint8_t a = memory[ip + 1];
@@ -506,7 +2072,7 @@ static void execute(uint16_t start_addr) {
 
             case OP_INC: {
                 if (!ensure_operands(ip, 2)) {
-                    fprintf(stderr, "CPU Fault: INC truncated at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: INC truncated at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 uint8_t addr = memory[ip + 1];
@@ -517,7 +2083,7 @@ static void execute(uint16_t start_addr) {
 
             case OP_DEC: {
                 if (!ensure_operands(ip, 2)) {
-                    fprintf(stderr, "CPU Fault: DEC truncated at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: DEC truncated at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 uint8_t addr = memory[ip + 1];
@@ -528,7 +2094,7 @@ static void execute(uint16_t start_addr) {
 
             case OP_CMP: {
                 if (!ensure_operands(ip, 4)) {
-                    fprintf(stderr, "CPU Fault: CMP truncated at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: CMP truncated at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 uint8_t a = memory[ip + 1];
@@ -541,13 +2107,13 @@ static void execute(uint16_t start_addr) {
 
             case OP_COMMENT: {
                 if (!ensure_operands(ip, 2)) {
-                    fprintf(stderr, "CPU Fault: COMMENT truncated at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: COMMENT truncated at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 uint8_t len = memory[ip + 1];
                 uint32_t new_ip = ip + 2 + len;
                 if (new_ip > MEMORY_SIZE) {
-                    fprintf(stderr, "CPU Fault: COMMENT overflows memory at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: COMMENT overflows memory at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 ip = new_ip;
@@ -558,49 +2124,45 @@ static void execute(uint16_t start_addr) {
 
             case OP_PUTC: {
                 if (!ensure_operands(ip, 2)) {
-                    fprintf(stderr, "CPU Fault: PUTC truncated at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: PUTC truncated at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 uint8_t addr = memory[ip + 1];
-                putchar(memory[addr]);
-                fflush(stdout);
+                out_write(vm, (const char *)&memory[addr], 1);
                 ip += 2;
                 break;
             }
 
             case OP_PUTN: {
                 if (!ensure_operands(ip, 2)) {
-                    fprintf(stderr, "CPU Fault: PUTN truncated at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: PUTN truncated at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 uint8_t addr = memory[ip + 1];
-                printf("%d", memory[addr]);
-                fflush(stdout);
+                out_putn(vm, memory[addr]);
                 ip += 2;
                 break;
             }
 
             case OP_GETC: {
                 if (!ensure_operands(ip, 2)) {
-                    fprintf(stderr, "CPU Fault: GETC truncated at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: GETC truncated at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
-                uint8_t addr = memory[ip + 1];
-                int ch = getchar();
-                memory[addr] = (ch == EOF) ? 0 : (uint8_t)ch;
+                memory[memory[ip + 1]] = in_getc(vm);
                 ip += 2;
                 break;
             }
 
             case OP_RET: {
-                if (stack_pointer > 0) {
+                if (vm->stack_pointer > 0) {
                     uint16_t ret_addr;
-                    if (!pop_stack(&ret_addr)) {
+                    if (!pop_stack(vm, &ret_addr)) {
                         running = 0; break;
                     }
                     ip = ret_addr;
                 } else {
-                    fprintf(stderr, "CPU Fault: RET with empty stack at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: RET with empty stack at 0x%04X\n", (unsigned)ip);
                     running = 0;
                 }
                 break;
@@ -610,7 +2172,7 @@ static void execute(uint16_t start_addr) {
 
             case OP_ADD: {
                 if (!ensure_operands(ip, 4)) {
-                    fprintf(stderr, "CPU Fault: ADD truncated at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: ADD truncated at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 uint8_t a = memory[ip + 1];
@@ -618,14 +2180,14 @@ static void execute(uint16_t start_addr) {
                 uint8_t dest = memory[ip + 3];
                 uint16_t result = (uint16_t)memory[a] + (uint16_t)memory[b];
                 memory[dest] = (uint8_t)result;
-                overflow_flag = (result > 255) ? 1 : 0;
+                vm->overflow_flag = (result > 255) ? 1 : 0;
                 ip += 4;
                 break;
             }
 
             case OP_SUB: {
                 if (!ensure_operands(ip, 4)) {
-                    fprintf(stderr, "CPU Fault: SUB truncated at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: SUB truncated at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 uint8_t a = memory[ip + 1];
@@ -633,14 +2195,14 @@ static void execute(uint16_t start_addr) {
                 uint8_t dest = memory[ip + 3];
                 int16_t result = (int16_t)memory[a] - (int16_t)memory[b];
                 memory[dest] = (uint8_t)result;
-                overflow_flag = (result < 0) ? 1 : 0;
+                vm->overflow_flag = (result < 0) ? 1 : 0;
                 ip += 4;
                 break;
             }
 
             case OP_MUL: {
                 if (!ensure_operands(ip, 4)) {
-                    fprintf(stderr, "CPU Fault: MUL truncated at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: MUL truncated at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 uint8_t a = memory[ip + 1];
@@ -648,21 +2210,21 @@ static void execute(uint16_t start_addr) {
                 uint8_t dest = memory[ip + 3];
                 uint16_t result = (uint16_t)memory[a] * (uint16_t)memory[b];
                 memory[dest] = (uint8_t)result;
-                overflow_flag = (result > 255) ? 1 : 0;
+                vm->overflow_flag = (result > 255) ? 1 : 0;
                 ip += 4;
                 break;
             }
 
             case OP_DIV: {
                 if (!ensure_operands(ip, 4)) {
-                    fprintf(stderr, "CPU Fault: DIV truncated at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: DIV truncated at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 uint8_t a = memory[ip + 1];
                 uint8_t b = memory[ip + 2];
                 uint8_t dest = memory[ip + 3];
                 if (memory[b] == 0) {
-                    fprintf(stderr, "CPU Fault: Division by zero at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: Division by zero at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 memory[dest] = memory[a] / memory[b];
@@ -672,7 +2234,7 @@ static void execute(uint16_t start_addr) {
 
             case OP_SHL: {
                 if (!ensure_operands(ip, 4)) {
-                    fprintf(stderr, "CPU Fault: SHL truncated at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: SHL truncated at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 uint8_t a = memory[ip + 1];
@@ -686,7 +2248,7 @@ static void execute(uint16_t start_addr) {
 
             case OP_SHR: {
                 if (!ensure_operands(ip, 4)) {
-                    fprintf(stderr, "CPU Fault: SHR truncated at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: SHR truncated at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 uint8_t a = memory[ip + 1];
@@ -702,13 +2264,13 @@ static void execute(uint16_t start_addr) {
 
             case OP_POKE16: {
                 if (!ensure_operands(ip, 4)) {
-                    fprintf(stderr, "CPU Fault: POKE16 truncated at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: POKE16 truncated at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 uint16_t addr = ((uint16_t)memory[ip + 1] << 8) | memory[ip + 2];
                 uint8_t value = memory[ip + 3];
                 if (!is_valid_address(addr)) {
-                    fprintf(stderr, "CPU Fault: POKE16 address 0x%04X out of bounds at 0x%04X\n",
+                    vm_error(vm, "CPU Fault: POKE16 address 0x%04X out of bounds at 0x%04X\n",
                             addr, (unsigned)ip);
                     running = 0; break;
                 }
@@ -719,13 +2281,13 @@ static void execute(uint16_t start_addr) {
 
             case OP_MOVE16: {
                 if (!ensure_operands(ip, 5)) {
-                    fprintf(stderr, "CPU Fault: MOVE16 truncated at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: MOVE16 truncated at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 uint16_t src = ((uint16_t)memory[ip + 1] << 8) | memory[ip + 2];
                 uint16_t dest = ((uint16_t)memory[ip + 3] << 8) | memory[ip + 4];
                 if (!is_valid_address(src) || !is_valid_address(dest)) {
-                    fprintf(stderr, "CPU Fault: MOVE16 address out of bounds at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: MOVE16 address out of bounds at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 memory[dest] = memory[src];
@@ -735,12 +2297,12 @@ static void execute(uint16_t start_addr) {
 
             case OP_JMP16: {
                 if (!ensure_operands(ip, 3)) {
-                    fprintf(stderr, "CPU Fault: JMP16 truncated at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: JMP16 truncated at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 uint16_t addr = ((uint16_t)memory[ip + 1] << 8) | memory[ip + 2];
                 if (!is_valid_address(addr)) {
-                    fprintf(stderr, "CPU Fault: JMP16 to 0x%04X out of bounds at 0x%04X\n",
+                    vm_error(vm, "CPU Fault: JMP16 to 0x%04X out of bounds at 0x%04X\n",
                             addr, (unsigned)ip);
                     running = 0; break;
                 }
@@ -750,13 +2312,13 @@ static void execute(uint16_t start_addr) {
 
             case OP_JZ16: {
                 if (!ensure_operands(ip, 4)) {
-                    fprintf(stderr, "CPU Fault: JZ16 truncated at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: JZ16 truncated at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 uint16_t addr = ((uint16_t)memory[ip + 1] << 8) | memory[ip + 2];
                 uint8_t cond = memory[ip + 3];
                 if (!is_valid_address(addr)) {
-                    fprintf(stderr, "CPU Fault: JZ16 to 0x%04X out of bounds at 0x%04X\n",
+                    vm_error(vm, "CPU Fault: JZ16 to 0x%04X out of bounds at 0x%04X\n",
                             addr, (unsigned)ip);
                     running = 0; break;
                 }
@@ -770,119 +2332,5803 @@ static void execute(uint16_t start_addr) {
 
             case OP_RUN16: {
                 if (!ensure_operands(ip, 3)) {
-                    fprintf(stderr, "CPU Fault: RUN16 truncated at 0x%04X\n", (unsigned)ip);
+                    vm_error(vm, "CPU Fault: RUN16 truncated at 0x%04X\n", (unsigned)ip);
                     running = 0; break;
                 }
                 uint16_t addr = ((uint16_t)memory[ip + 1] << 8) | memory[ip + 2];
                 if (!is_valid_address(addr)) {
-                    fprintf(stderr, "CPU Fault: RUN16 to 0x%04X out of bounds at 0x%04X\n",
+                    vm_error(vm, "CPU Fault: RUN16 to 0x%04X out of bounds at 0x%04X\n",
                             addr, (unsigned)ip);
                     running = 0; break;
                 }
-                if (!push_stack((uint16_t)(ip + 3))) {
+                if (!push_stack(vm, (uint16_t)(ip + 3))) {
                     running = 0; break;
                 }
                 ip = addr;
                 break;
             }
 
-            default:
-                fprintf(stderr, "CPU Fault: Unknown opcode 0x%02X at 0x%04X\n", opcode, (unsigned)ip);
-                running = 0;
+            // Data stack and 16-bit words
+
+            case OP_PUSH: {
+                if (!ensure_operands(ip, 2)) {
+                    vm_error(vm, "CPU Fault: PUSH truncated at 0x%04X\n", (unsigned)ip);
+                    running = 0; break;
+                }
+                if (!push_data(vm, memory[memory[ip + 1]])) {
+                    running = 0; break;
+                }
+                ip += 2;
                 break;
-        }
-    }
+            }
 
-    if (debug_mode) {
-        printf("\nExecution ended. Instructions executed: %u\n", (unsigned)instruction_count);
-    }
-}
+            case OP_POP: {
+                if (!ensure_operands(ip, 2)) {
+                    vm_error(vm, "CPU Fault: POP truncated at 0x%04X\n", (unsigned)ip);
+                    running = 0; break;
+                }
+                uint16_t value;
+                if (!pop_data(vm, &value)) {
+                    running = 0; break;
+                }
+                memory[memory[ip + 1]] = (uint8_t)value;
+                ip += 2;
+                break;
+            }
 
- // Main Entry Point
- int main(int argc, char *argv[]) {
-    if (argc < 2) {
-        printf("Shredder - A Minimal Hexadecimal Virtual Machine\n");
-        printf("================================================\n");
-        printf("Usage: %s [OPTIONS] <program.shred>\n\n", argv[0]);
-        printf("Options:\n");
-        printf("  -d, --debug      Enable debug mode\n");
-        printf("  -t, --trace      Enable trace mode (verbose)\n");
-        printf("  -m START:END     Dump memory range (hex, no 0x prefix)\n");
-        printf("  -h, --help       Show this help\n\n");
-        printf("Memory: 64K bytes (0x0000-0xFFFF)\n");
-        printf("Stack:  64 levels\n");
-        return EXIT_SUCCESS;
-    }
+            case OP_PUSH16_MEM:
+            case OP_POP16_MEM:
+            case OP_BNOT16: {
+                if (!ensure_operands(ip, 3)) {
+                    vm_error(vm, "CPU Fault: %s truncated at 0x%04X\n", op_table[opcode].name, (unsigned)ip);
+                    running = 0; break;
+                }
+                if (!operands_fit(&memory[ip])) {
+                    vm_error(vm, "CPU Fault: %s out of bounds at 0x%04X\n", op_table[opcode].name, (unsigned)ip);
+                    running = 0; break;
+                }
+                uint16_t addr = ((uint16_t)memory[ip + 1] << 8) | memory[ip + 2];
+                uint16_t value = load_word(memory, addr);
+                if (opcode == OP_PUSH16_MEM) {
+                    if (!push_data(vm, value)) {
+                        running = 0; break;
+                    }
+                } else {
+                    if (opcode == OP_POP16_MEM && !pop_data(vm, &value)) {
+                        running = 0; break;
+                    }
+                    if (opcode == OP_BNOT16) value = (uint16_t)~value;
+                    memory[addr] = (uint8_t)(value >> 8);
+                    memory[addr + 1] = (uint8_t)value;
+                }
+                ip += 3;
+                break;
+            }
 
-    const char *filename = NULL;
-    int dump_start = -1, dump_end = -1;
+            case OP_BAND16:
+            case OP_BOR16:
+            case OP_BXOR16:
+            case OP_BNAND16: {
+                if (!ensure_operands(ip, 7)) {
+                    vm_error(vm, "CPU Fault: %s truncated at 0x%04X\n", op_table[opcode].name, (unsigned)ip);
+                    running = 0; break;
+                }
+                if (!operands_fit(&memory[ip])) {
+                    vm_error(vm, "CPU Fault: %s out of bounds at 0x%04X\n", op_table[opcode].name, (unsigned)ip);
+                    running = 0; break;
+                }
+                uint16_t a = ((uint16_t)memory[ip + 1] << 8) | memory[ip + 2];
+                uint16_t b = ((uint16_t)memory[ip + 3] << 8) | memory[ip + 4];
+                uint16_t dest = ((uint16_t)memory[ip + 5] << 8) | memory[ip + 6];
+                uint16_t result = word_op(opcode, load_word(memory, a), load_word(memory, b));
+                memory[dest] = (uint8_t)(result >> 8);
+                memory[dest + 1] = (uint8_t)result;
+                ip += 7;
+                break;
+            }
 
-    // Parse arguments
-    for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--debug") == 0) {
-            debug_mode = 1;
-        } else if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--trace") == 0) {
-            trace_mode = 1;
-            debug_mode = 1;
-        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
-            if (sscanf(argv[i + 1], "%x:%x", &dump_start, &dump_end) == 2) {
-                i++;
-            } else {
-                fprintf(stderr, "Error: Invalid memory range. Use -m START:END (hex)\n");
-                return EXIT_FAILURE;
+            case OP_LT16_CMP:
+            case OP_GT16_CMP: {
+                if (!ensure_operands(ip, 6)) {
+                    vm_error(vm, "CPU Fault: %s truncated at 0x%04X\n", op_table[opcode].name, (unsigned)ip);
+                    running = 0; break;
+                }
+                if (!operands_fit(&memory[ip])) {
+                    vm_error(vm, "CPU Fault: %s out of bounds at 0x%04X\n", op_table[opcode].name, (unsigned)ip);
+                    running = 0; break;
+                }
+                uint16_t a = load_word(memory, ((uint16_t)memory[ip + 1] << 8) | memory[ip + 2]);
+                uint16_t b = load_word(memory, ((uint16_t)memory[ip + 3] << 8) | memory[ip + 4]);
+                uint8_t dest = memory[ip + 5];
+                memory[dest] = (opcode == OP_LT16_CMP) ? (a < b) : (a > b);
+                ip += 6;
+                break;
             }
-        } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
-            return EXIT_SUCCESS;
-        } else if (argv[i][0] == '-') {
-            fprintf(stderr, "Error: Unknown option '%s'\n", argv[i]);
-            return EXIT_FAILURE;
-        } else {
-            filename = argv[i];
-        }
-    }
 
-    if (!filename) {
-        fprintf(stderr, "Error: No .shred file specified\n");
-        return EXIT_FAILURE;
-    }
+            // Structured control flow
 
-    // Check file extension
-    const char *ext = strrchr(filename, '.');
-    if (!ext || strcmp(ext, ".shred") != 0) {
-        fprintf(stderr, "Warning: File '%s' doesn't have .shred extension\n", filename);
-    }
+            case OP_IF:
+            case OP_FOR: {
+                if (!ensure_operands(ip, 2)) {
+                    vm_error(vm, "CPU Fault: %s truncated at 0x%04X\n", op_table[opcode].name, (unsigned)ip);
+                    running = 0; break;
+                }
+                ctrl_entry *e = ctrl_get(vm, ip);
+                if (!e) {
+                    running = 0; break;
+                }
+                if (memory[memory[ip + 1]] != 0) {
+                    ip += 2;
+                } else {
+                    ip = (opcode == OP_IF) ? ctrl_false(vm->ctrl, memory, e) : e->end + 1U;
+                }
+                break;
+            }
 
-    // Initialize VM
-    memset(memory, 0, MEMORY_SIZE);
-    memset(call_stack, 0, sizeof(call_stack));
-    stack_pointer = 0;
-    overflow_flag = 0;
-    instruction_count = 0;
+            case OP_ELSEIF:
+            case OP_ELSE: {
+                // only reached at the end of the branch before it
+                if (!ensure_operands(ip, op_table[opcode].length)) {
+                    vm_error(vm, "CPU Fault: %s truncated at 0x%04X\n", op_table[opcode].name, (unsigned)ip);
+                    running = 0; break;
+                }
+                ctrl_entry *e = ctrl_get(vm, ip);
+                if (!e) {
+                    running = 0; break;
+                }
+                ip = e->end + 1U;
+                break;
+            }
 
-    // Load and execute
-    if (load_program(filename) != 0) {
-        return EXIT_FAILURE;
-    }
+            case OP_THEN: {
+                ctrl_entry *e = ctrl_get(vm, ip);
+                if (!e) {
+                    running = 0; break;
+                }
+                uint32_t opener = e->opener;
+                if (memory[opener] == OP_FOR) {
+                    uint8_t counter = memory[opener + 1];
+                    memory[counter]--;
+                    if (vm->code_bytes[counter] & CODE_CTRL) ctrl_forget(vm);
+                    if (memory[counter] != 0) {
+                        ip = opener + 2;
+                        break;
+                    }
+                }
+                ip += 1;
+                break;
+            }
 
-    if (debug_mode) {
-        printf("\n=== Starting execution ===\n\n");
-    }
+            case OP_ERROR:
+                if (!ensure_operands(ip, 2)) {
+                    vm_error(vm, "CPU Fault: ERROR truncated at 0x%04X\n", (unsigned)ip);
+                } else {
+                    vm_error(vm, "CPU Fault: ERROR 0x%02X at 0x%04X\n", memory[ip + 1], (unsigned)ip);
+                }
+                running = 0;
+                break;
 
-    execute(0);
+            // Block Memory
+            case OP_BCOPY: {
+                if (!ensure_operands(ip, 7)) {
+                    vm_error(vm, "CPU Fault: BCOPY truncated at 0x%04X\n", (unsigned)ip);
+                    running = 0; break;
+                }
+                if (!operands_fit(&memory[ip])) {
+                    vm_error(vm, "CPU Fault: BCOPY out of bounds at 0x%04X\n", (unsigned)ip);
+                    running = 0; break;
+                }
+                uint16_t src = ((uint16_t)memory[ip + 1] << 8) | memory[ip + 2];
+                uint16_t dest = ((uint16_t)memory[ip + 3] << 8) | memory[ip + 4];
+                uint16_t len = ((uint16_t)memory[ip + 5] << 8) | memory[ip + 6];
+                memmove(&memory[dest], &memory[src], len);
+                ip += 7;
+                break;
+            }
 
-    // Post-execution
-    if (debug_mode) {
-        if (dump_start < 0) dump_start = 0x00;
-        if (dump_end < 0) dump_end = 0xFF;
-        dump_memory((uint32_t)dump_start, (uint32_t)dump_end);
+            case OP_BFILL: {
+                if (!ensure_operands(ip, 6)) {
+                    vm_error(vm, "CPU Fault: BFILL truncated at 0x%04X\n", (unsigned)ip);
+                    running = 0; break;
+                }
+                if (!operands_fit(&memory[ip])) {
+                    vm_error(vm, "CPU Fault: BFILL out of bounds at 0x%04X\n", (unsigned)ip);
+                    running = 0; break;
+                }
+                uint16_t dest = ((uint16_t)memory[ip + 1] << 8) | memory[ip + 2];
+                uint16_t len = ((uint16_t)memory[ip + 3] << 8) | memory[ip + 4];
+                memset(&memory[dest], memory[ip + 5], len);
+                ip += 6;
+                break;
+            }
 
-        if (overflow_flag) {
-            printf("[!] Overflow flag is SET\n");
-        }
-        if (stack_pointer > 0) {
-            printf("[!] Warning: Stack not empty (depth=%u)\n", (unsigned)stack_pointer);
-        }
+            case OP_BCMP: {
+                if (!ensure_operands(ip, 8)) {
+                    vm_error(vm, "CPU Fault: BCMP truncated at 0x%04X\n", (unsigned)ip);
+                    running = 0; break;
+                }
+                if (!operands_fit(&memory[ip])) {
+                    vm_error(vm, "CPU Fault: BCMP out of bounds at 0x%04X\n", (unsigned)ip);
+                    running = 0; break;
+                }
+                uint16_t a = ((uint16_t)memory[ip + 1] << 8) | memory[ip + 2];
+                uint16_t b = ((uint16_t)memory[ip + 3] << 8) | memory[ip + 4];
+                uint16_t len = ((uint16_t)memory[ip + 5] << 8) | memory[ip + 6];
+                memory[memory[ip + 7]] = (memcmp(&memory[a], &memory[b], len) == 0) ? 1 : 0;
+                ip += 8;
+                break;
+            }
+
+            // Banked Memory
+            case OP_BANK: {
+                if (!ensure_operands(ip, 5)) {
+                    vm_error(vm, "CPU Fault: BANK truncated at 0x%04X\n", (unsigned)ip);
+                    running = 0; break;
+                }
+                if (!operands_fit(&memory[ip])) {
+                    vm_error(vm, "CPU Fault: BANK out of bounds at 0x%04X\n", (unsigned)ip);
+                    running = 0; break;
+                }
+                if (bank_switch(vm, ip) != 0) {
+                    running = 0; break;
+                }
+                ip += 5;
+                break;
+            }
+
+            case OP_BANKLEN: {
+                if (!ensure_operands(ip, 4)) {
+                    vm_error(vm, "CPU Fault: BANKLEN truncated at 0x%04X\n", (unsigned)ip);
+                    running = 0; break;
+                }
+                if (!operands_fit(&memory[ip])) {
+                    vm_error(vm, "CPU Fault: BANKLEN out of bounds at 0x%04X\n", (unsigned)ip);
+                    running = 0; break;
+                }
+                uint16_t dest = ((uint16_t)memory[ip + 2] << 8) | memory[ip + 3];
+                uint16_t pages = bank_length(vm, memory[ip + 1]);
+                memory[dest] = (uint8_t)(pages >> 8);
+                memory[dest + 1] = (uint8_t)pages;
+                ip += 4;
+                break;
+            }
+
+            default:
+                vm_error(vm, "CPU Fault: Unknown opcode 0x%02X at 0x%04X\n", opcode, (unsigned)ip);
+                running = 0;
+                break;
+        }
+    }
+
+    vm->ip = ip;   // the HALT or the faulting instruction
+    if (vm->debug_mode) {
+        fprintf(vm->out, "\nExecution ended. Instructions executed: %llu\n", (unsigned long long)vm->instruction_count);
+    }
+    return status;
+}
+
+ // Decoded instruction cache
+ // One entry per address, filled the first time the threaded engine runs the
+ // instruction there. Stores check a per-page bitmap first (pages with no
+ // decoded code cost nothing more), then the per-byte map, since .shred
+ // programs usually keep their data right next to the code in page 0. A store
+ // that really lands on code drops the entries covering that byte so
+ // self-modifying code still works.
+ //
+ // Neither the cache nor code_bytes[] exists until something needs it: the
+ // switch engine never decodes, and a clone that only waits on GETC or runs
+ // the switch engine shouldn't pay for a 1MB cache. The cache is an anonymous
+ // mapping where there is mmap, and code_bytes[] comes from alloc_memory(), so
+ // only the pages holding code are ever touched (a recycled malloc chunk would
+ // be zeroed in full).
+#define DECODE_CACHE_SIZE ((MEMORY_SIZE + 1) * sizeof(decoded_insn))
+
+static uint8_t *alloc_memory(void);
+static void release_memory(uint8_t *memory);
+
+ // Returns 0, or -1 if it can't be had
+static int code_bytes_alloc(shred_vm *vm) {
+    if (!vm->code_bytes) vm->code_bytes = alloc_memory();
+    return vm->code_bytes ? 0 : -1;
+}
+
+ // the decode cache and code_bytes[], for the threaded engine
+ // Returns 0, or -1 if they can't be had
+static int decode_cache_alloc(shred_vm *vm) {
+    if (code_bytes_alloc(vm) != 0) return -1;
+    if (vm->decode_cache) return 0;
+#if HAVE_MMAP
+    void *cache = mmap(NULL, DECODE_CACHE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    vm->decode_cache = (cache == MAP_FAILED) ? NULL : cache;
+#else
+    vm->decode_cache = calloc(MEMORY_SIZE + 1, sizeof(decoded_insn));
+#endif
+    return vm->decode_cache ? 0 : -1;
+}
+
+static void decode_cache_free(decoded_insn *cache) {
+    if (!cache) return;
+#if HAVE_MMAP
+    munmap(cache, DECODE_CACHE_SIZE);
+#else
+    free(cache);
+#endif
+}
+
+ // forget all decoded code; only pages that ever held some get cleared, so a
+ // small program costs a few KB here rather than the whole 1MB cache.
+ // code_bytes[] flags in keep stay set
+static void reset_decode_cache(shred_vm *vm, uint8_t keep) {
+    for (uint32_t page = 0; page < CODE_PAGE_COUNT; page++) {
+        if (!((vm->code_pages[page >> 3] >> (page & 7)) & 1)) continue;
+        uint32_t start = page << CODE_PAGE_SHIFT;
+        uint8_t left = 0;
+        if (vm->decode_cache) memset(&vm->decode_cache[start], 0, sizeof(decoded_insn) << CODE_PAGE_SHIFT);
+        if (keep) {
+            for (uint32_t i = start; i < start + (1U << CODE_PAGE_SHIFT); i++) left |= (vm->code_bytes[i] &= keep);
+        } else {
+            memset(&vm->code_bytes[start], 0, 1U << CODE_PAGE_SHIFT);
+        }
+        if (!left) vm->code_pages[page >> 3] &= (uint8_t)~(1U << (page & 7));
+    }
+}
+
+// macro rather than a function so it always inlines into the store path
+// (expects code_pages and code_bytes in scope)
+#define IS_CODE(addr)   (((code_pages[(addr) >> (CODE_PAGE_SHIFT + 3)] >> (((addr) >> CODE_PAGE_SHIFT) & 7)) & 1) \
+                         && code_bytes[(addr)])
+
+ // IS_CODE for block stores: any page of [addr, addr + len) holding code (len > 0)
+static ALWAYS_INLINE int range_has_code(const uint8_t *code_pages, uint32_t addr, uint32_t len) {
+    for (uint32_t page = addr >> CODE_PAGE_SHIFT; page <= (addr + len - 1) >> CODE_PAGE_SHIFT; page++) {
+        if ((code_pages[page >> 3] >> (page & 7)) & 1) return 1;
+    }
+    return 0;
+}
+
+ // flag [addr, addr + len) as code (flags never get cleared, stale ones only cost a lookup)
+static void mark_code(shred_vm *vm, uint32_t addr, uint32_t len, uint8_t flag) {
+    for (uint32_t i = addr; i < addr + len; i++) {
+        uint32_t page = i >> CODE_PAGE_SHIFT;
+        vm->code_pages[page >> 3] |= (uint8_t)(1U << (page & 7));
+        vm->code_bytes[i] |= flag;
+    }
+}
+
+static void jit_invalidate(shred_vm *vm, uint32_t addr, uint32_t len);
+
+ // drop every decoded instruction (and compiled block) that covers [addr, addr + len)
+static void invalidate_code(shred_vm *vm, uint32_t addr, uint32_t len) {
+    uint32_t first = (addr >= MAX_INSN_LEN - 1) ? addr - (MAX_INSN_LEN - 1) : 0;
+    int jit_hit = 0, ctrl_hit = 0;
+    decoded_insn *const cache = vm->decode_cache;   // NULL when only IF/FOR marked code (BANK under execute())
+    for (uint32_t s = first; s < addr + len && s < MEMORY_SIZE; s++) {
+        if (cache && cache[s].handler != H_DECODE && s + cache[s].length > addr) {
+            cache[s].handler = H_DECODE;
+        }
+        if (s >= addr) {
+            jit_hit |= vm->code_bytes[s] & CODE_JIT;
+            ctrl_hit |= vm->code_bytes[s] & CODE_CTRL;
+        }
+    }
+    if (jit_hit) jit_invalidate(vm, addr, len);
+    if (ctrl_hit) ctrl_forget(vm);
+}
+
+ // match up the IF/FOR at opener and record all of its clauses in vm->ctrl
+ // Returns 0, or -1 after printing the fault
+static int ctrl_resolve(shred_vm *vm, uint32_t opener) {
+    const uint8_t *memory = vm->memory;
+    uint32_t bad;
+    int32_t end = ctrl_match(memory, opener, &bad);
+    if (end < 0) {
+        if (bad == opener) {
+            vm_error(vm, "CPU Fault: %s without THEN at 0x%04X\n", op_table[memory[bad]].name, (unsigned)bad);
+        } else {
+            vm_error(vm, "CPU Fault: %s out of place at 0x%04X\n", op_table[memory[bad]].name, (unsigned)bad);
+        }
+        return -1;
+    }
+    if (!vm->ctrl && (vm->ctrl = calloc(1, sizeof(ctrl_table)))) vm->ctrl->gen = 1;
+    if (!vm->ctrl || code_bytes_alloc(vm) != 0) {
+        vm_error(vm, "CPU Fault: Out of memory matching %s at 0x%04X\n",
+                op_table[memory[opener]].name, (unsigned)opener);
+        return -1;
+    }
+
+    ctrl_table *t = vm->ctrl;
+    uint32_t k = opener;
+    for (;;) {
+        uint32_t next = (k == (uint32_t)end) ? k : (uint32_t)ctrl_next_clause(memory, k);
+        t->at[k].gen = t->gen;
+        t->at[k].opener = (uint16_t)opener;
+        t->at[k].next = (uint16_t)next;
+        t->at[k].end = (uint16_t)end;
+        if (k == (uint32_t)end) break;
+        k = next;
+    }
+    mark_code(vm, opener, (uint32_t)end + 1 - opener, CODE_CTRL);
+    return 0;
+}
+
+static ctrl_entry *ctrl_lookup(shred_vm *vm, uint32_t ip) {
+    const uint8_t *memory = vm->memory;
+    uint8_t opcode = memory[ip];
+    int32_t opener = (int32_t)ip;
+    if (opcode != OP_IF && opcode != OP_FOR) {
+        // a clause: resolve its IF/FOR again
+        if (vm->ctrl && vm->ctrl->at[ip].gen != 0) {
+            opener = vm->ctrl->at[ip].opener;
+            if (memory[opener] != OP_IF && memory[opener] != OP_FOR) goto outside;
+        } else if ((opener = ctrl_claimant(memory, ip)) < 0) {
+            goto outside;
+        }
+    }
+    if (ctrl_resolve(vm, (uint32_t)opener) != 0) return NULL;
+    if (vm->ctrl->at[ip].gen == vm->ctrl->gen) return &vm->ctrl->at[ip];
+
+outside:
+    vm_error(vm, "CPU Fault: %s outside IF/FOR at 0x%04X\n", op_table[opcode].name, (unsigned)ip);
+    return NULL;
+}
+
+ // check that the instruction at ip can run at all
+ // Returns its length, or 0 for anything execute() would fault on (printed to report unless NULL)
+static uint32_t check_insn(const uint8_t *memory, uint32_t ip, FILE *report) {
+    if (!is_valid_address(ip)) {
+        if (report) fprintf(report, "CPU Fault: IP 0x%04X out of bounds\n", (unsigned)ip);
+        return 0;
+    }
+
+    uint8_t opcode = memory[ip];
+    const op_info *info = &op_table[opcode];
+    if (info->length == 0) {
+        if (report) fprintf(report, "CPU Fault: Unknown opcode 0x%02X at 0x%04X\n", opcode, (unsigned)ip);
+        return 0;
+    }
+    if (!ensure_operands(ip, info->length)) {
+        if (report) fprintf(report, "CPU Fault: %s truncated at 0x%04X\n", info->name, (unsigned)ip);
+        return 0;
+    }
+    if (opcode == OP_COMMENT && ip + 2 + memory[ip + 1] > MEMORY_SIZE) {
+        if (report) fprintf(report, "CPU Fault: COMMENT overflows memory at 0x%04X\n", (unsigned)ip);
+        return 0;
+    }
+    if (!operands_fit(&memory[ip])) {
+        if (report) fprintf(report, "CPU Fault: %s out of bounds at 0x%04X\n", info->name, (unsigned)ip);
+        return 0;
+    }
+    return info->length;
+}
+
+ // Static analysis (--analyze, --emit-c, .shbin metadata)
+ // Walks everything reachable from the entry address. Store targets are
+ // always operand constants and the only computed jumps are returns to RUN
+ // return addresses, so if no store can land on a byte read as code the
+ // program can't modify itself: the control flow is fixed, --emit-c can
+ // translate it exactly and the engines can skip their store checks.
+ // reach[] gets AOT_INSN for every reachable instruction start (or AOT_FAULT
+ // where execute() would fault), code[] every byte read as an instruction,
+ // including everything an IF/FOR scans to find its clauses. opener[] is the
+ // IF/FOR of every clause marked AOT_CLAUSE.
+#define AOT_INSN    0x01
+#define AOT_FAULT   0x02
+#define AOT_RETURN  0x04   // a RUN/RUN16 return address, needs a dispatch case
+#define AOT_CLAUSE  0x08   // ELSEIF/ELSE/THEN of a reachable IF/FOR
+#define AOT_LEADER  0x10   // starts a basic block: the entry or a jump, call or return target
+
+typedef struct {
+    uint8_t  reach[MEMORY_SIZE + 1];   // AOT_* flags
+    uint8_t  code[MEMORY_SIZE];
+    uint16_t opener[MEMORY_SIZE];
+    uint32_t work[MEMORY_SIZE + 1];
+    uint32_t edges;                    // control flow edges, fall-through included
+    uint32_t calls;                    // reachable RUN/RUN16
+    uint32_t stores;                   // reachable instructions that store
+    int32_t  smc_at;                   // first store that can hit code, -1 if none
+    int32_t  smc_target;               // the code byte it hits, -1 for a clause with two IF/FORs
+} code_analysis;
+
+static void aot_queue(code_analysis *a, uint32_t *top, uint32_t addr, uint8_t flags) {
+    a->edges++;
+    a->reach[addr] |= flags;
+    if (!(a->reach[addr] & (AOT_INSN | AOT_FAULT))) {
+        a->reach[addr] |= AOT_INSN;
+        a->work[(*top)++] = addr;
+    }
+}
+
+ // Returns 1 if no store can ever hit reachable code
+static int aot_analyze(const uint8_t *memory, uint32_t entry, code_analysis *a) {
+    uint8_t *reach = a->reach, *code = a->code;
+    uint32_t top = 0;
+
+    memset(reach, 0, sizeof(a->reach));
+    memset(code, 0, sizeof(a->code));
+    a->edges = a->calls = a->stores = 0;
+    a->smc_at = a->smc_target = -1;
+    a->work[top++] = entry;
+    reach[entry] = AOT_INSN | AOT_LEADER;
+
+    while (top > 0) {
+        uint32_t ip = a->work[--top];
+        uint32_t length = check_insn(memory, ip, NULL);
+        if (!length) {
+            // a store could still turn this into a valid instruction
+            reach[ip] = AOT_FAULT | (reach[ip] & AOT_LEADER);
+            if (ip < MEMORY_SIZE) code[ip] = 1;
+            continue;
+        }
+        memset(&code[ip], 1, length);
+
+        const uint8_t *p = &memory[ip + 1];
+        uint8_t opcode = memory[ip];
+        uint32_t succ[2];
+        uint32_t nsucc = 0;
+        uint8_t lead = AOT_LEADER;
+
+        switch (opcode) {
+            case OP_JMP:     succ[nsucc++] = p[0]; break;
+            case OP_JMP16:   succ[nsucc++] = ((uint32_t)p[0] << 8) | p[1]; break;
+            case OP_JZ:      succ[nsucc++] = p[0]; succ[nsucc++] = ip + length; break;
+            case OP_JZ16:    succ[nsucc++] = ((uint32_t)p[0] << 8) | p[1]; succ[nsucc++] = ip + length; break;
+            case OP_RUN:
+            case OP_RUN16:
+                succ[nsucc++] = (opcode == OP_RUN) ? p[0] : (((uint32_t)p[0] << 8) | p[1]);
+                succ[nsucc++] = (uint16_t)(ip + length);
+                reach[(uint16_t)(ip + length)] |= AOT_RETURN;
+                a->calls++;
+                break;
+            case OP_COMMENT: succ[nsucc++] = ip + 2 + p[0]; break;
+            case OP_HALT:
+            case OP_RET:     break;   // returns go to RUN return addresses, already queued
+            case OP_IF:
+            case OP_FOR: {
+                // everything the clause scan reads decides where it goes
+                uint32_t bad;
+                int32_t end = ctrl_match(memory, ip, &bad);
+                if (end < 0) {
+                    reach[ip] = AOT_FAULT | (reach[ip] & AOT_LEADER);
+                    memset(&code[ip], 1, ((bad == ip) ? MEMORY_SIZE : bad + 1) - ip);
+                    break;
+                }
+                memset(&code[ip], 1, (uint32_t)end + 1 - ip);
+                for (int32_t k = ctrl_next_clause(memory, ip); ; k = ctrl_next_clause(memory, (uint32_t)k)) {
+                    reach[k] |= AOT_CLAUSE;
+                    a->opener[k] = (uint16_t)ip;
+                    if (memory[k] == OP_ELSEIF) aot_queue(a, &top, (uint32_t)k + 2, AOT_LEADER);
+                    if (k == end) break;
+                }
+                aot_queue(a, &top, ip + 2, AOT_LEADER);
+                aot_queue(a, &top, (uint32_t)end + 1, AOT_LEADER);
+                if (opcode == OP_IF) {
+                    int32_t k = ctrl_next_clause(memory, ip);
+                    while (memory[k] == OP_ELSEIF) k = ctrl_next_clause(memory, (uint32_t)k);
+                    aot_queue(a, &top, (uint32_t)k + 1, AOT_LEADER);
+                }
+                break;
+            }
+            case OP_ELSE:
+            case OP_ELSEIF:
+            case OP_ERROR:   break;   // ELSE/ELSEIF go past the THEN, queued by their IF
+            default:         succ[nsucc++] = ip + length; lead = 0; break;
+        }
+
+        for (uint32_t i = 0; i < nsucc; i++) aot_queue(a, &top, succ[i], lead);
+    }
+
+    // second pass: can any store land on code?
+    for (uint32_t ip = 0; ip < MEMORY_SIZE; ip++) {
+        if (!(reach[ip] & AOT_INSN)) continue;
+        uint32_t span;   // bytes stored from target on
+        int32_t target = store_span(&memory[ip], &span);
+        if (memory[ip] == OP_THEN || memory[ip] == OP_ELSE || memory[ip] == OP_ELSEIF) {
+            // a clause belongs to whichever IF/FOR ran last and claimed it,
+            // or the closest one: fine as long as only one candidate exists
+            int32_t claimant = ctrl_claimant(memory, ip);
+            if (((reach[ip] & AOT_CLAUSE) ? claimant != a->opener[ip] : claimant >= 0) && a->smc_at < 0) {
+                a->smc_at = (int32_t)ip;
+            }
+            if (memory[ip] == OP_THEN && claimant >= 0 && memory[claimant] == OP_FOR) target = memory[claimant + 1];
+        }
+        if (target >= 0) a->stores++;
+        // reach[] only holds instructions that passed check_insn(), so a
+        // word or block store is inside memory
+        for (uint32_t k = 0; target >= 0 && k < span && a->smc_at < 0; k++) {
+            if (code[target + k]) {
+                a->smc_at = (int32_t)ip;
+                a->smc_target = target + (int32_t)k;
+            }
+        }
+    }
+    return a->smc_at < 0;
+}
+
+ // can runs of this image skip the store checks? Only if no store reaches
+ // code and all the code is inside the image: a .shbin doesn't set memory
+ // past it, so that may hold anything when it loads
+static int fixed_code_image(const uint8_t *memory, uint32_t entry, uint32_t image_len) {
+    code_analysis *a = malloc(sizeof(code_analysis));
+    int fixed = a && aot_analyze(memory, entry, a);
+    for (uint32_t i = image_len; fixed && i < MEMORY_SIZE; i++) {
+        if (a->code[i]) fixed = 0;
+    }
+    free(a);
+    return fixed;
+}
+
+ // superinstructions: pairs that keep showing up in profiles, a counter or
+ // compare followed by the branch that tests its result (DEC/CMP then JZ or
+ // JZ16 on the byte just written) and INC followed by a JMP/JMP16 back-edge.
+ // The pair dispatches once but still counts as two instructions.
+ // Returns the handler id for first (ip, length len) fused with the
+ // instruction after it and sets *target to that one's jump target, or 0
+static uint16_t fuse_insn(const uint8_t *memory, uint32_t ip, uint32_t len, uint16_t *target) {
+    uint32_t next = ip + len;
+    if (!check_insn(memory, next, NULL)) return 0;
+
+    uint8_t first = memory[ip];
+    uint8_t cell = memory[ip + ((first == OP_CMP) ? 3 : 1)];  // the byte first writes
+    const uint8_t *q = &memory[next + 1];
+    switch (memory[next]) {
+        case OP_JZ:
+            if (first == OP_INC || q[1] != cell) return 0;
+            *target = q[0];
+            return (first == OP_DEC) ? H_DEC_JZ : H_CMP_JZ;
+        case OP_JZ16:
+            if (first == OP_INC || q[2] != cell) return 0;
+            *target = (uint16_t)((q[0] << 8) | q[1]);
+            return (first == OP_DEC) ? H_DEC_JZ16 : H_CMP_JZ16;
+        case OP_JMP:
+            if (first != OP_INC) return 0;
+            *target = q[0];
+            return H_INC_JMP;
+        case OP_JMP16:
+            if (first != OP_INC) return 0;
+            *target = (uint16_t)((q[0] << 8) | q[1]);
+            return H_INC_JMP16;
+        default:
+            return 0;
+    }
+}
+
+ // decode the instruction at ip into the cache
+ // Returns NULL (after printing the fault) for anything execute() would fault on
+static decoded_insn *decode_insn(shred_vm *vm, uint32_t ip) {
+    uint32_t length = check_insn(vm->memory, ip, NULL);
+    if (!length) {
+        out_flush(vm);
+        check_insn(vm->memory, ip, vm->err);   // again, this time printing the fault
+        return NULL;
+    }
+
+    uint8_t opcode = vm->memory[ip];
+    decoded_insn *d = &vm->decode_cache[ip];
+    const uint8_t *p = &vm->memory[ip + 1];
+    d->a = (length > 1) ? p[0] : 0;
+    d->b = (length > 2) ? p[1] : 0;
+    d->c = (length > 3) ? p[2] : 0;
+
+    switch (opcode) {
+        case OP_RUN:     d->b = (uint16_t)(ip + 2); break;    // return address
+        case OP_COMMENT: d->a = (uint16_t)(ip + 2 + p[0]); break;  // == MEMORY_SIZE wraps to 0, see handler
+        case OP_POKE16:
+            d->a = (uint16_t)((p[0] << 8) | p[1]);
+            d->b = p[2];
+            break;
+        case OP_MOVE16:
+            d->a = (uint16_t)((p[0] << 8) | p[1]);
+            d->b = (uint16_t)((p[2] << 8) | p[3]);
+            break;
+        case OP_JMP16:
+            d->a = (uint16_t)((p[0] << 8) | p[1]);
+            break;
+        case OP_JZ16:
+            d->a = (uint16_t)((p[0] << 8) | p[1]);
+            d->b = p[2];
+            break;
+        case OP_RUN16:
+            d->a = (uint16_t)((p[0] << 8) | p[1]);
+            d->b = (uint16_t)(ip + 3);
+            break;
+        case OP_PUSH16_MEM:
+        case OP_POP16_MEM:
+        case OP_BNOT16:
+            d->a = (uint16_t)((p[0] << 8) | p[1]);
+            break;
+        case OP_BAND16:  // a, b, dest
+        case OP_BOR16:
+        case OP_BXOR16:
+        case OP_BNAND16:
+        case OP_LT16_CMP:   // a, b, result (8-bit)
+        case OP_GT16_CMP:
+            d->a = (uint16_t)((p[0] << 8) | p[1]);
+            d->b = (uint16_t)((p[2] << 8) | p[3]);
+            d->c = (opcode == OP_LT16_CMP || opcode == OP_GT16_CMP) ? p[4] : (uint16_t)((p[4] << 8) | p[5]);
+            break;
+        case OP_BCOPY:   // src, dest, len
+        case OP_BCMP:    // a, b, len, result
+            d->a = (uint16_t)((p[0] << 8) | p[1]);
+            d->b = (uint16_t)((p[2] << 8) | p[3]);
+            d->c = (uint16_t)((p[4] << 8) | p[5]);
+            d->x = (opcode == OP_BCMP) ? p[6] : 0;
+            break;
+        case OP_BFILL:   // dest, len, value
+            d->a = (uint16_t)((p[0] << 8) | p[1]);
+            d->b = (uint16_t)((p[2] << 8) | p[3]);
+            d->c = p[4];
+            break;
+        case OP_BANKLEN: // file, dest
+            d->a = p[0];
+            d->b = (uint16_t)((p[1] << 8) | p[2]);
+            break;
+        default:
+            break;
+    }
+
+    d->opcode = opcode;
+    d->handler = H_OP(opcode);
+    if (vm->fuse && (opcode == OP_INC || opcode == OP_DEC || opcode == OP_CMP)) {
+        uint16_t fused = fuse_insn(vm->memory, ip, length, &d->x);
+        if (fused) {
+            // the entry spans both (at most MAX_INSN_LEN bytes), so a store
+            // into the second one drops it too
+            d->handler = fused;
+            length += op_table[vm->memory[ip + length]].length;
+        }
+    }
+    d->length = (uint8_t)length;
+    mark_code(vm, ip, length, CODE_DECODED);
+    return d;
+}
+
+ // x86-64 JIT for hot basic blocks
+ // The threaded engine counts how often each branch target is reached; once a
+ // target gets JIT_THRESHOLD hits the straight-line code from there up to the
+ // next JMP/JZ/RUN/HALT/RET (or their 16-bit forms) is compiled to native code.
+ // Blocks only cover the easy cases. Anything that could fault (DIV by zero,
+ // stack overflow/underflow, HALT with an empty stack) or does I/O exits back
+ // to the interpreter *before* that instruction, so the interpreter prints the
+ // exact same fault. Stores check code_bytes[] and leave the block as soon as
+ // one lands on code, the interpreter then invalidates it. IF/FOR/THEN/ELSE
+ // are compiled from vm->ctrl once the interpreter has resolved them, and a
+ // block using those targets is dropped when the table's generation changes.
+ //
+ // Register use inside a block: rdi = memory[], rsi = jit_ctx, r9 = code_bytes,
+ // eax/ecx/edx scratch.
+#if HAVE_JIT
+#define JIT_THRESHOLD        50U
+#define JIT_CODE_SIZE        (1U << 20)
+#define JIT_MAX_BLOCKS       4096U
+#define JIT_MAX_BLOCK_INSNS  64U
+#define JIT_MAX_BLOCK_CODE   16384U
+#define JIT_MAX_EXITS        (JIT_MAX_BLOCK_INSNS * 2)
+
+#define JIT_EXIT_NORMAL      0   // continue interpreting at ctx.ip
+#define JIT_EXIT_CODE_STORE  1   // same, but ctx.store_addr hit a code page first
+
+typedef struct {
+    uint32_t  ip;          // out: next instruction for the interpreter
+    uint32_t  executed;    // out: instructions retired by the block
+    uint32_t  store_addr;  // out: JIT_EXIT_CODE_STORE only
+    uint16_t  sp;          // in/out: stack_pointer
+    uint8_t   overflow;    // in/out: overflow_flag
+    uint16_t *stack;       // in: call_stack
+} jit_ctx;
+
+typedef int (*jit_fn)(uint8_t *mem, jit_ctx *ctx, const uint8_t *code);
+
+typedef struct {
+    jit_fn   entry;
+    uint32_t start, end;      // code bytes [start, end) the block was built from
+    uint32_t insn_count;      // most instructions one pass can retire
+    uint32_t code_offset;     // where its native code starts in jit->code
+    uint32_t ctrl_gen;        // vm->ctrl generation its IF/FOR targets came from, 0 = none
+} jit_block;
+
+struct jit_state {
+    uint8_t   *code;                     // mmap'd, RX except while compiling
+    uint32_t   code_used;
+    int        unavailable;              // mmap/mprotect refused, stay interpreted
+    jit_block  blocks[JIT_MAX_BLOCKS];
+    uint32_t   block_count;
+    jit_block *block_at[MEMORY_SIZE];
+    uint16_t   hits[MEMORY_SIZE];
+};
+
+ // code emitter
+typedef struct {
+    uint32_t patch;           // offset of the rel32 to point at the stub
+    uint32_t ip, executed, store_addr;
+    int      status;
+} jit_exit;
+
+typedef struct {
+    uint8_t *start, *p;
+    jit_exit exits[JIT_MAX_EXITS];
+    uint32_t exit_count;
+    int      fixed_code;      // vm->fixed_code: stores can't reach code, no need to check them
+} jit_emitter;
+
+static void emit8(jit_emitter *e, uint8_t b)    { *e->p++ = b; }
+static void emit32(jit_emitter *e, uint32_t v)  { memcpy(e->p, &v, 4); e->p += 4; }
+
+static void emit_bytes(jit_emitter *e, const char *bytes, uint32_t n) {
+    memcpy(e->p, bytes, n);
+    e->p += n;
+}
+
+ // opcode bytes followed by a disp32/imm32
+static void emit_op32(jit_emitter *e, const char *bytes, uint32_t n, uint32_t v) {
+    emit_bytes(e, bytes, n);
+    emit32(e, v);
+}
+
+#define CTX_OFF(field) ((uint32_t)offsetof(jit_ctx, field))
+
+ // movzx eax/ecx, byte [rdi + addr]
+static void emit_load_eax(jit_emitter *e, uint32_t addr) { emit_op32(e, "\x0F\xB6\x87", 3, addr); }
+static void emit_load_ecx(jit_emitter *e, uint32_t addr) { emit_op32(e, "\x0F\xB6\x8F", 3, addr); }
+
+ // conditional branch (0F 8x) to an exit stub filled in after the body
+static void emit_exit_jcc(jit_emitter *e, uint8_t cc, uint32_t ip, uint32_t executed,
+                          uint32_t store_addr, int status) {
+    jit_exit *x = &e->exits[e->exit_count++];
+    emit8(e, 0x0F);
+    emit8(e, cc);
+    x->patch = (uint32_t)(e->p - e->start);
+    emit32(e, 0);
+    x->ip = ip;
+    x->executed = executed;
+    x->store_addr = store_addr;
+    x->status = status;
+}
+
+ // leave the block with a constant next ip
+static void emit_exit(jit_emitter *e, uint32_t ip, uint32_t executed, uint32_t store_addr, int status) {
+    emit_op32(e, "\xC7\x86", 2, CTX_OFF(ip));        emit32(e, ip);
+    emit_op32(e, "\xC7\x86", 2, CTX_OFF(executed));  emit32(e, executed);
+    if (status == JIT_EXIT_CODE_STORE) {
+        emit_op32(e, "\xC7\x86", 2, CTX_OFF(store_addr)); emit32(e, store_addr);
+    }
+    emit_op32(e, "\xB8", 1, (uint32_t)status);      // mov eax, status
+    emit8(e, 0xC3);                                 // ret
+}
+
+ // mov byte [rdi + addr], al, then bail out if addr is a code byte
+static void emit_store_al(jit_emitter *e, uint32_t addr, uint32_t next_ip, uint32_t executed) {
+    emit_op32(e, "\x88\x87", 2, addr);
+    if (e->fixed_code) return;
+    emit_op32(e, "\x41\xF6\x81", 3, addr);         // test byte [r9 + addr], 0xFF
+    emit8(e, 0xFF);
+    emit_exit_jcc(e, 0x85, next_ip, executed, addr, JIT_EXIT_CODE_STORE);  // jnz
+}
+
+ // pop a return address into ctx.ip, or exit before the instruction if the stack is empty
+static void emit_return(jit_emitter *e, uint32_t ip, uint32_t n) {
+    emit_op32(e, "\x0F\xB7\x86", 3, CTX_OFF(sp));   // movzx eax, word [rsi+sp]
+    emit_bytes(e, "\x85\xC0", 2);                   // test eax, eax
+    emit_exit_jcc(e, 0x84, ip, n, 0, JIT_EXIT_NORMAL);  // jz -> interpreter
+    emit_bytes(e, "\xFF\xC8", 2);                   // dec eax
+    emit_op32(e, "\x66\x89\x86", 3, CTX_OFF(sp));   // mov [rsi+sp], ax
+    emit_op32(e, "\x48\x8B\x96", 3, CTX_OFF(stack)); // mov rdx, [rsi+stack]
+    emit_bytes(e, "\x0F\xB7\x04\x42", 4);           // movzx eax, word [rdx+rax*2]
+    emit_op32(e, "\x89\x86", 2, CTX_OFF(ip));       // mov [rsi+ip], eax
+    emit_op32(e, "\xC7\x86", 2, CTX_OFF(executed)); emit32(e, n + 1);
+    emit_bytes(e, "\x31\xC0\xC3", 3);               // xor eax, eax; ret
+}
+
+ // push ret_addr and jump to target, or exit before the instruction on overflow
+static void emit_call(jit_emitter *e, uint32_t ip, uint32_t n, uint32_t target, uint16_t ret_addr) {
+    emit_op32(e, "\x0F\xB7\x86", 3, CTX_OFF(sp));   // movzx eax, word [rsi+sp]
+    emit_bytes(e, "\x83\xF8", 2);                   // cmp eax, STACK_SIZE
+    emit8(e, (uint8_t)STACK_SIZE);
+    emit_exit_jcc(e, 0x83, ip, n, 0, JIT_EXIT_NORMAL);  // jae -> interpreter
+    emit_op32(e, "\x48\x8B\x96", 3, CTX_OFF(stack)); // mov rdx, [rsi+stack]
+    emit_bytes(e, "\x66\xC7\x04\x42", 4);           // mov word [rdx+rax*2], ret_addr
+    emit8(e, (uint8_t)(ret_addr & 0xFF));
+    emit8(e, (uint8_t)(ret_addr >> 8));
+    emit_bytes(e, "\xFF\xC0", 2);                   // inc eax
+    emit_op32(e, "\x66\x89\x86", 3, CTX_OFF(sp));   // mov [rsi+sp], ax
+    emit_exit(e, target, n + 1, 0, JIT_EXIT_NORMAL);
+}
+
+ // set overflow_flag from a setcc on dl
+static void emit_overflow_from(jit_emitter *e, uint8_t setcc) {
+    emit8(e, 0x0F);
+    emit8(e, setcc);
+    emit8(e, 0xC2);                                 // setcc dl
+    emit_op32(e, "\x88\x96", 2, CTX_OFF(overflow)); // mov [rsi+overflow], dl
+}
+
+static void jit_protect(jit_state *jit, int writable) {
+    if (mprotect(jit->code, JIT_CODE_SIZE,
+                 writable ? (PROT_READ | PROT_WRITE) : (PROT_READ | PROT_EXEC)) != 0) {
+        jit->unavailable = 1;
+    }
+}
+
+ // throw away every compiled block
+static void jit_flush(jit_state *jit) {
+    for (uint32_t i = 0; i < jit->block_count; i++) {
+        jit->block_at[jit->blocks[i].start] = NULL;
+    }
+    jit->block_count = 0;
+    jit->code_used = 0;
+}
+
+static void jit_reset(shred_vm *vm) {
+    if (!vm->jit) return;
+    jit_flush(vm->jit);
+    memset(vm->jit->hits, 0, sizeof(vm->jit->hits));
+}
+
+static void jit_invalidate(shred_vm *vm, uint32_t addr, uint32_t len) {
+    jit_state *jit = vm->jit;
+    for (uint32_t i = 0; i < jit->block_count; i++) {
+        jit_block *b = &jit->blocks[i];
+        if (b->entry && addr < b->end && addr + len > b->start) {
+            jit->block_at[b->start] = NULL;
+            jit->hits[b->start] = 0;
+            b->entry = NULL;
+        }
+    }
+    // dead blocks at the end hand back their slots and code, so a loop that
+    // keeps rewriting itself doesn't fill the table and slow every scan down
+    while (jit->block_count > 0 && !jit->blocks[jit->block_count - 1].entry) {
+        jit->block_count--;
+        jit->code_used = jit->blocks[jit->block_count].code_offset;
+    }
+}
+
+static void jit_destroy(shred_vm *vm) {
+    if (!vm->jit) return;
+    if (vm->jit->code) munmap(vm->jit->code, JIT_CODE_SIZE);
+    free(vm->jit);
+    vm->jit = NULL;
+}
+
+ // compile the block starting at start, NULL if nothing there is worth compiling
+static jit_block *jit_compile(shred_vm *vm, uint32_t start) {
+    jit_state *jit = vm->jit;
+    if (jit->unavailable) return NULL;
+    if (!jit->code) {
+        void *mem = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_EXEC,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            jit->unavailable = 1;
+            return NULL;
+        }
+        jit->code = mem;
+    }
+    if (jit->block_count >= JIT_MAX_BLOCKS || jit->code_used + JIT_MAX_BLOCK_CODE > JIT_CODE_SIZE) {
+        jit_flush(jit);
+    }
+
+    jit_protect(jit, 1);
+    if (jit->unavailable) return NULL;
+
+    jit_emitter em;
+    jit_emitter *e = &em;
+    e->start = e->p = jit->code + jit->code_used;
+    e->exit_count = 0;
+    e->fixed_code = vm->fixed_code;
+
+    emit_bytes(e, "\x49\x89\xD1", 3);               // mov r9, rdx
+
+    uint32_t ip = start, n = 0, end = start, ctrl_gen = 0;
+    int open = 1;
+
+    while (open && n < JIT_MAX_BLOCK_INSNS) {
+        uint32_t len = check_insn(vm->memory, ip, NULL);
+        if (!len) break;    // let the interpreter report the fault
+
+        const uint8_t *p = &vm->memory[ip + 1];
+        uint32_t next = ip + len;
+        uint32_t a16 = (len >= 3) ? (((uint32_t)p[0] << 8) | p[1]) : 0;
+        uint8_t opcode = vm->memory[ip];
+
+        switch (opcode) {
+            case OP_NOP:
+                break;
+            case OP_POKE:
+                emit_bytes(e, "\xB0", 1);               // mov al, value
+                emit8(e, p[1]);
+                emit_store_al(e, p[0], next, n + 1);
+                break;
+            case OP_MOVE:
+                emit_load_eax(e, p[0]);
+                emit_store_al(e, p[1], next, n + 1);
+                break;
+            case OP_NOT:
+                emit_load_eax(e, p[0]);
+                emit_bytes(e, "\xF7\xD0", 2);           // not eax
+                emit_store_al(e, p[0], next, n + 1);
+                break;
+            case OP_INC:
+            case OP_DEC:
+                emit_load_eax(e, p[0]);
+                emit_bytes(e, opcode == OP_INC ? "\xFF\xC0" : "\xFF\xC8", 2);
+                emit_store_al(e, p[0], next, n + 1);
+                break;
+            case OP_NAND: case OP_AND: case OP_OR: case OP_XOR: case OP_CMP:
+            case OP_ADD:  case OP_SUB: case OP_MUL: case OP_SHL: case OP_SHR:
+                emit_load_eax(e, p[0]);
+                emit_load_ecx(e, p[1]);
+                switch (opcode) {
+                    case OP_NAND: emit_bytes(e, "\x21\xC8\xF7\xD0", 4); break;   // and; not
+                    case OP_AND:  emit_bytes(e, "\x21\xC8", 2); break;
+                    case OP_OR:   emit_bytes(e, "\x09\xC8", 2); break;
+                    case OP_XOR:  emit_bytes(e, "\x31\xC8", 2); break;
+                    case OP_CMP:  emit_bytes(e, "\x39\xC8\x0F\x94\xC0", 5); break; // cmp; sete al
+                    case OP_ADD:
+                        emit_bytes(e, "\x01\xC8", 2);                   // add eax, ecx
+                        emit_op32(e, "\x3D", 1, 255);                   // cmp eax, 255
+                        emit_overflow_from(e, 0x97);                    // seta
+                        break;
+                    case OP_SUB:
+                        emit_bytes(e, "\x39\xC8", 2);                   // cmp eax, ecx
+                        emit_overflow_from(e, 0x92);                    // setb
+                        emit_bytes(e, "\x29\xC8", 2);                   // sub eax, ecx
+                        break;
+                    case OP_MUL:
+                        emit_bytes(e, "\x0F\xAF\xC1", 3);               // imul eax, ecx
+                        emit_op32(e, "\x3D", 1, 255);
+                        emit_overflow_from(e, 0x97);
+                        break;
+                    case OP_SHL:  emit_bytes(e, "\x83\xE1\x07\xD3\xE0", 5); break; // and ecx,7; shl eax,cl
+                    case OP_SHR:  emit_bytes(e, "\x83\xE1\x07\xD3\xE8", 5); break; // and ecx,7; shr eax,cl
+                    default: break;
+                }
+                emit_store_al(e, p[2], next, n + 1);
+                break;
+            case OP_DIV:
+                emit_load_eax(e, p[0]);
+                emit_load_ecx(e, p[1]);
+                emit_bytes(e, "\x85\xC9", 2);           // test ecx, ecx
+                emit_exit_jcc(e, 0x84, ip, n, 0, JIT_EXIT_NORMAL);   // divide by zero: interpreter faults
+                emit_bytes(e, "\x31\xD2\xF7\xF1", 4);   // xor edx, edx; div ecx
+                emit_store_al(e, p[2], next, n + 1);
+                break;
+            case OP_POKE16:
+                emit_bytes(e, "\xB0", 1);
+                emit8(e, p[2]);
+                emit_store_al(e, a16, next, n + 1);
+                break;
+            case OP_MOVE16:
+                emit_load_eax(e, a16);
+                emit_store_al(e, ((uint32_t)p[2] << 8) | p[3], next, n + 1);
+                break;
+            case OP_COMMENT:
+                next = ip + 2 + p[0];
+                break;
+            case OP_JMP:
+            case OP_JMP16:
+                emit_exit(e, opcode == OP_JMP ? p[0] : a16, n + 1, 0, JIT_EXIT_NORMAL);
+                open = 0;
+                break;
+            case OP_JZ:
+            case OP_JZ16: {
+                uint32_t target = (opcode == OP_JZ) ? p[0] : a16;
+                uint8_t  cond = (opcode == OP_JZ) ? p[1] : p[2];
+                emit_op32(e, "\x80\xBF", 2, cond);      // cmp byte [rdi+cond], 0
+                emit8(e, 0);
+                emit_exit_jcc(e, 0x84, target, n + 1, 0, JIT_EXIT_NORMAL);  // jz taken
+                emit_exit(e, next, n + 1, 0, JIT_EXIT_NORMAL);
+                open = 0;
+                break;
+            }
+            case OP_RUN:
+                emit_call(e, ip, n, p[0], (uint16_t)next);
+                open = 0;
+                break;
+            case OP_RUN16:
+                emit_call(e, ip, n, a16, (uint16_t)next);
+                open = 0;
+                break;
+            case OP_HALT:
+            case OP_RET:
+                emit_return(e, ip, n);
+                open = 0;
+                break;
+            case OP_IF:
+            case OP_FOR:
+            case OP_THEN:
+            case OP_ELSE:
+            case OP_ELSEIF: {
+                // only once the interpreter has resolved them; the block is
+                // rebuilt when the table's generation moves on
+                const ctrl_table *t = vm->ctrl;
+                if (!t || t->at[ip].gen != t->gen) {
+                    len = 0;
+                    break;
+                }
+                const ctrl_entry *c = &t->at[ip];
+                ctrl_gen = t->gen;
+                if (opcode == OP_IF || opcode == OP_FOR) {
+                    uint32_t skip = c->end + 1U;
+                    if (opcode == OP_IF) {
+                        if (vm->memory[c->next] == OP_ELSEIF) {   // depends on more conditions
+                            len = 0;
+                            break;
+                        }
+                        skip = c->next + 1U;
+                    }
+                    emit_op32(e, "\x80\xBF", 2, p[0]);  // cmp byte [rdi+cond], 0
+                    emit8(e, 0);
+                    emit_exit_jcc(e, 0x84, skip, n + 1, 0, JIT_EXIT_NORMAL);
+                } else if (opcode == OP_THEN) {
+                    if (vm->memory[c->opener] == OP_FOR) {
+                        uint8_t counter = vm->memory[c->opener + 1];
+                        if (!e->fixed_code) {
+                            emit_op32(e, "\x41\xF6\x81", 3, counter);   // test byte [r9 + counter], 0xFF
+                            emit8(e, 0xFF);
+                            emit_exit_jcc(e, 0x85, ip, n, 0, JIT_EXIT_NORMAL);  // counter in code: interpreter
+                        }
+                        emit_load_eax(e, counter);
+                        emit_bytes(e, "\xFF\xC8", 2);                // dec eax
+                        emit_op32(e, "\x88\x87", 2, counter);        // mov [rdi+counter], al
+                        emit_bytes(e, "\x84\xC0", 2);                // test al, al
+                        emit_exit_jcc(e, 0x85, c->opener + 2U, n + 1, 0, JIT_EXIT_NORMAL);
+                    }
+                } else {
+                    emit_exit(e, c->end + 1U, n + 1, 0, JIT_EXIT_NORMAL);
+                    open = 0;
+                }
+                break;
+            }
+            default:
+                // I/O and anything new: end the block in front of it
+                len = 0;
+                break;
+        }
+        if (!len) break;
+
+        if (ip + len > end) end = ip + len;
+        mark_code(vm, ip, len, CODE_JIT);
+        n++;
+        if (open) ip = next;
+    }
+
+    if (n == 0) {
+        jit_protect(jit, 0);
+        return NULL;
+    }
+    if (open) emit_exit(e, ip, n, 0, JIT_EXIT_NORMAL);
+
+    for (uint32_t i = 0; i < e->exit_count; i++) {
+        jit_exit *x = &e->exits[i];
+        int32_t rel = (int32_t)((e->p - e->start) - (x->patch + 4));
+        memcpy(e->start + x->patch, &rel, 4);
+        emit_exit(e, x->ip, x->executed, x->store_addr, x->status);
+    }
+
+    jit_protect(jit, 0);
+    if (jit->unavailable) return NULL;
+
+    jit_block *b = &jit->blocks[jit->block_count++];
+    b->entry = (jit_fn)(void *)e->start;
+    b->code_offset = jit->code_used;
+    b->start = start;
+    b->end = end;
+    b->insn_count = n;
+    b->ctrl_gen = ctrl_gen;
+    jit->code_used += (uint32_t)(e->p - e->start);
+    jit->code_used = (jit->code_used + 15U) & ~15U;
+    jit->block_at[start] = b;
+    return b;
+}
+#else
+static void jit_reset(shred_vm *vm) { (void)vm; }
+static void jit_invalidate(shred_vm *vm, uint32_t addr, uint32_t len) { (void)vm; (void)addr; (void)len; }
+static void jit_destroy(shred_vm *vm) { (void)vm; }
+#endif
+
+ // threaded engine
+ // Same semantics as execute(), but runs from the decoded cache: operands are
+ // already widened and bounds-checked, and each handler jumps straight to the
+ // next one. No debug hooks; profiling and the binary trace swap in a dispatch
+ // table that sends every instruction through them first, so they cost
+ // nothing when off.
+#define INSN_HOOKS(opcode)  do {                                         \
+                                if (profile) profile_insn(profile, memory, ip, opcode, vm->stack_pointer, count); \
+                                if (tracer) trace_insn(tracer, memory, ip, opcode, vm->stack_pointer, \
+                                                       vm->overflow_flag, count); \
+                                if (perf) perf_insn(perf, memory, ip, opcode, vm->stack_pointer); \
+                            } while (0)
+#if HAVE_COMPUTED_GOTO
+#define NEXT()         do {                                              \
+                           if (++count > stop) goto limit_fault;         \
+                           d = &decode_cache[ip];                        \
+                           goto *dispatch[d->handler];                   \
+                       } while (0)
+ // P_ is where hook_handlers enter: profile/trace, then fall into the handler
+#define HANDLER(name)  P_##name: INSN_HOOKS(OP_##name); \
+                       L_##name:
+ // superinstructions have no P_ entry, hook_handlers send them to their first half
+#define FUSED(name)    L_##name:
+ // run a superinstruction's second half? Not when the step budget has only
+ // room for the first, or the first one's store just rewrote the pair
+#define SECOND_HALF()  (count < stop && d->handler != H_DECODE)
+#else
+#define NEXT()         continue
+#define HANDLER(name)  case H_OP(OP_##name):
+#define FUSED(name)    case H_##name:
+#define SECOND_HALF()  (count < stop && d->handler != H_DECODE && !profile && !tracer && !perf)
+#endif
+
+ // control transfers land on block starts, that's where the JIT gets a look in
+#if HAVE_JIT
+#define BRANCH()       do { if (use_jit) goto jit_enter; NEXT(); } while (0)
+#else
+#define BRANCH()       NEXT()
+#endif
+
+ // every store goes through here so decoded code under it gets dropped
+ // (unless the program was proven never to store onto its code)
+#define STORE(addr, value)  do {                                         \
+                                uint32_t st_ = (addr);                   \
+                                memory[st_] = (value);                   \
+                                if (check_stores && IS_CODE(st_)) invalidate_code(vm, st_, 1); \
+                            } while (0)
+#define STORE16(addr, value) do {                                        \
+                                uint32_t st_ = (addr);                   \
+                                uint16_t v_ = (value);                   \
+                                memory[st_] = (uint8_t)(v_ >> 8);        \
+                                memory[st_ + 1] = (uint8_t)v_;           \
+                                if (check_stores && (IS_CODE(st_) || IS_CODE(st_ + 1))) invalidate_code(vm, st_, 2); \
+                            } while (0)
+
+NO_CROSSJUMP static shred_status execute_threaded(shred_vm *vm, uint64_t stop, int use_jit) {
+    uint8_t *const memory = vm->memory;
+    uint16_t *const call_stack = vm->call_stack;
+    uint16_t *const data_stack = vm->data_stack;
+    decoded_insn *const decode_cache = vm->decode_cache;
+    const uint8_t *const code_pages = vm->code_pages;
+    const uint8_t *const code_bytes = vm->code_bytes;
+    const int check_stores = !vm->fixed_code;   // else no store can reach code
+    uint32_t ip = vm->ip;
+    uint64_t count = vm->instruction_count;
+    shred_status status = SHRED_FAULT;
+    decoded_insn *d;
+    exec_profile *const profile = vm->profile;
+    exec_trace *const tracer = vm->trace;
+    exec_perf *const perf = vm->perf;
+#if HAVE_JIT
+    jit_ctx ctx;
+    ctx.stack = call_stack;
+    if (profile || tracer || perf) use_jit = 0;   // compiled blocks would run past the hooks
+    if (use_jit && !vm->jit && !(vm->jit = calloc(1, sizeof(jit_state)))) use_jit = 0;
+#else
+    (void)use_jit;
+#endif
+
+#if HAVE_COMPUTED_GOTO
+    // everything defaults to unknown_op, the real opcodes override it below
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+    static void *const handlers[H_COUNT] = {
+        [0 ... H_COUNT - 1] = &&unknown_op,
+        [H_DECODE]           = &&decode,
+        [H_OP(OP_NOP)]     = &&L_NOP,     [H_OP(OP_POKE)]   = &&L_POKE,
+        [H_OP(OP_MOVE)]    = &&L_MOVE,    [H_OP(OP_NOT)]    = &&L_NOT,
+        [H_OP(OP_NAND)]    = &&L_NAND,    [H_OP(OP_JMP)]    = &&L_JMP,
+        [H_OP(OP_JZ)]      = &&L_JZ,      [H_OP(OP_RUN)]    = &&L_RUN,
+        [H_OP(OP_HALT)]    = &&L_HALT,    [H_OP(OP_AND)]    = &&L_AND,
+        [H_OP(OP_OR)]      = &&L_OR,      [H_OP(OP_XOR)]    = &&L_XOR,
+        [H_OP(OP_INC)]     = &&L_INC,     [H_OP(OP_DEC)]    = &&L_DEC,
+        [H_OP(OP_CMP)]     = &&L_CMP,     [H_OP(OP_COMMENT)] = &&L_COMMENT,
+        [H_OP(OP_PUTC)]    = &&L_PUTC,    [H_OP(OP_PUTN)]   = &&L_PUTN,
+        [H_OP(OP_GETC)]    = &&L_GETC,    [H_OP(OP_RET)]    = &&L_RET,
+        [H_OP(OP_ADD)]     = &&L_ADD,     [H_OP(OP_SUB)]    = &&L_SUB,
+        [H_OP(OP_MUL)]     = &&L_MUL,     [H_OP(OP_DIV)]    = &&L_DIV,
+        [H_OP(OP_SHL)]     = &&L_SHL,     [H_OP(OP_SHR)]    = &&L_SHR,
+        [H_OP(OP_POKE16)]  = &&L_POKE16,  [H_OP(OP_MOVE16)] = &&L_MOVE16,
+        [H_OP(OP_JMP16)]   = &&L_JMP16,   [H_OP(OP_JZ16)]   = &&L_JZ16,
+        [H_OP(OP_RUN16)]   = &&L_RUN16,
+        [H_OP(OP_PUSH)]    = &&L_PUSH,    [H_OP(OP_POP)]    = &&L_POP,
+        [H_OP(OP_PUSH16_MEM)] = &&L_PUSH16_MEM, [H_OP(OP_POP16_MEM)] = &&L_POP16_MEM,
+        [H_OP(OP_BAND16)]  = &&L_BAND16,  [H_OP(OP_BOR16)]  = &&L_BOR16,
+        [H_OP(OP_BXOR16)]  = &&L_BXOR16,  [H_OP(OP_BNOT16)] = &&L_BNOT16,
+        [H_OP(OP_BNAND16)] = &&L_BNAND16,
+        [H_OP(OP_LT16_CMP)] = &&L_LT16_CMP, [H_OP(OP_GT16_CMP)] = &&L_GT16_CMP,
+        [H_OP(OP_IF)]      = &&L_IF,      [H_OP(OP_THEN)]   = &&L_THEN,
+        [H_OP(OP_ELSE)]    = &&L_ELSE,    [H_OP(OP_ELSEIF)] = &&L_ELSEIF,
+        [H_OP(OP_FOR)]     = &&L_FOR,     [H_OP(OP_ERROR)]  = &&L_ERROR,
+        [H_OP(OP_BCOPY)]   = &&L_BCOPY,   [H_OP(OP_BFILL)]  = &&L_BFILL,
+        [H_OP(OP_BCMP)]    = &&L_BCMP,    [H_OP(OP_BANK)]   = &&L_BANK,
+        [H_OP(OP_BANKLEN)] = &&L_BANKLEN,
+        [H_DEC_JZ]         = &&L_DEC_JZ,  [H_DEC_JZ16]      = &&L_DEC_JZ16,
+        [H_CMP_JZ]         = &&L_CMP_JZ,  [H_CMP_JZ16]      = &&L_CMP_JZ16,
+        [H_INC_JMP]        = &&L_INC_JMP, [H_INC_JMP16]     = &&L_INC_JMP16,
+    };
+    static void *const hook_handlers[H_COUNT] = {
+        [0 ... H_COUNT - 1] = &&unknown_op,
+        [H_DECODE]           = &&hook_decode,
+        [H_OP(OP_NOP)]     = &&P_NOP,     [H_OP(OP_POKE)]   = &&P_POKE,
+        [H_OP(OP_MOVE)]    = &&P_MOVE,    [H_OP(OP_NOT)]    = &&P_NOT,
+        [H_OP(OP_NAND)]    = &&P_NAND,    [H_OP(OP_JMP)]    = &&P_JMP,
+        [H_OP(OP_JZ)]      = &&P_JZ,      [H_OP(OP_RUN)]    = &&P_RUN,
+        [H_OP(OP_HALT)]    = &&P_HALT,    [H_OP(OP_AND)]    = &&P_AND,
+        [H_OP(OP_OR)]      = &&P_OR,      [H_OP(OP_XOR)]    = &&P_XOR,
+        [H_OP(OP_INC)]     = &&P_INC,     [H_OP(OP_DEC)]    = &&P_DEC,
+        [H_OP(OP_CMP)]     = &&P_CMP,     [H_OP(OP_COMMENT)] = &&P_COMMENT,
+        [H_OP(OP_PUTC)]    = &&P_PUTC,    [H_OP(OP_PUTN)]   = &&P_PUTN,
+        [H_OP(OP_GETC)]    = &&P_GETC,    [H_OP(OP_RET)]    = &&P_RET,
+        [H_OP(OP_ADD)]     = &&P_ADD,     [H_OP(OP_SUB)]    = &&P_SUB,
+        [H_OP(OP_MUL)]     = &&P_MUL,     [H_OP(OP_DIV)]    = &&P_DIV,
+        [H_OP(OP_SHL)]     = &&P_SHL,     [H_OP(OP_SHR)]    = &&P_SHR,
+        [H_OP(OP_POKE16)]  = &&P_POKE16,  [H_OP(OP_MOVE16)] = &&P_MOVE16,
+        [H_OP(OP_JMP16)]   = &&P_JMP16,   [H_OP(OP_JZ16)]   = &&P_JZ16,
+        [H_OP(OP_RUN16)]   = &&P_RUN16,
+        [H_OP(OP_PUSH)]    = &&P_PUSH,    [H_OP(OP_POP)]    = &&P_POP,
+        [H_OP(OP_PUSH16_MEM)] = &&P_PUSH16_MEM, [H_OP(OP_POP16_MEM)] = &&P_POP16_MEM,
+        [H_OP(OP_BAND16)]  = &&P_BAND16,  [H_OP(OP_BOR16)]  = &&P_BOR16,
+        [H_OP(OP_BXOR16)]  = &&P_BXOR16,  [H_OP(OP_BNOT16)] = &&P_BNOT16,
+        [H_OP(OP_BNAND16)] = &&P_BNAND16,
+        [H_OP(OP_LT16_CMP)] = &&P_LT16_CMP, [H_OP(OP_GT16_CMP)] = &&P_GT16_CMP,
+        [H_OP(OP_IF)]      = &&P_IF,      [H_OP(OP_THEN)]   = &&P_THEN,
+        [H_OP(OP_ELSE)]    = &&P_ELSE,    [H_OP(OP_ELSEIF)] = &&P_ELSEIF,
+        [H_OP(OP_FOR)]     = &&P_FOR,     [H_OP(OP_ERROR)]  = &&P_ERROR,
+        [H_OP(OP_BCOPY)]   = &&P_BCOPY,   [H_OP(OP_BFILL)]  = &&P_BFILL,
+        [H_OP(OP_BCMP)]    = &&P_BCMP,    [H_OP(OP_BANK)]   = &&P_BANK,
+        [H_OP(OP_BANKLEN)] = &&P_BANKLEN,
+        [H_DEC_JZ]         = &&P_DEC,     [H_DEC_JZ16]      = &&P_DEC,
+        [H_CMP_JZ]         = &&P_CMP,     [H_CMP_JZ16]      = &&P_CMP,
+        [H_INC_JMP]        = &&P_INC,     [H_INC_JMP16]     = &&P_INC,
+    };
+#pragma GCC diagnostic pop
+    void *const *const dispatch = (profile || tracer || perf) ? hook_handlers : handlers;
+
+    BRANCH();
+#else
+    for (;;) {
+        if (++count > stop) goto limit_fault;
+        if ((profile || tracer || perf) && ip < MEMORY_SIZE) {
+            if (memory[ip] == OP_GETC && input_waits(vm)) goto wait_input;
+            INSN_HOOKS(memory[ip]);
+        }
+        d = &decode_cache[ip];
+        if (d->handler == H_DECODE && !(d = decode_insn(vm, ip))) goto done;
+        switch (d->handler) {
+#endif
+
+    HANDLER(NOP)
+        ip += 1;
+        NEXT();
+
+    HANDLER(POKE)
+        STORE(d->a, (uint8_t)d->b);
+        ip += 3;
+        NEXT();
+
+    HANDLER(MOVE)
+        STORE(d->b, memory[d->a]);
+        ip += 3;
+        NEXT();
+
+    HANDLER(NOT)
+        STORE(d->a, (uint8_t)~memory[d->a]);
+        ip += 2;
+        NEXT();
+
+    HANDLER(NAND)
+        STORE(d->c, (uint8_t)~(memory[d->a] & memory[d->b]));
+        ip += 4;
+        NEXT();
+
+    HANDLER(JMP)
+        ip = d->a;
+        BRANCH();
+
+    HANDLER(JZ)
+        ip = (memory[d->b] == 0) ? d->a : ip + 3;
+        BRANCH();
+
+    HANDLER(RUN)
+        if (vm->stack_pointer >= STACK_SIZE) goto stack_overflow;
+        call_stack[vm->stack_pointer++] = d->b;
+        ip = d->a;
+        BRANCH();
+
+    HANDLER(HALT)
+        if (vm->stack_pointer == 0) {
+            status = SHRED_HALTED;
+            goto done;
+        }
+        ip = call_stack[--vm->stack_pointer];
+        BRANCH();
+
+    HANDLER(AND)
+        STORE(d->c, memory[d->a] & memory[d->b]);
+        ip += 4;
+        NEXT();
+
+    HANDLER(OR)
+        STORE(d->c, memory[d->a] | memory[d->b]);
+        ip += 4;
+        NEXT();
+
+    HANDLER(XOR)
+        STORE(d->c, memory[d->a] ^ memory[d->b]);
+        ip += 4;
+        NEXT();
+
+    HANDLER(INC)
+        STORE(d->a, (uint8_t)(memory[d->a] + 1));
+        ip += 2;
+        NEXT();
+
+    HANDLER(DEC)
+        STORE(d->a, (uint8_t)(memory[d->a] - 1));
+        ip += 2;
+        NEXT();
+
+    HANDLER(CMP)
+        STORE(d->c, (memory[d->a] == memory[d->b]) ? 1 : 0);
+        ip += 4;
+        NEXT();
+
+    HANDLER(COMMENT)
+        ip = d->a ? d->a : MEMORY_SIZE;
+        NEXT();
+
+    HANDLER(PUTC)
+        out_write(vm, (const char *)&memory[d->a], 1);
+        ip += 2;
+        NEXT();
+
+    HANDLER(PUTN)
+        out_putn(vm, memory[d->a]);
+        ip += 2;
+        NEXT();
+
+    // a GETC that has to wait for input leaves before the hooks see it
+#if HAVE_COMPUTED_GOTO
+    P_GETC:
+        if (input_waits(vm)) goto wait_input;
+        INSN_HOOKS(OP_GETC);
+    L_GETC:
+#else
+    HANDLER(GETC)
+#endif
+        if (input_waits(vm)) goto wait_input;
+        STORE(d->a, in_getc(vm));
+        ip += 2;
+        NEXT();
+
+    HANDLER(RET)
+        if (vm->stack_pointer == 0) {
+            vm_error(vm, "CPU Fault: RET with empty stack at 0x%04X\n", (unsigned)ip);
+            goto done;
+        }
+        ip = call_stack[--vm->stack_pointer];
+        BRANCH();
+
+    HANDLER(ADD) {
+        uint16_t result = (uint16_t)memory[d->a] + (uint16_t)memory[d->b];
+        STORE(d->c, (uint8_t)result);
+        vm->overflow_flag = (result > 255) ? 1 : 0;
+        ip += 4;
+        NEXT();
+    }
+
+    HANDLER(SUB) {
+        uint8_t a = memory[d->a];
+        uint8_t b = memory[d->b];
+        STORE(d->c, (uint8_t)(a - b));
+        vm->overflow_flag = (a < b) ? 1 : 0;
+        ip += 4;
+        NEXT();
+    }
+
+    HANDLER(MUL) {
+        uint16_t result = (uint16_t)memory[d->a] * (uint16_t)memory[d->b];
+        STORE(d->c, (uint8_t)result);
+        vm->overflow_flag = (result > 255) ? 1 : 0;
+        ip += 4;
+        NEXT();
+    }
+
+    HANDLER(DIV) {
+        uint8_t divisor = memory[d->b];
+        if (divisor == 0) {
+            vm_error(vm, "CPU Fault: Division by zero at 0x%04X\n", (unsigned)ip);
+            goto done;
+        }
+        STORE(d->c, memory[d->a] / divisor);
+        ip += 4;
+        NEXT();
+    }
+
+    HANDLER(SHL)
+        STORE(d->c, (uint8_t)(memory[d->a] << (memory[d->b] & 0x07)));
+        ip += 4;
+        NEXT();
+
+    HANDLER(SHR)
+        STORE(d->c, memory[d->a] >> (memory[d->b] & 0x07));
+        ip += 4;
+        NEXT();
+
+    // 16-bit addresses can't leave the 64K range, no is_valid_address() needed
+    HANDLER(POKE16)
+        STORE(d->a, (uint8_t)d->b);
+        ip += 4;
+        NEXT();
+
+    HANDLER(MOVE16)
+        STORE(d->b, memory[d->a]);
+        ip += 5;
+        NEXT();
+
+    HANDLER(JMP16)
+        ip = d->a;
+        BRANCH();
+
+    HANDLER(JZ16)
+        ip = (memory[d->b] == 0) ? d->a : ip + 4;
+        BRANCH();
+
+    HANDLER(RUN16)
+        if (vm->stack_pointer >= STACK_SIZE) goto stack_overflow;
+        call_stack[vm->stack_pointer++] = d->b;
+        ip = d->a;
+        BRANCH();
+
+    HANDLER(PUSH)
+        if (vm->data_pointer >= DATA_STACK_SIZE) goto data_overflow;
+        data_stack[vm->data_pointer++] = memory[d->a];
+        ip += 2;
+        NEXT();
+
+    HANDLER(POP)
+        if (vm->data_pointer == 0) goto data_underflow;
+        STORE(d->a, (uint8_t)data_stack[--vm->data_pointer]);
+        ip += 2;
+        NEXT();
+
+    // word ops: decode_insn() already checked both bytes of every word are in memory
+    HANDLER(PUSH16_MEM)
+        if (vm->data_pointer >= DATA_STACK_SIZE) goto data_overflow;
+        data_stack[vm->data_pointer++] = load_word(memory, d->a);
+        ip += 3;
+        NEXT();
+
+    HANDLER(POP16_MEM)
+        if (vm->data_pointer == 0) goto data_underflow;
+        STORE16(d->a, data_stack[--vm->data_pointer]);
+        ip += 3;
+        NEXT();
+
+    HANDLER(BAND16)
+        STORE16(d->c, load_word(memory, d->a) & load_word(memory, d->b));
+        ip += 7;
+        NEXT();
+
+    HANDLER(BOR16)
+        STORE16(d->c, load_word(memory, d->a) | load_word(memory, d->b));
+        ip += 7;
+        NEXT();
+
+    HANDLER(BXOR16)
+        STORE16(d->c, load_word(memory, d->a) ^ load_word(memory, d->b));
+        ip += 7;
+        NEXT();
+
+    HANDLER(BNOT16)
+        STORE16(d->a, (uint16_t)~load_word(memory, d->a));
+        ip += 3;
+        NEXT();
+
+    HANDLER(BNAND16)
+        STORE16(d->c, (uint16_t)~(load_word(memory, d->a) & load_word(memory, d->b)));
+        ip += 7;
+        NEXT();
+
+    HANDLER(LT16_CMP)
+        STORE(d->c, (load_word(memory, d->a) < load_word(memory, d->b)) ? 1 : 0);
+        ip += 6;
+        NEXT();
+
+    HANDLER(GT16_CMP)
+        STORE(d->c, (load_word(memory, d->a) > load_word(memory, d->b)) ? 1 : 0);
+        ip += 6;
+        NEXT();
+
+    // structured control flow: targets come from vm->ctrl, see ctrl_lookup()
+    HANDLER(IF) {
+        ctrl_entry *e = ctrl_get(vm, ip);
+        if (!e) goto done;
+        ip = memory[d->a] ? ip + 2 : ctrl_false(vm->ctrl, memory, e);
+        BRANCH();
+    }
+
+    HANDLER(ELSEIF) {
+        ctrl_entry *e = ctrl_get(vm, ip);
+        if (!e) goto done;
+        ip = e->end + 1U;
+        BRANCH();
+    }
+
+    HANDLER(ELSE) {
+        ctrl_entry *e = ctrl_get(vm, ip);
+        if (!e) goto done;
+        ip = e->end + 1U;
+        BRANCH();
+    }
+
+    HANDLER(THEN) {
+        ctrl_entry *e = ctrl_get(vm, ip);
+        if (!e) goto done;
+        uint32_t opener = e->opener;
+        if (memory[opener] == OP_FOR) {
+            uint8_t counter = memory[opener + 1];
+            STORE(counter, (uint8_t)(memory[counter] - 1));
+            if (memory[counter] != 0) {
+                ip = opener + 2;
+                BRANCH();
+            }
+        }
+        ip += 1;
+        NEXT();
+    }
+
+    HANDLER(FOR) {
+        ctrl_entry *e = ctrl_get(vm, ip);
+        if (!e) goto done;
+        ip = memory[d->a] ? ip + 2 : e->end + 1U;
+        BRANCH();
+    }
+
+    HANDLER(ERROR)
+        vm_error(vm, "CPU Fault: ERROR 0x%02X at 0x%04X\n", (unsigned)d->a, (unsigned)ip);
+        goto done;
+
+    // block ops: decode_insn() already checked the whole range is in memory
+    HANDLER(BCOPY)
+        memmove(&memory[d->b], &memory[d->a], d->c);
+        if (d->c && check_stores && range_has_code(code_pages, d->b, d->c)) invalidate_code(vm, d->b, d->c);
+        ip += 7;
+        NEXT();
+
+    HANDLER(BFILL)
+        memset(&memory[d->a], d->c, d->b);
+        if (d->b && check_stores && range_has_code(code_pages, d->a, d->b)) invalidate_code(vm, d->a, d->b);
+        ip += 6;
+        NEXT();
+
+    HANDLER(BCMP)
+        STORE(d->x, (memcmp(&memory[d->a], &memory[d->b], d->c) == 0) ? 1 : 0);
+        ip += 8;
+        NEXT();
+
+    // BANK reads its operands itself and drops any code in the window
+    HANDLER(BANK)
+        if (bank_switch(vm, ip) != 0) goto done;
+        ip += 5;
+        NEXT();
+
+    HANDLER(BANKLEN)
+        STORE16(d->b, bank_length(vm, d->a));
+        ip += 4;
+        NEXT();
+
+    // superinstructions, see fuse_insn(): the first half as above, then the
+    // branch counted as an instruction of its own
+    FUSED(DEC_JZ)
+        STORE(d->a, (uint8_t)(memory[d->a] - 1));
+        ip += 2;
+        if (!SECOND_HALF()) NEXT();
+        count++;
+        ip = (memory[d->a] == 0) ? d->x : ip + 3;
+        BRANCH();
+
+    FUSED(DEC_JZ16)
+        STORE(d->a, (uint8_t)(memory[d->a] - 1));
+        ip += 2;
+        if (!SECOND_HALF()) NEXT();
+        count++;
+        ip = (memory[d->a] == 0) ? d->x : ip + 4;
+        BRANCH();
+
+    FUSED(CMP_JZ)
+        STORE(d->c, (memory[d->a] == memory[d->b]) ? 1 : 0);
+        ip += 4;
+        if (!SECOND_HALF()) NEXT();
+        count++;
+        ip = (memory[d->c] == 0) ? d->x : ip + 3;
+        BRANCH();
+
+    FUSED(CMP_JZ16)
+        STORE(d->c, (memory[d->a] == memory[d->b]) ? 1 : 0);
+        ip += 4;
+        if (!SECOND_HALF()) NEXT();
+        count++;
+        ip = (memory[d->c] == 0) ? d->x : ip + 4;
+        BRANCH();
+
+    FUSED(INC_JMP)
+    FUSED(INC_JMP16)
+        STORE(d->a, (uint8_t)(memory[d->a] + 1));
+        ip += 2;
+        if (!SECOND_HALF()) NEXT();
+        count++;
+        ip = d->x;
+        BRANCH();
+
+#if !HAVE_COMPUTED_GOTO
+        default:
+            goto unknown_op;
+        }
+    }
+#endif
+
+    // slow paths, kept out of the handlers
+#if HAVE_COMPUTED_GOTO
+decode:
+    d = decode_insn(vm, ip);
+    if (!d) goto done;
+    goto *handlers[d->handler];
+
+hook_decode:
+    // hooked before decoding, so instructions that fail to decode still show
+    // up like they do in execute(); then straight to the unhooked handler,
+    // never a superinstruction, so the hooks still see its second half
+    if (ip < MEMORY_SIZE) {
+        if (memory[ip] == OP_GETC && input_waits(vm)) goto wait_input;
+        INSN_HOOKS(memory[ip]);
+    }
+    d = decode_insn(vm, ip);
+    if (!d) goto done;
+    goto *handlers[H_OP(d->opcode)];
+#endif
+
+#if HAVE_JIT
+jit_enter:
+    // run compiled blocks back to back for as long as they chain
+    while (ip < MEMORY_SIZE) {
+        jit_block *blk = vm->jit->block_at[ip];
+        if (blk && blk->ctrl_gen && blk->ctrl_gen != vm->ctrl->gen) {
+            // built from IF/FOR targets that have gone stale
+            vm->jit->block_at[ip] = NULL;
+            blk->entry = NULL;
+            blk = NULL;
+        }
+        if (!blk) {
+            if (++vm->jit->hits[ip] < JIT_THRESHOLD) break;
+            if (!(blk = jit_compile(vm, ip))) {
+                vm->jit->hits[ip] = 0;   // nothing to compile here (yet), don't retry every visit
+                break;
+            }
+        }
+        if (count + blk->insn_count > stop) break;   // let the interpreter hit the limit
+
+        ctx.sp = vm->stack_pointer;
+        ctx.overflow = vm->overflow_flag;
+        int exit = blk->entry(memory, &ctx, code_bytes);
+        vm->stack_pointer = ctx.sp;
+        vm->overflow_flag = ctx.overflow;
+        count += ctx.executed;
+        ip = ctx.ip;
+        if (exit == JIT_EXIT_CODE_STORE) invalidate_code(vm, ctx.store_addr, 1);
+        if (ctx.executed == 0) break;   // bailed out on its first instruction
+    }
+    NEXT();
+#endif
+
+limit_fault:
+    if (count <= vm->max_instructions) {
+        // only the step budget ran out, the instruction at ip hasn't run yet
+        vm->ip = ip;
+        vm->instruction_count = count - 1;
+        return SHRED_PAUSED;
+    }
+    vm_error(vm, "CPU Fault: Instruction limit exceeded (%llu), possible infinite loop\n",
+            (unsigned long long)vm->max_instructions);
+    goto done;
+
+wait_input:
+    // GETC at ip runs on the next call, once the host has fed some input
+    vm->ip = ip;
+    vm->instruction_count = count - 1;
+    return SHRED_WAITING;
+
+stack_overflow:
+    vm_error(vm, "CPU Fault: Stack overflow (max depth: %u) at instruction %llu\n",
+            (unsigned)STACK_SIZE, (unsigned long long)count);
+    goto done;
+
+data_overflow:
+    vm_error(vm, "CPU Fault: Data stack overflow (max depth: %u) at instruction %llu\n",
+            (unsigned)DATA_STACK_SIZE, (unsigned long long)count);
+    goto done;
+
+data_underflow:
+    vm_error(vm, "CPU Fault: Data stack underflow at instruction %llu\n", (unsigned long long)count);
+    goto done;
+
+unknown_op:
+    // only reachable with a corrupt handler id, decode_insn() rejects unknown opcodes
+    vm_error(vm, "CPU Fault: Unknown opcode 0x%02X at 0x%04X\n", memory[ip], (unsigned)ip);
+
+done:
+    vm->ip = ip;
+    vm->instruction_count = count;
+    return status;
+}
+
+#undef INSN_HOOKS
+#undef NEXT
+#undef HANDLER
+#undef FUSED
+#undef SECOND_HALF
+#undef BRANCH
+#undef STORE
+#undef STORE16
+
+ // VM memory
+ // An anonymous mapping where there is mmap: the OS hands out zero pages
+ // lazily, and a snapshot or a clone base can be mapped over it in place, so
+ // the pointer from shred_vm_memory() never changes.
+static uint8_t *alloc_memory(void) {
+#if HAVE_MMAP
+    void *memory = mmap(NULL, MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (memory == MAP_FAILED) ? NULL : memory;
+#else
+    return calloc(MEMORY_SIZE, 1);
+#endif
+}
+
+static void release_memory(uint8_t *memory) {
+    if (!memory) return;
+#if HAVE_MMAP
+    munmap(memory, MEMORY_SIZE);
+#else
+    free(memory);
+#endif
+}
+
+#if HAVE_MMAP
+ // replace memory with a private copy-on-write view of fd at offset
+ // Returns 0, or -1 with memory left as it was
+static int map_memory_over(uint8_t *memory, int fd, off_t offset) {
+    void *map = mmap(memory, MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset);
+    return (map == MAP_FAILED) ? -1 : 0;
+}
+#endif
+
+ // memory is about to change, clones made from now on need a new base
+static void cow_forget(shred_vm *vm) {
+#if HAVE_MEMFD
+    if (vm->cow_fd >= 0) close(vm->cow_fd);
+#endif
+    vm->cow_fd = -1;
+}
+
+ // Banked memory
+ // Host files attached with shred_vm_attach_bank() are read in 4K pages
+ // through BANK, which maps one page of a file over one of the 16 windows
+ // memory is split into. The window becomes a view of the file itself
+ // (MAP_FIXED at the same address), so the engines and the JIT go on
+ // indexing memory[] as before, the OS reads a page in when it's first
+ // touched and nothing gets copied. A writable bank is mapped shared, so
+ // stores go straight to the file; a read-only one is mapped private, so
+ // stores stick until the window is switched. What a window held before its
+ // first BANK is put aside and comes back with BANK w FF. Programs that never
+ // run BANK never get here.
+#define BANK_WINDOW_SIZE  (1U << BANK_WINDOW_SHIFT)
+#define BANK_FILES        SHRED_BANK_FILES
+#define BANK_PLAIN        0xFFU      // BANK's file operand for the window's own memory
+#define BANK_MAX_PAGES    0x10000U   // a 16-bit page operand reaches this far into a file
+
+typedef struct {
+    int fd;                            // -1 = nothing attached
+    int writable;
+} bank_file;
+
+struct bank_state {
+    bank_file files[BANK_FILES];
+    uint8_t   file_at[BANK_WINDOWS];   // file mapped over each window, BANK_PLAIN if none
+    uint16_t  page_at[BANK_WINDOWS];   // and its page
+    uint8_t  *saved[BANK_WINDOWS];     // the window's own bytes while a file is mapped there
+};
+
+#if HAVE_MMAP
+ // 4K pages in an attached file, the last one may be partial (0 if nothing is attached)
+static uint32_t bank_pages(const shred_vm *vm, uint32_t file) {
+    struct stat st;
+    if (!vm->banks || file >= BANK_FILES || vm->banks->files[file].fd < 0) return 0;
+    if (fstat(vm->banks->files[file].fd, &st) != 0 || st.st_size <= 0) return 0;
+    uint64_t pages = ((uint64_t)st.st_size + BANK_WINDOW_SIZE - 1) >> BANK_WINDOW_SHIFT;
+    return (pages > BANK_MAX_PAGES) ? BANK_MAX_PAGES : (uint32_t)pages;
+}
+
+ // what BANKLEN stores
+static uint16_t bank_length(const shred_vm *vm, uint32_t file) {
+    uint32_t pages = bank_pages(vm, file);
+    return (uint16_t)((pages > 0xFFFFU) ? 0xFFFFU : pages);
+}
+
+ // the window's bytes just changed under any code decoded or compiled there
+static void bank_changed(shred_vm *vm, uint32_t window) {
+    uint32_t start = window << BANK_WINDOW_SHIFT;
+    if (range_has_code(vm->code_pages, start, BANK_WINDOW_SIZE)) invalidate_code(vm, start, BANK_WINDOW_SIZE);
+}
+
+ // map page of file over window, putting the window's own bytes aside first
+ // Returns 0, or -1 with errno set and the window as it was
+static int bank_map(shred_vm *vm, uint32_t window, uint32_t file, uint32_t page) {
+    bank_state *b = vm->banks;
+    uint8_t *at = vm->memory + (window << BANK_WINDOW_SHIFT);
+    if (b->file_at[window] == BANK_PLAIN && !b->saved[window]) {
+        if (!(b->saved[window] = malloc(BANK_WINDOW_SIZE))) return -1;
+        memcpy(b->saved[window], at, BANK_WINDOW_SIZE);
+    }
+    int flags = MAP_FIXED | (b->files[file].writable ? MAP_SHARED : MAP_PRIVATE);
+    if (mmap(at, BANK_WINDOW_SIZE, PROT_READ | PROT_WRITE, flags, b->files[file].fd,
+             (off_t)page << BANK_WINDOW_SHIFT) == MAP_FAILED) {
+        return -1;
+    }
+    b->file_at[window] = (uint8_t)file;
+    b->page_at[window] = (uint16_t)page;
+    bank_changed(vm, window);
+    return 0;
+}
+
+ // put the window's own memory back
+ // Returns 0, or -1 with errno set and the file still mapped there
+static int bank_unmap(shred_vm *vm, uint32_t window) {
+    bank_state *b = vm->banks;
+    uint8_t *at = vm->memory + (window << BANK_WINDOW_SHIFT);
+    if (!b || b->file_at[window] == BANK_PLAIN) return 0;
+    if (mmap(at, BANK_WINDOW_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+             -1, 0) == MAP_FAILED) {
+        return -1;
+    }
+    memcpy(at, b->saved[window], BANK_WINDOW_SIZE);
+    free(b->saved[window]);
+    b->saved[window] = NULL;
+    b->file_at[window] = BANK_PLAIN;
+    bank_changed(vm, window);
+    return 0;
+}
+
+ // every window back to plain memory, before something loads into it or
+ // resets it; the files stay attached
+static void bank_unmap_all(shred_vm *vm) {
+    if (!vm->banks) return;
+    for (uint32_t w = 0; w < BANK_WINDOWS; w++) {
+        if (bank_unmap(vm, w) != 0) {
+            fprintf(vm->err, "Error: Cannot put memory back over bank window %X: %s\n", (unsigned)w, strerror(errno));
+        }
+    }
+}
+
+#if HAVE_MEMFD
+ // is a file mapped over any window? (then clones can't share memory)
+static int bank_in_use(const shred_vm *vm) {
+    if (!vm->banks) return 0;
+    for (uint32_t w = 0; w < BANK_WINDOWS; w++) {
+        if (vm->banks->file_at[w] != BANK_PLAIN) return 1;
+    }
+    return 0;
+}
+#endif
+
+ // BANK at ip, which passed check_insn()
+ // Returns 0, or -1 after printing the fault
+static int bank_switch(shred_vm *vm, uint32_t ip) {
+    // the operands first, the window may be the one holding this BANK
+    uint32_t window = vm->memory[ip + 1];
+    uint32_t file = vm->memory[ip + 2];
+    uint32_t page = operand16(&vm->memory[ip], 3);
+
+    if (file == BANK_PLAIN) {
+        if (bank_unmap(vm, window) == 0) return 0;
+    } else if (file >= BANK_FILES || !vm->banks || vm->banks->files[file].fd < 0) {
+        vm_error(vm, "CPU Fault: BANK file 0x%02X not attached at 0x%04X\n", (unsigned)file, (unsigned)ip);
+        return -1;
+    } else if (page >= bank_pages(vm, file)) {
+        vm_error(vm, "CPU Fault: BANK page 0x%04X past the end of file 0x%02X at 0x%04X\n",
+                (unsigned)page, (unsigned)file, (unsigned)ip);
+        return -1;
+    } else if (bank_map(vm, window, file, page) == 0) {
+        return 0;
+    }
+    vm_error(vm, "CPU Fault: BANK can't map window %X at 0x%04X: %s\n", (unsigned)window, (unsigned)ip, strerror(errno));
+    return -1;
+}
+
+ // give a clone its own handles on the parent's files and the same windows.
+ // Its memory is a plain copy (clone_memory() doesn't share banked memory),
+ // which is all a read-only window needs; writable ones are mapped again so
+ // both VMs keep writing through to the file.
+ // Returns 0, or -1 if out of memory or the files can't be mapped
+static int bank_clone(shred_vm *child, const shred_vm *vm) {
+    const bank_state *from = vm->banks;
+    bank_state *b = calloc(1, sizeof(bank_state));
+    if (!b) return -1;
+    child->banks = b;
+    for (uint32_t f = 0; f < BANK_FILES; f++) {
+        b->files[f].fd = -1;
+    }
+    memset(b->file_at, BANK_PLAIN, sizeof(b->file_at));
+
+    for (uint32_t f = 0; f < BANK_FILES; f++) {
+        if (from->files[f].fd < 0) continue;
+        if ((b->files[f].fd = fcntl(from->files[f].fd, F_DUPFD_CLOEXEC, 0)) < 0) return -1;
+        b->files[f].writable = from->files[f].writable;
+    }
+    for (uint32_t w = 0; w < BANK_WINDOWS; w++) {
+        uint32_t file = from->file_at[w];
+        if (file == BANK_PLAIN) continue;
+        if (!(b->saved[w] = malloc(BANK_WINDOW_SIZE))) return -1;
+        memcpy(b->saved[w], from->saved[w], BANK_WINDOW_SIZE);
+        b->file_at[w] = (uint8_t)file;
+        b->page_at[w] = from->page_at[w];
+        if (b->files[file].writable &&
+            mmap(child->memory + (w << BANK_WINDOW_SHIFT), BANK_WINDOW_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED, b->files[file].fd, (off_t)b->page_at[w] << BANK_WINDOW_SHIFT) == MAP_FAILED) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+ // detach everything; memory itself goes with the VM
+static void bank_close(bank_state *b) {
+    if (!b) return;
+    for (uint32_t f = 0; f < BANK_FILES; f++) {
+        if (b->files[f].fd >= 0) close(b->files[f].fd);
+    }
+    for (uint32_t w = 0; w < BANK_WINDOWS; w++) {
+        free(b->saved[w]);
+    }
+    free(b);
+}
+
+int shred_vm_attach_bank(shred_vm *vm, uint32_t slot, const char *filename, int writable) {
+    if (slot >= BANK_FILES) {
+        fprintf(vm->err, "Error: Bank slot %u out of range (0-%u)\n", (unsigned)slot, BANK_FILES - 1U);
+        return -1;
+    }
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (page_size != (long)BANK_WINDOW_SIZE) {
+        fprintf(vm->err, "Error: Banked memory needs 4096 byte pages, this system has %ld\n", page_size);
+        return -1;
+    }
+    if (!vm->banks) {
+        if (!filename) return 0;
+        if (!(vm->banks = calloc(1, sizeof(bank_state)))) {
+            fprintf(vm->err, "Error: Out of memory attaching '%s'\n", filename);
+            return -1;
+        }
+        for (uint32_t f = 0; f < BANK_FILES; f++) {
+            vm->banks->files[f].fd = -1;
+        }
+        memset(vm->banks->file_at, BANK_PLAIN, sizeof(vm->banks->file_at));
+    }
+
+    int fd = -1;
+    if (filename) {
+        struct stat st;
+        fd = open(filename, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+        if (fd < 0) {
+            fprintf(vm->err, "Error: Cannot open bank file '%s'\n", filename);
+            fprintf(vm->err, "open: %s\n", strerror(errno));
+            return -1;
+        }
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            fprintf(vm->err, "Error: Bank file '%s' is not a regular file\n", filename);
+            close(fd);
+            return -1;
+        }
+    }
+
+    // windows showing the old file go back to plain memory
+    bank_file *slot_file = &vm->banks->files[slot];
+    for (uint32_t w = 0; w < BANK_WINDOWS; w++) {
+        if (vm->banks->file_at[w] == slot && bank_unmap(vm, w) != 0) {
+            fprintf(vm->err, "Error: Cannot put memory back over bank window %X: %s\n", (unsigned)w, strerror(errno));
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+    }
+    if (slot_file->fd >= 0) close(slot_file->fd);
+    slot_file->fd = fd;
+    slot_file->writable = (writable != 0);
+    return 0;
+}
+#else
+static uint16_t bank_length(const shred_vm *vm, uint32_t file) { (void)vm; (void)file; return 0; }
+static void bank_unmap_all(shred_vm *vm) { (void)vm; }
+static int bank_clone(shred_vm *child, const shred_vm *vm) { (void)child; (void)vm; return 0; }
+static void bank_close(bank_state *b) { (void)b; }
+
+ // nothing can be attached, so BANK only ever finds plain memory
+static int bank_switch(shred_vm *vm, uint32_t ip) {
+    uint32_t file = vm->memory[ip + 2];
+    if (file == BANK_PLAIN) return 0;
+    vm_error(vm, "CPU Fault: BANK file 0x%02X not attached at 0x%04X\n", (unsigned)file, (unsigned)ip);
+    return -1;
+}
+
+int shred_vm_attach_bank(shred_vm *vm, uint32_t slot, const char *filename, int writable) {
+    (void)slot; (void)writable;
+    if (!filename) return 0;
+    fprintf(vm->err, "Error: Banked memory needs mmap, which this build doesn't have\n");
+    return -1;
+}
+#endif
+
+ // Library API, see shredder.h
+ // A VM around memory (NULL if memory is NULL or anything else can't be had)
+static shred_vm *vm_new(uint8_t *memory) {
+    shred_vm *vm = calloc(1, sizeof(shred_vm));
+    if (!vm) {
+        release_memory(memory);
+        return NULL;
+    }
+
+    vm->memory = memory;
+    vm->cow_fd = -1;
+    vm->out_buf = malloc(SHRED_OUTPUT_BUFFER_DEFAULT);   // code maps come later, see decode_cache_alloc()
+    if (!vm->memory || !vm->out_buf) {
+        shred_vm_destroy(vm);
+        return NULL;
+    }
+    vm->engine = SHRED_ENGINE_THREADED;
+    vm->fuse = 1;
+    vm->status = SHRED_PAUSED;
+    vm->out_cap = SHRED_OUTPUT_BUFFER_DEFAULT;
+    vm->out_mode = SHRED_OUTPUT_LINE;
+    vm->max_instructions = MAX_INSTRUCTIONS;
+    shred_vm_set_io(vm, stdin, stdout, stderr);
+    return vm;
+}
+
+shred_vm *shred_vm_create(void) {
+    return vm_new(alloc_memory());
+}
+
+void shred_vm_destroy(shred_vm *vm) {
+    if (!vm) return;
+    jit_destroy(vm);
+    cow_forget(vm);
+    free(vm->profile);
+    trace_close(vm->trace, vm->err);
+    perf_close(vm->perf);
+    bank_close(vm->banks);
+    free(vm->ctrl);
+    free(vm->out_buf);
+    free(vm->in_buf);
+    release_memory(vm->code_bytes);
+    decode_cache_free(vm->decode_cache);
+    release_memory(vm->memory);
+    free(vm);
+}
+
+ // the program changed under the caches
+static void drop_code(shred_vm *vm) {
+    vm->fixed_code = 0;
+    reset_decode_cache(vm, 0);
+    free(vm->ctrl);
+    vm->ctrl = NULL;
+    jit_reset(vm);
+    cow_forget(vm);
+}
+
+ // from here on memory may change behind the analysis that set fixed_code
+static void unfix_code(shred_vm *vm) {
+    if (!vm->fixed_code) return;
+    vm->fixed_code = 0;
+    jit_reset(vm);   // its blocks don't check their stores
+}
+
+ // after execute(), which stores without checking for decoded code but does
+ // keep vm->ctrl up to date
+static void drop_decoded(shred_vm *vm) {
+    reset_decode_cache(vm, CODE_CTRL);
+    jit_reset(vm);
+    cow_forget(vm);
+}
+
+void shred_vm_reset(shred_vm *vm, int flags) {
+    int fixed = vm->fixed_code;   // stays true while the code is still there
+    bank_unmap_all(vm);
+    if (flags & SHRED_RESET_CLEAR_MEMORY) {
+        memset(vm->memory, 0, MEMORY_SIZE);
+        fixed = 0;
+    }
+    drop_code(vm);
+    vm->fixed_code = fixed;
+    memset(vm->call_stack, 0, sizeof(vm->call_stack));
+    vm->stack_pointer = 0;
+    memset(vm->data_stack, 0, sizeof(vm->data_stack));
+    vm->data_pointer = 0;
+    vm->overflow_flag = 0;
+    vm->instruction_count = 0;
+    vm->ip = vm->entry;
+    vm->status = SHRED_PAUSED;
+    if (vm->profile) profile_restart(vm->profile, 0);
+    if (vm->perf) perf_restart(vm->perf, 0);
+}
+
+int shred_vm_load(shred_vm *vm, const char *text, size_t len) {
+    bank_unmap_all(vm);
+    drop_code(vm);
+    vm->entry = vm->ip = 0;
+    int32_t loaded = parse_program(vm, text, len);
+    if (loaded < 0) return -1;
+    vm->image_len = (uint32_t)loaded;
+    return 0;
+}
+
+int shred_vm_load_image(shred_vm *vm, const uint8_t *image, size_t len) {
+    if (len > MEMORY_SIZE) {
+        fprintf(vm->err, "Error: Image of %lu bytes doesn't fit in %u bytes of memory\n",
+                (unsigned long)len, (unsigned)MEMORY_SIZE);
+        return -1;
+    }
+    bank_unmap_all(vm);
+    drop_code(vm);
+    if (is_shbin((const char *)image, len)) {
+        int32_t loaded = parse_shbin(vm, image, len, "image");
+        if (loaded < 0) return -1;
+        vm->image_len = (uint32_t)loaded;
+        return 0;
+    }
+    memcpy(vm->memory, image, len);
+    vm->entry = vm->ip = 0;
+    vm->image_len = (uint32_t)len;
+    return 0;
+}
+
+int shred_vm_load_file(shred_vm *vm, const char *filename) {
+    bank_unmap_all(vm);
+    drop_code(vm);
+    return load_program(vm, filename);
+}
+
+int shred_vm_save_shbin(shred_vm *vm, const char *filename) {
+    return save_shbin(vm, filename);
+}
+
+int shred_vm_set_entry(shred_vm *vm, uint32_t entry) {
+    if (entry >= MEMORY_SIZE) return -1;
+    if (entry != vm->entry) unfix_code(vm);   // the analysis started from the old one
+    vm->entry = entry;
+    vm->ip = entry;
+    return 0;
+}
+
+  // Snapshots (--save-snapshot / --restore), file layout next to SNAP_MAGIC
+static uint32_t snapshot_checksum(const uint8_t *header, const uint8_t *memory) {
+    uint32_t hash = fnv1a(FNV_SEED, header + 6, 28U - 6U);   // status up to the checksum itself
+    return fnv1a(fnv1a(hash, header + 32, SNAP_HEADER_LEN - 32U), memory, MEMORY_SIZE);
+}
+
+int shred_vm_save_snapshot(shred_vm *vm, const char *filename) {
+    static const uint8_t padding[SNAP_MEMORY_OFFSET - SNAP_HEADER_LEN];
+    uint8_t header[SNAP_HEADER_LEN];
+
+    memset(header, 0, sizeof(header));
+    memcpy(header, SNAP_MAGIC, 4);
+    header[4] = SNAP_VERSION;
+    header[6] = (uint8_t)((vm->status == SHRED_WAITING) ? SHRED_PAUSED : vm->status);   // the GETC hasn't run
+    header[7] = vm->overflow_flag;
+    put_le32(header + 8, vm->ip);
+    put_le32(header + 12, vm->entry);
+    put_le64(header + 16, vm->instruction_count);
+    put_le16(header + 24, vm->stack_pointer);
+    for (uint32_t i = 0; i < STACK_SIZE; i++) {
+        put_le16(header + 32 + i * 2, vm->call_stack[i]);
+    }
+    put_le16(header + 26, vm->data_pointer);
+    for (uint32_t i = 0; i < DATA_STACK_SIZE; i++) {
+        put_le16(header + SNAP_DATA_OFFSET + i * 2, vm->data_stack[i]);
+    }
+    put_le32(header + 28, snapshot_checksum(header, vm->memory));
+
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        fprintf(vm->err, "Error: Cannot open '%s' for writing\n", filename);
+        fprintf(vm->err, "fopen: %s\n", strerror(errno));
+        return -1;
+    }
+    int ok = fwrite(header, 1, sizeof(header), file) == sizeof(header) &&
+             fwrite(padding, 1, sizeof(padding), file) == sizeof(padding) &&
+             fwrite(vm->memory, 1, MEMORY_SIZE, file) == MEMORY_SIZE;
+    if (fclose(file) != 0) ok = 0;
+    if (!ok) {
+        fprintf(vm->err, "Error: Failed writing '%s': %s\n", filename, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int shred_vm_restore_snapshot(shred_vm *vm, const char *filename) {
+    uint8_t header[SNAP_HEADER_LEN];
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        fprintf(vm->err, "Error: Cannot open file '%s'\n", filename);
+        fprintf(vm->err, "fopen: %s\n", strerror(errno));
+        return -1;
+    }
+    if (fread(header, 1, sizeof(header), file) != sizeof(header) || memcmp(header, SNAP_MAGIC, 4) != 0) {
+        fprintf(vm->err, "Error: '%s' is not a Shredder snapshot\n", filename);
+        fclose(file);
+        return -1;
+    }
+    if (header[4] != SNAP_VERSION || header[5] != 0) {
+        fprintf(vm->err, "Error: '%s' is snapshot version %u, this build reads version %u\n",
+                filename, (unsigned)header[4], (unsigned)SNAP_VERSION);
+        fclose(file);
+        return -1;
+    }
+
+    uint32_t sp = get_le16(header + 24);
+    uint32_t dsp = get_le16(header + 26);
+    // ip may be one past the end: a VM paused right after running off it,
+    // which faults as soon as it runs again
+    int damaged = (sp > STACK_SIZE || dsp > DATA_STACK_SIZE || header[6] > SHRED_FAULT ||
+                   get_le32(header + 8) > MEMORY_SIZE || get_le32(header + 12) >= MEMORY_SIZE);
+    int loaded = 0;
+
+    // map the memory image copy-on-write; if that's not possible, read it
+    if (!damaged) bank_unmap_all(vm);
+#if HAVE_MMAP
+    struct stat st;
+    if (!damaged && fstat(fileno(file), &st) == 0 && st.st_size == (off_t)(SNAP_MEMORY_OFFSET + MEMORY_SIZE)) {
+        void *view = mmap(NULL, MEMORY_SIZE, PROT_READ, MAP_PRIVATE, fileno(file), SNAP_MEMORY_OFFSET);
+        if (view != MAP_FAILED) {
+            damaged = snapshot_checksum(header, view) != get_le32(header + 28);
+            munmap(view, MEMORY_SIZE);
+            loaded = !damaged && map_memory_over(vm->memory, fileno(file), SNAP_MEMORY_OFFSET) == 0;
+        }
+    }
+#endif
+    if (!damaged && !loaded) {
+        uint8_t *copy = malloc(MEMORY_SIZE);
+        if (!copy || fseek(file, SNAP_MEMORY_OFFSET, SEEK_SET) != 0 ||
+            fread(copy, 1, MEMORY_SIZE, file) != MEMORY_SIZE) {
+            fprintf(vm->err, "Error: '%s' is truncated\n", filename);
+            free(copy);
+            fclose(file);
+            return -1;
+        }
+        damaged = snapshot_checksum(header, copy) != get_le32(header + 28);
+        if (!damaged) memcpy(vm->memory, copy, MEMORY_SIZE);
+        free(copy);
+    }
+    fclose(file);
+    if (damaged) {
+        fprintf(vm->err, "Error: '%s' failed its checksum, the file is damaged\n", filename);
+        return -1;
+    }
+
+    vm->image_len = MEMORY_SIZE;   // all of it is state now
+    drop_code(vm);
+    vm->status = (shred_status)header[6];
+    vm->overflow_flag = header[7];
+    vm->ip = get_le32(header + 8);
+    vm->entry = get_le32(header + 12);
+    vm->instruction_count = get_le64(header + 16);
+    vm->stack_pointer = (uint16_t)sp;
+    for (uint32_t i = 0; i < STACK_SIZE; i++) {
+        vm->call_stack[i] = (uint16_t)get_le16(header + 32 + i * 2);
+    }
+    vm->data_pointer = (uint16_t)dsp;
+    for (uint32_t i = 0; i < DATA_STACK_SIZE; i++) {
+        vm->data_stack[i] = (uint16_t)get_le16(header + SNAP_DATA_OFFSET + i * 2);
+    }
+    if (vm->profile) profile_restart(vm->profile, vm->instruction_count);
+    if (vm->perf) perf_restart(vm->perf, vm->stack_pointer);
+    return 0;
+}
+
+ // Clones
+ // The first clone moves the parent's memory onto a memfd (one 64K write) and
+ // maps it back in place. Every clone after that is one more private mapping
+ // of the same memfd, so nothing is copied until someone writes, and then only
+ // the 4K page written to. Running, loading or resetting the parent drops the
+ // memfd again; the next clone takes a fresh one. The child starts without a
+ // decode cache (see decode_cache_alloc()), so all a clone costs is the VM
+ // struct, its output buffer and the mapping: about 5us, against 40-70us
+ // when every VM allocated and zeroed its 1MB cache up front.
+static uint8_t *clone_memory(shred_vm *vm) {
+#if HAVE_MEMFD
+    // a banked window is a view of its file, which moving memory onto the
+    // memfd would cut off; those clones copy
+    if (vm->cow_fd < 0 && !bank_in_use(vm)) {
+        int fd = memfd_create("shredder-vm", MFD_CLOEXEC);
+        if (fd >= 0) {
+            if (ftruncate(fd, MEMORY_SIZE) == 0 &&
+                pwrite(fd, vm->memory, MEMORY_SIZE, 0) == (ssize_t)MEMORY_SIZE &&
+                map_memory_over(vm->memory, fd, 0) == 0) {
+                vm->cow_fd = fd;
+            } else {
+                close(fd);
+            }
+        }
+    }
+    if (vm->cow_fd >= 0) {
+        void *map = mmap(NULL, MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, vm->cow_fd, 0);
+        if (map != MAP_FAILED) return map;
+    }
+#endif
+    // no memfd: a plain copy
+    uint8_t *memory = alloc_memory();
+    if (memory) memcpy(memory, vm->memory, MEMORY_SIZE);
+    return memory;
+}
+
+shred_vm *shred_vm_clone(shred_vm *vm) {
+    shred_vm *child = vm_new(clone_memory(vm));
+    if (!child) return NULL;
+    if (shred_vm_set_output(child, vm->out_mode, vm->out_cap) != 0 ||
+        (vm->banks && bank_clone(child, vm) != 0)) {
+        shred_vm_destroy(child);
+        return NULL;
+    }
+
+    memcpy(child->call_stack, vm->call_stack, sizeof(vm->call_stack));
+    child->stack_pointer = vm->stack_pointer;
+    memcpy(child->data_stack, vm->data_stack, sizeof(vm->data_stack));
+    child->data_pointer = vm->data_pointer;
+    child->overflow_flag = vm->overflow_flag;
+    child->instruction_count = vm->instruction_count;
+    child->max_instructions = vm->max_instructions;
+    child->ip = vm->ip;
+    child->entry = vm->entry;
+    child->image_len = vm->image_len;
+    child->fixed_code = vm->fixed_code;
+    child->status = (vm->status == SHRED_WAITING) ? SHRED_PAUSED : vm->status;   // it reads in, not the feed
+    child->debug_mode = vm->debug_mode;
+    child->trace_mode = vm->trace_mode;
+    child->engine = vm->engine;
+    child->fuse = vm->fuse;
+    shred_vm_set_io(child, vm->in, vm->out, vm->err);
+    return child;
+}
+
+ // pick the engine; debug/trace need the hooks in execute(), and so does a
+ // VM that can't get a decode cache
+shred_status shred_vm_run(shred_vm *vm, uint64_t max_steps) {
+    if (vm->status == SHRED_WAITING && !input_waits(vm)) vm->status = SHRED_PAUSED;
+    if (vm->status != SHRED_PAUSED) return vm->status;
+    cow_forget(vm);
+
+    // the engines stop once instruction_count passes stop; past the limit
+    // itself they fault, anything short of it is just a pause
+    uint64_t stop = vm->max_instructions;
+    if (max_steps && vm->instruction_count < stop && max_steps < stop - vm->instruction_count) {
+        stop = vm->instruction_count + max_steps;
+    }
+
+    if (vm->perf) perf_start(vm->perf, vm->stack_pointer);
+    if (vm->engine == SHRED_ENGINE_SWITCH || vm->debug_mode || vm->trace_mode || decode_cache_alloc(vm) != 0) {
+        vm->status = execute(vm, stop);
+        drop_decoded(vm);
+    } else {
+        vm->status = execute_threaded(vm, stop, vm->engine == SHRED_ENGINE_JIT);
+    }
+    if (vm->perf) perf_stop(vm->perf);
+    // faults for the limit or an ip off the end of memory count one
+    // instruction that never ran
+    int phantom = vm->instruction_count > vm->max_instructions || vm->ip >= MEMORY_SIZE;
+    if (vm->profile) profile_close_block(vm->profile, vm->instruction_count - (phantom ? 1 : 0));
+    if (vm->trace) trace_end_run(vm->trace, vm->memory, vm->status == SHRED_FAULT && !phantom);
+    out_flush(vm);
+    return vm->status;
+}
+
+int shred_vm_set_engine(shred_vm *vm, int engine) {
+    if (engine != SHRED_ENGINE_SWITCH && engine != SHRED_ENGINE_THREADED && engine != SHRED_ENGINE_JIT) {
+        return -1;
+    }
+    if (engine == SHRED_ENGINE_JIT && !HAVE_JIT) return -1;
+    vm->engine = engine;
+    return 0;
+}
+
+void shred_vm_set_fusion(shred_vm *vm, int enabled) {
+    enabled = (enabled != 0);
+    if (enabled == vm->fuse) return;
+    vm->fuse = enabled;
+    reset_decode_cache(vm, CODE_JIT | CODE_CTRL);   // entries decoded the other way
+}
+
+void shred_vm_set_io(shred_vm *vm, FILE *in, FILE *out, FILE *err) {
+    vm->in = in;
+    vm->out = out;
+    vm->err = err;
+}
+
+int shred_vm_feed_input(shred_vm *vm, const void *data, size_t len) {
+    size_t unread = (size_t)(vm->in_end - vm->in_next);
+    vm->in_fed = 1;
+    if (len > SIZE_MAX / 2 - unread) return -1;
+    if (unread + len > vm->in_cap || !vm->in_buf) {
+        size_t cap = vm->in_cap ? vm->in_cap : 256U;
+        while (cap < unread + len) cap *= 2;
+        uint8_t *buf = malloc(cap);
+        if (!buf) return -1;
+        if (unread) memcpy(buf, vm->in_next, unread);
+        free(vm->in_buf);
+        vm->in_buf = buf;
+        vm->in_cap = cap;
+    } else if (unread) {
+        memmove(vm->in_buf, vm->in_next, unread);   // what's left of in_buf or of a lent buffer
+    }
+    if (len) memcpy(vm->in_buf + unread, data, len);
+    vm->in_next = vm->in_buf;
+    vm->in_end = vm->in_buf + unread + len;
+    return 0;
+}
+
+int shred_vm_lend_input(shred_vm *vm, const void *data, size_t len) {
+    if (vm->in_next != vm->in_end) return -1;
+    vm->in_fed = 1;
+    vm->in_next = data;
+    vm->in_end = vm->in_next + len;
+    return 0;
+}
+
+void shred_vm_close_input(shred_vm *vm) {
+    vm->in_fed = 1;
+    vm->in_closed = 1;
+}
+
+int shred_vm_set_output(shred_vm *vm, int mode, uint32_t buffer_size) {
+    if (mode != SHRED_OUTPUT_INTERACTIVE && mode != SHRED_OUTPUT_LINE && mode != SHRED_OUTPUT_BLOCK) {
+        return -1;
+    }
+    if (buffer_size == 0) buffer_size = SHRED_OUTPUT_BUFFER_DEFAULT;
+    if (buffer_size < 4) buffer_size = 4;   // PUTN writes up to 3 bytes at once
+
+    if (buffer_size != vm->out_cap) {
+        char *buf = realloc(vm->out_buf, buffer_size);
+        if (!buf) return -1;
+        vm->out_buf = buf;
+        vm->out_cap = buffer_size;
+    }
+    vm->out_mode = mode;
+    return 0;
+}
+
+void shred_vm_set_debug(shred_vm *vm, int level) {
+    vm->debug_mode = (level >= 1);
+    vm->trace_mode = (level >= 2);
+}
+
+uint8_t *shred_vm_memory(shred_vm *vm) {
+    drop_code(vm);   // the caller may write to it, code included
+    return vm->memory;
+}
+
+void shred_vm_set_limit(shred_vm *vm, uint64_t max_instructions) {
+    vm->max_instructions = max_instructions ? max_instructions : UINT64_MAX;
+}
+
+uint64_t shred_vm_instruction_count(const shred_vm *vm) {
+    return vm->instruction_count;
+}
+
+uint32_t shred_vm_ip(const shred_vm *vm) {
+    return vm->ip;
+}
+
+uint32_t shred_vm_stack_depth(const shred_vm *vm) {
+    return vm->stack_pointer;
+}
+
+uint32_t shred_vm_data_depth(const shred_vm *vm) {
+    return vm->data_pointer;
+}
+
+int shred_vm_overflow(const shred_vm *vm) {
+    return vm->overflow_flag;
+}
+
+int shred_vm_set_profile(shred_vm *vm, int enabled) {
+    free(vm->profile);
+    vm->profile = NULL;
+    if (!enabled) return 0;
+    if (!(vm->profile = calloc(1, sizeof(exec_profile)))) return -1;
+    profile_restart(vm->profile, vm->instruction_count);
+    return 0;
+}
+
+int shred_vm_set_trace(shred_vm *vm, const char *filename, uint32_t records) {
+    trace_close(vm->trace, vm->err);
+    vm->trace = NULL;
+    if (!filename) return 0;
+    if (records == 0) records = TRACE_RECORDS_DEFAULT;
+    if (records > TRACE_RECORDS_MAX) {
+        fprintf(vm->err, "Error: A trace holds at most %u records\n", (unsigned)TRACE_RECORDS_MAX);
+        return -1;
+    }
+    vm->trace = trace_open(filename, records, vm->err);
+    return vm->trace ? 0 : -1;
+}
+
+int shred_vm_set_perf_counters(shred_vm *vm, int enabled) {
+    perf_close(vm->perf);
+    vm->perf = NULL;
+    if (!enabled) return 0;
+#if HAVE_PERF
+    if (!(vm->perf = perf_open(vm->err))) return -1;
+    perf_restart(vm->perf, vm->stack_pointer);
+    return 0;
+#else
+    fprintf(vm->err, "Error: Performance counters need Linux, not available in this build\n");
+    return -1;
+#endif
+}
+
+ // Profile reports
+#define PROFILE_TOP_DEFAULT  20U
+
+typedef struct {
+    uint32_t addr;   // address, or opcode for the opcode table
+    uint64_t key;
+} profile_entry;
+
+static int compare_profile_entries(const void *a, const void *b) {
+    const profile_entry *x = a, *y = b;
+    if (x->key != y->key) return (x->key < y->key) ? 1 : -1;
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+ // the non-zero counts (every stride'th uint64_t), busiest first; returns how many
+#define SLOT_STRIDE  (sizeof(profile_slot) / sizeof(uint64_t))
+
+static uint32_t profile_sorted(const uint64_t *counts, uint32_t n, size_t stride, profile_entry *rows) {
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (!counts[i * stride]) continue;
+        rows[used].addr = i;
+        rows[used].key = counts[i * stride];
+        used++;
+    }
+    qsort(rows, used, sizeof(profile_entry), compare_profile_entries);
+    return used;
+}
+
+static const char *profile_op_name(uint8_t opcode) {
+    return op_table[opcode].name ? op_table[opcode].name : "???";
+}
+
+static double percent_of(uint64_t part, uint64_t total) {
+    return total ? 100.0 * (double)part / (double)total : 0.0;
+}
+
+ // per-opcode totals; returns the sum
+static uint64_t profile_opcodes(const exec_profile *p, uint64_t *ops) {
+    uint64_t total = 0;
+    memcpy(ops, p->ops, sizeof(p->ops));
+    for (uint32_t addr = 0; addr < MEMORY_SIZE; addr++) {
+        ops[p->opcode_at[addr]] += p->slots[addr].hits - p->op_counted[addr];
+    }
+    for (uint32_t i = 0; i < 256; i++) total += ops[i];
+    return total;
+}
+
+void shred_vm_profile_report(const shred_vm *vm, FILE *out, uint32_t top) {
+    const exec_profile *p = vm->profile;
+    if (!p) return;
+    profile_entry *rows = malloc(MEMORY_SIZE * sizeof(profile_entry));
+    if (!rows) {
+        fprintf(out, "Error: Out of memory for the profile report\n");
+        return;
+    }
+    if (top == 0) top = PROFILE_TOP_DEFAULT;
+    uint64_t ops[256];
+    uint64_t total = profile_opcodes(p, ops);
+    uint32_t n, shown;
+
+    fprintf(out, "\n--- Profile: %llu instructions ---\n", (unsigned long long)total);
+
+    fprintf(out, "\nOpcodes\n%-8s %14s %8s\n", "OPCODE", "COUNT", "%");
+    n = profile_sorted(ops, 256, 1, rows);
+    for (uint32_t i = 0; i < n; i++) {
+        fprintf(out, "%-8s %14llu %7.2f%%\n", profile_op_name((uint8_t)rows[i].addr),
+                (unsigned long long)rows[i].key, percent_of(rows[i].key, total));
+    }
+
+    fprintf(out, "\nHottest addresses\n%-6s %-8s %14s %8s\n", "ADDR", "OPCODE", "HITS", "%");
+    n = profile_sorted(&p->slots[0].hits, MEMORY_SIZE, SLOT_STRIDE, rows);
+    for (uint32_t i = 0; i < n && i < top; i++) {
+        fprintf(out, "%04X   %-8s %14llu %7.2f%%\n", (unsigned)rows[i].addr,
+                profile_op_name(p->opcode_at[rows[i].addr]), (unsigned long long)rows[i].key,
+                percent_of(rows[i].key, total));
+    }
+
+    fprintf(out, "\nBranches (JZ/JZ16)\n%-6s %-8s %14s %14s %14s %8s\n",
+            "ADDR", "OPCODE", "EXECUTED", "TAKEN", "NOT TAKEN", "TAKEN%");
+    shown = 0;
+    for (uint32_t i = 0; i < n && shown < top; i++) {   // rows still holds the hits
+        uint32_t addr = rows[i].addr;
+        uint8_t opcode = p->opcode_at[addr];
+        if (opcode != OP_JZ && opcode != OP_JZ16) continue;
+        fprintf(out, "%04X   %-8s %14llu %14llu %14llu %7.2f%%\n", (unsigned)addr, profile_op_name(opcode),
+                (unsigned long long)rows[i].key, (unsigned long long)p->slots[addr].taken,
+                (unsigned long long)(rows[i].key - p->slots[addr].taken), percent_of(p->slots[addr].taken, rows[i].key));
+        shown++;
+    }
+
+    fprintf(out, "\nCalls (RUN/RUN16 targets, by inclusive instructions)\n%-6s %14s %14s %8s %12s\n",
+            "TARGET", "CALLS", "INCLUSIVE", "%", "PER CALL");
+    n = profile_sorted(p->inclusive, MEMORY_SIZE, 1, rows);
+    for (uint32_t i = 0; i < n && i < top; i++) {
+        uint32_t addr = rows[i].addr;
+        fprintf(out, "%04X   %14llu %14llu %7.2f%% %12.1f\n", (unsigned)addr,
+                (unsigned long long)p->calls[addr], (unsigned long long)rows[i].key,
+                percent_of(rows[i].key, total), (double)rows[i].key / (double)p->calls[addr]);
+    }
+
+    fprintf(out, "\nHottest blocks\n%-6s %14s %14s %8s %8s\n", "START", "ENTRIES", "INSTRUCTIONS", "%", "LENGTH");
+    n = profile_sorted(&p->slots[0].block_insns, MEMORY_SIZE, SLOT_STRIDE, rows);
+    for (uint32_t i = 0; i < n && i < top; i++) {
+        uint32_t addr = rows[i].addr;
+        uint64_t entries = p->slots[addr].block_entries ? p->slots[addr].block_entries : 1;
+        fprintf(out, "%04X   %14llu %14llu %7.2f%% %8.1f\n", (unsigned)addr,
+                (unsigned long long)p->slots[addr].block_entries, (unsigned long long)rows[i].key,
+                percent_of(rows[i].key, total), (double)rows[i].key / (double)entries);
+    }
+    free(rows);
+}
+
+int shred_vm_profile_write(const shred_vm *vm, FILE *out, int format) {
+    const exec_profile *p = vm->profile;
+    if (!p || (format != SHRED_PROFILE_JSON && format != SHRED_PROFILE_CSV)) return -1;
+    uint64_t ops[256];
+    uint64_t total = profile_opcodes(p, ops);
+
+    if (format == SHRED_PROFILE_CSV) {
+        fprintf(out, "kind,address,opcode,count,detail\n");
+        for (uint32_t op = 0; op < 256; op++) {
+            if (ops[op]) fprintf(out, "opcode,,%s,%llu,\n", profile_op_name((uint8_t)op), (unsigned long long)ops[op]);
+        }
+        for (uint32_t addr = 0; addr < MEMORY_SIZE; addr++) {
+            if (!p->slots[addr].hits) continue;
+            uint8_t opcode = p->opcode_at[addr];
+            fprintf(out, "address,0x%04X,%s,%llu,", (unsigned)addr, profile_op_name(opcode), (unsigned long long)p->slots[addr].hits);
+            if (opcode == OP_JZ || opcode == OP_JZ16) fprintf(out, "%llu", (unsigned long long)p->slots[addr].taken);
+            fputc('\n', out);
+        }
+        for (uint32_t addr = 0; addr < MEMORY_SIZE; addr++) {
+            if (p->calls[addr]) fprintf(out, "call,0x%04X,,%llu,%llu\n", (unsigned)addr,
+                                        (unsigned long long)p->calls[addr], (unsigned long long)p->inclusive[addr]);
+        }
+        for (uint32_t addr = 0; addr < MEMORY_SIZE; addr++) {
+            if (p->slots[addr].block_insns) fprintf(out, "block,0x%04X,,%llu,%llu\n", (unsigned)addr,
+                                              (unsigned long long)p->slots[addr].block_entries, (unsigned long long)p->slots[addr].block_insns);
+        }
+        return ferror(out) ? -1 : 0;
+    }
+
+    const char *sep = "";
+    fprintf(out, "{\n  \"instructions\": %llu,\n  \"opcodes\": [", (unsigned long long)total);
+    for (uint32_t op = 0; op < 256; op++) {
+        if (!ops[op]) continue;
+        fprintf(out, "%s\n    {\"opcode\": \"%s\", \"count\": %llu}", sep, profile_op_name((uint8_t)op),
+                (unsigned long long)ops[op]);
+        sep = ",";
+    }
+    fprintf(out, "\n  ],\n  \"addresses\": [");
+    sep = "";
+    for (uint32_t addr = 0; addr < MEMORY_SIZE; addr++) {
+        if (!p->slots[addr].hits) continue;
+        uint8_t opcode = p->opcode_at[addr];
+        fprintf(out, "%s\n    {\"address\": %u, \"opcode\": \"%s\", \"hits\": %llu", sep, (unsigned)addr,
+                profile_op_name(opcode), (unsigned long long)p->slots[addr].hits);
+        if (opcode == OP_JZ || opcode == OP_JZ16) fprintf(out, ", \"taken\": %llu", (unsigned long long)p->slots[addr].taken);
+        fputc('}', out);
+        sep = ",";
+    }
+    fprintf(out, "\n  ],\n  \"calls\": [");
+    sep = "";
+    for (uint32_t addr = 0; addr < MEMORY_SIZE; addr++) {
+        if (!p->calls[addr]) continue;
+        fprintf(out, "%s\n    {\"target\": %u, \"calls\": %llu, \"inclusive\": %llu}", sep, (unsigned)addr,
+                (unsigned long long)p->calls[addr], (unsigned long long)p->inclusive[addr]);
+        sep = ",";
+    }
+    fprintf(out, "\n  ],\n  \"blocks\": [");
+    sep = "";
+    for (uint32_t addr = 0; addr < MEMORY_SIZE; addr++) {
+        if (!p->slots[addr].block_insns) continue;
+        fprintf(out, "%s\n    {\"start\": %u, \"entries\": %llu, \"instructions\": %llu}", sep, (unsigned)addr,
+                (unsigned long long)p->slots[addr].block_entries, (unsigned long long)p->slots[addr].block_insns);
+        sep = ",";
+    }
+    fprintf(out, "\n  ]\n}\n");
+    return ferror(out) ? -1 : 0;
+}
+
+ // Performance counter report
+#if HAVE_PERF
+static const char *const perf_columns[PERF_EVENTS] = { "CYCLES", "BR-MISS", "L1D-MISS" };
+
+static void perf_cells(FILE *out, const exec_perf *p, const uint64_t *events, uint64_t executed) {
+    for (uint32_t e = PERF_BRANCH_MISSES; e < PERF_EVENTS; e++) {
+        if (p->fd[e] < 0) continue;
+        fprintf(out, " %12llu", (unsigned long long)events[e]);
+        if (executed) fprintf(out, " %9.4f", (double)events[e] / (double)executed);
+    }
+    fprintf(out, "\n");
+}
+#endif
+
+void shred_vm_perf_report(const shred_vm *vm, FILE *out, uint32_t top) {
+#if HAVE_PERF
+    const exec_perf *p = vm->perf;
+    if (!p) return;
+    profile_entry *rows = malloc((MEMORY_SIZE + 1) * sizeof(profile_entry));
+    if (!rows) {
+        fprintf(out, "Error: Out of memory for the performance counter report\n");
+        return;
+    }
+    if (top == 0) top = PROFILE_TOP_DEFAULT;
+    const char *unit = (p->source == PERF_SOURCE_PMU) ? "cycles" : "ns";
+    const char *first = (p->source == PERF_SOURCE_PMU) ? perf_columns[PERF_CYCLES] : "NS";
+    uint64_t executed = 0, sampled = 0;
+    uint32_t n = 0;
+    for (uint32_t op = 0; op < 256; op++) {
+        executed += p->executed[op];
+        sampled += p->by_opcode[PERF_CYCLES][op];
+    }
+
+    fprintf(out, "\n--- Performance counters: %llu instructions, %.2f %s",
+            (unsigned long long)executed, executed ? (double)perf_total(p, PERF_CYCLES) / (double)executed : 0.0, unit);
+    for (uint32_t e = PERF_BRANCH_MISSES; e < PERF_EVENTS; e++) {
+        if (p->fd[e] < 0) continue;
+        fprintf(out, ", %.4f %s", executed ? (double)perf_total(p, e) / (double)executed : 0.0,
+                e == PERF_BRANCH_MISSES ? "branch misses" : "L1D misses");
+    }
+    fprintf(out, " per instruction ---\n");
+    if (p->source == PERF_SOURCE_CLOCK) {
+        fprintf(out, "No hardware counters here; sampling CPU time every %llu ns instead.\n",
+                (unsigned long long)p->period[PERF_CYCLES]);
+    } else if (p->source == PERF_SOURCE_TIMER) {
+        fprintf(out, "perf_event_open isn't allowed here; sampling CPU time on a timer instead.\n");
+    } else {
+        fprintf(out, "Sampled every %llu cycles", (unsigned long long)p->period[PERF_CYCLES]);
+        for (uint32_t e = PERF_BRANCH_MISSES; e < PERF_EVENTS; e++) {
+            if (p->fd[e] >= 0) fprintf(out, ", %llu %s", (unsigned long long)p->period[e],
+                                       e == PERF_BRANCH_MISSES ? "branch misses" : "L1D misses");
+        }
+        fprintf(out, ".\n");
+    }
+
+    fprintf(out, "\nOpcodes (by %s)\n%-8s %14s %14s %9s %8s", unit, "OPCODE", "EXECUTED", first, "PER INSN", "%");
+    for (uint32_t e = PERF_BRANCH_MISSES; e < PERF_EVENTS; e++) {
+        if (p->fd[e] >= 0) fprintf(out, " %12s %9s", perf_columns[e], "PER INSN");
+    }
+    fprintf(out, "\n");
+    for (uint32_t op = 0; op < 256; op++) {
+        if (!p->executed[op] && !p->by_opcode[PERF_CYCLES][op]) continue;
+        rows[n].addr = op;
+        rows[n++].key = p->by_opcode[PERF_CYCLES][op];
+    }
+    qsort(rows, n, sizeof(profile_entry), compare_profile_entries);
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t op = rows[i].addr;
+        uint64_t events[PERF_EVENTS] = { p->by_opcode[0][op], p->by_opcode[1][op], p->by_opcode[2][op] };
+        fprintf(out, "%-8s %14llu %14llu %9.2f %7.2f%%", profile_op_name((uint8_t)op),
+                (unsigned long long)p->executed[op], (unsigned long long)rows[i].key,
+                p->executed[op] ? (double)rows[i].key / (double)p->executed[op] : 0.0, percent_of(rows[i].key, sampled));
+        perf_cells(out, p, events, p->executed[op]);
+    }
+
+    fprintf(out, "\nCalls (RUN/RUN16 targets, by inclusive %s)\n%-6s %14s %14s %8s %14s", unit,
+            "TARGET", "CALLS", "INCLUSIVE", "%", "SELF");
+    for (uint32_t e = PERF_BRANCH_MISSES; e < PERF_EVENTS; e++) {
+        if (p->fd[e] >= 0) fprintf(out, " %12s", perf_columns[e]);
+    }
+    fprintf(out, "\n");
+    n = profile_sorted(p->inclusive, MEMORY_SIZE, 1, rows);
+    for (uint32_t i = 0; i < n && i < top; i++) {
+        uint32_t addr = rows[i].addr;
+        uint64_t events[PERF_EVENTS] = { p->self[0][addr], p->self[1][addr], p->self[2][addr] };
+        fprintf(out, "%04X   %14llu %14llu %7.2f%% %14llu", (unsigned)addr, (unsigned long long)p->calls[addr],
+                (unsigned long long)rows[i].key, percent_of(rows[i].key, sampled), (unsigned long long)events[0]);
+        perf_cells(out, p, events, 0);
+    }
+    {
+        uint64_t events[PERF_EVENTS] = { p->self[0][PERF_OUTSIDE], p->self[1][PERF_OUTSIDE], p->self[2][PERF_OUTSIDE] };
+        fprintf(out, "%-6s %14s %14s %7.2f%% %14llu", "(none)", "", "", percent_of(events[0], sampled),
+                (unsigned long long)events[0]);
+        perf_cells(out, p, events, 0);
+    }
+    free(rows);
+#else
+    (void)vm;
+    (void)out;
+    (void)top;
+#endif
+}
+
+ // Differential testing (--fuzz, and LLVMFuzzerTestOneInput with -DSHREDDER_FUZZER)
+ // Runs one image on every engine at once, in slices of varying length, and
+ // compares each one's whole state with the switch engine after every slice:
+ // status, ip, instruction count, both stacks, the overflow flag, memory and
+ // everything written to out/err so far. The threaded and JIT engines run
+ // with and without superinstructions, and with the store checks off too when
+ // aot_analyze() says that's safe, so every fast path has to agree with
+ // execute() at every pause point, not just at the end.
+#if HAVE_BATCH && (!defined(SHREDDER_LIBRARY) || defined(SHREDDER_FUZZER))
+#define FUZZ_LIMIT      20000U     // instructions per program unless --max-insns says otherwise
+#define FUZZ_CODE_END   0xC0U      // generated code below here, data from here to 0xFF
+#define FUZZ_IMAGE_LEN  0x100U
+#define FUZZ_INPUT      "Shredder fuzz\n"   // what GETC reads
+#define FUZZ_MAX_VMS    6U
+
+typedef struct {
+    const char *name;
+    int         engine;
+    int         fuse;
+    int         fixed;                // run with store checks off (only for fixed code)
+} diff_variant;
+
+static const diff_variant diff_variants[] = {
+    { "switch",                SHRED_ENGINE_SWITCH,   1, 0 },   // the reference
+    { "threaded",              SHRED_ENGINE_THREADED, 1, 0 },
+    { "threaded --no-fuse",    SHRED_ENGINE_THREADED, 0, 0 },
+    { "threaded, fixed code",  SHRED_ENGINE_THREADED, 1, 1 },
+    { "jit",                   SHRED_ENGINE_JIT,      1, 0 },
+    { "jit, fixed code",       SHRED_ENGINE_JIT,      1, 1 },
+};
+
+typedef struct {
+    const uint8_t *image;
+    uint32_t       len, entry;
+    uint64_t       limit;             // instruction limit on every engine
+    uint64_t       schedule;          // seeds the slice lengths
+    uint64_t       instructions;      // what the switch engine ran
+    char           why[192];          // what differed, and where
+} diff_case;
+
+ // xorshift64*, so a seed always gives the same program and slices
+static uint64_t fuzz_next(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static uint32_t fuzz_below(uint64_t *state, uint32_t n) {
+    return (uint32_t)(fuzz_next(state) >> 32) % n;
+}
+
+static uint64_t fuzz_seed_state(uint64_t seed) {
+    uint64_t state = seed ^ 0x9E3779B97F4A7C15ULL;
+    return state ? state : 1;
+}
+
+ // b against the reference a. Returns 1 and fills why if anything differs
+static int diff_state(shred_vm *a, shred_vm *b, const char *out_a, size_t len_a,
+                      const char *out_b, size_t len_b, char *why, size_t why_len) {
+    if (a->status != b->status) {
+        snprintf(why, why_len, "status %d, not %d", (int)b->status, (int)a->status);
+    } else if (a->instruction_count != b->instruction_count) {
+        snprintf(why, why_len, "instruction count %llu, not %llu",
+                 (unsigned long long)b->instruction_count, (unsigned long long)a->instruction_count);
+    } else if (a->ip != b->ip) {
+        snprintf(why, why_len, "ip %04X, not %04X", (unsigned)b->ip, (unsigned)a->ip);
+    } else if (a->stack_pointer != b->stack_pointer ||
+               memcmp(a->call_stack, b->call_stack, a->stack_pointer * sizeof(a->call_stack[0])) != 0) {
+        snprintf(why, why_len, "call stack differs (depth %u, not %u)",
+                 (unsigned)b->stack_pointer, (unsigned)a->stack_pointer);
+    } else if (a->data_pointer != b->data_pointer ||
+               memcmp(a->data_stack, b->data_stack, a->data_pointer * sizeof(a->data_stack[0])) != 0) {
+        snprintf(why, why_len, "data stack differs (depth %u, not %u)",
+                 (unsigned)b->data_pointer, (unsigned)a->data_pointer);
+    } else if (a->overflow_flag != b->overflow_flag) {
+        snprintf(why, why_len, "overflow flag %u, not %u", (unsigned)b->overflow_flag, (unsigned)a->overflow_flag);
+    } else if (memcmp(a->memory, b->memory, MEMORY_SIZE) != 0) {
+        uint32_t addr = 0;
+        while (a->memory[addr] == b->memory[addr]) addr++;
+        snprintf(why, why_len, "memory[%04X] = %02X, not %02X", (unsigned)addr,
+                 (unsigned)b->memory[addr], (unsigned)a->memory[addr]);
+    } else if (len_a != len_b || memcmp(out_a, out_b, len_a) != 0) {
+        size_t at = 0;
+        while (at < len_a && at < len_b && out_a[at] == out_b[at]) at++;
+        snprintf(why, why_len, "output differs from byte %lu (%lu bytes, not %lu)",
+                 (unsigned long)at, (unsigned long)len_b, (unsigned long)len_a);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+ // Returns 0 if every engine agreed with the switch engine all the way,
+ // 1 if one didn't (c->why says which and how), -1 if out of memory
+static int diff_run(diff_case *c) {
+    shred_vm *vms[FUZZ_MAX_VMS] = { NULL };
+    FILE *outs[FUZZ_MAX_VMS] = { NULL };
+    char *bufs[FUZZ_MAX_VMS] = { NULL };
+    size_t lens[FUZZ_MAX_VMS] = { 0 };
+    const diff_variant *used[FUZZ_MAX_VMS];
+    uint32_t n = 0;
+    int rc = -1;
+
+    uint8_t *first = calloc(MEMORY_SIZE, 1);
+    if (!first) return -1;
+    memcpy(first, c->image, c->len);
+    int fixed = fixed_code_image(first, c->entry, c->len);
+    free(first);
+
+    for (uint32_t i = 0; i < sizeof(diff_variants) / sizeof(diff_variants[0]); i++) {
+        const diff_variant *v = &diff_variants[i];
+        if ((v->engine == SHRED_ENGINE_JIT && !HAVE_JIT) || (v->fixed && !fixed)) continue;
+        shred_vm *vm = shred_vm_create();
+        FILE *out = vm ? open_memstream(&bufs[n], &lens[n]) : NULL;
+        vms[n] = vm;
+        outs[n] = out;
+        used[n++] = v;
+        if (!out || shred_vm_feed_input(vm, FUZZ_INPUT, strlen(FUZZ_INPUT)) != 0) goto cleanup;
+        shred_vm_close_input(vm);
+        shred_vm_set_io(vm, NULL, out, out);
+        shred_vm_set_engine(vm, v->engine);
+        shred_vm_set_fusion(vm, v->fuse);
+        shred_vm_set_limit(vm, c->limit);
+        memcpy(vm->memory, c->image, c->len);   // raw, a "SHBN" image doesn't get to set the flags
+        vm->image_len = c->len;
+        vm->entry = vm->ip = c->entry;
+        vm->fixed_code = v->fixed;
+    }
+
+    // slices from 1 instruction (a pause between every pair) to long enough for the JIT
+    static const uint64_t slices[] = { 1, 2, 7, 50, 333, 5000, 100000 };
+    uint64_t state = fuzz_seed_state(c->schedule);
+    rc = 0;
+    for (;;) {
+        uint64_t steps = slices[fuzz_below(&state, sizeof(slices) / sizeof(slices[0]))];
+        for (uint32_t i = 0; i < n; i++) {
+            shred_vm_run(vms[i], steps);
+            fflush(outs[i]);
+        }
+        for (uint32_t i = 1; i < n && !rc; i++) {
+            char detail[160];
+            if (diff_state(vms[0], vms[i], bufs[0], lens[0], bufs[i], lens[i], detail, sizeof(detail))) {
+                snprintf(c->why, sizeof(c->why), "%s: %s after %llu instructions", used[i]->name, detail,
+                         (unsigned long long)vms[0]->instruction_count);
+                rc = 1;
+            }
+        }
+        if (rc || vms[0]->status != SHRED_PAUSED) break;
+    }
+    c->instructions = vms[0]->instruction_count;
+
+cleanup:
+    for (uint32_t i = 0; i < n; i++) {
+        if (outs[i]) fclose(outs[i]);
+        free(bufs[i]);
+        shred_vm_destroy(vms[i]);
+    }
+    return rc;
+}
+
+#ifdef SHREDDER_FUZZER
+ // libFuzzer entry point:
+ //   clang -fsanitize=fuzzer,address -DSHREDDER_LIBRARY -DSHREDDER_FUZZER shredder.c
+ // The first byte says how the rest loads (odd: .shred text, even: a raw or
+ // .shbin image), so the loaders get fuzzed too; whatever loads then runs on
+ // every engine, and a disagreement aborts with what differed.
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static shred_vm *loader;
+    if (!loader) {
+        FILE *sink = fopen("/dev/null", "w");
+        if (!sink || !(loader = shred_vm_create())) abort();
+        shred_vm_set_io(loader, NULL, sink, sink);   // load errors are expected
+    }
+    if (size == 0) return 0;
+
+    int rc = (data[0] & 1) ? shred_vm_load(loader, (const char *)data + 1, size - 1)
+                           : shred_vm_load_image(loader, data + 1, size - 1);
+    if (rc != 0) return 0;
+    diff_case c;
+    memset(&c, 0, sizeof(c));
+    c.image = loader->memory;
+    c.len = loader->image_len;
+    c.entry = loader->entry;
+    c.limit = FUZZ_LIMIT;
+    c.schedule = size;
+    if (diff_run(&c) == 1) {
+        fprintf(stderr, "Engines disagree: %s\n", c.why);
+        abort();
+    }
+    return 0;
+}
+#endif
+#endif
+
+#ifndef SHREDDER_LIBRARY
+
+#define MAX_FORKS  256U   // --fork-input files per run
+#define BENCH_RUNS_DEFAULT  5U
+#define BENCH_TOLERANCE     10.0   // percent slower than the baseline that counts as a regression
+
+ // Ahead-of-time translation to C (--emit-c)
+ // Writes one labelled block per instruction aot_analyze() found reachable,
+ // with the same semantics and fault messages as execute(). That is exact as
+ // long as the program can't modify its own code; otherwise the file embeds
+ // an interpreter built from the same per-opcode snippets, so the output is
+ // always correct.
+#define C_EXPR_LEN  64
+
+typedef struct {
+    FILE           *out;
+    int             dynamic;   // 1 = embedded interpreter, operands read from memory[ip + n]
+    uint32_t        ip;        // static mode: address being translated
+    const uint8_t  *memory;    // static mode: the loaded image
+    const uint8_t  *reach;     // static mode: aot_analyze() results
+    const uint16_t *opener;
+} c_emitter;
+
+ // 8-bit operand k bytes after the opcode
+static void c_operand8(const c_emitter *e, uint32_t k, char *buf) {
+    if (e->dynamic) snprintf(buf, C_EXPR_LEN, "memory[ip + %u]", (unsigned)k);
+    else snprintf(buf, C_EXPR_LEN, "0x%02X", (e->ip + k < MEMORY_SIZE) ? e->memory[e->ip + k] : 0);
+}
+
+ // 16-bit operand starting k bytes after the opcode
+static void c_operand16(const c_emitter *e, uint32_t k, char *buf) {
+    if (e->dynamic) {
+        snprintf(buf, C_EXPR_LEN, "(((uint32_t)memory[ip + %u] << 8) | memory[ip + %u])", (unsigned)k, (unsigned)k + 1);
+    } else {
+        snprintf(buf, C_EXPR_LEN, "0x%04X", ((unsigned)e->memory[e->ip + k] << 8) | e->memory[e->ip + k + 1]);
+    }
+}
+
+ // the current ip, for fault messages and return addresses
+static void c_here(const c_emitter *e, uint32_t offset, char *buf) {
+    if (e->dynamic) snprintf(buf, C_EXPR_LEN, "(ip + %u)", (unsigned)offset);
+    else snprintf(buf, C_EXPR_LEN, "0x%04XU", (unsigned)(e->ip + offset));
+}
+
+ // jump to the address held in operand k
+static void c_jump(const c_emitter *e, uint32_t k, int wide) {
+    char target[C_EXPR_LEN];
+    if (e->dynamic) {
+        if (wide) c_operand16(e, k, target);
+        else c_operand8(e, k, target);
+        fprintf(e->out, "ip = %s; continue;", target);
+    } else {
+        uint32_t addr = wide ? (((uint32_t)e->memory[e->ip + k] << 8) | e->memory[e->ip + k + 1])
+                             : e->memory[e->ip + k];
+        fprintf(e->out, "goto L_%04X;", (unsigned)addr);
+    }
+}
+
+ // jump to whatever address is in ip (returns)
+static void c_jump_ip(const c_emitter *e) {
+    fprintf(e->out, e->dynamic ? "continue;" : "goto dispatch;");
+}
+
+ // fall through to the next instruction
+static void c_next(const c_emitter *e, uint32_t length) {
+    if (e->dynamic) fprintf(e->out, "    ip += %u; continue;\n", (unsigned)length);
+}
+
+static void c_fault(const c_emitter *e, const char *fmt, const char *arg) {
+    fprintf(e->out, "{ fprintf(stderr, \"CPU Fault: %s\\n\", %s); goto done; }", fmt, arg);
+}
+
+ // body of one instruction; the opcode byte was checked for length already
+static void emit_c_insn(const c_emitter *e, uint8_t opcode) {
+    FILE *out = e->out;
+    char a[C_EXPR_LEN], b[C_EXPR_LEN], c[C_EXPR_LEN], here[C_EXPR_LEN], ret[C_EXPR_LEN];
+    uint32_t length = op_table[opcode].length;
+
+    c_operand8(e, 1, a);
+    c_operand8(e, 2, b);
+    c_operand8(e, 3, c);
+    c_here(e, 0, here);
+
+    switch (opcode) {
+        case OP_NOP:
+            break;
+        case OP_POKE:    fprintf(out, "    memory[%s] = %s;\n", a, b); break;
+        case OP_MOVE:    fprintf(out, "    memory[%s] = memory[%s];\n", b, a); break;
+        case OP_NOT:     fprintf(out, "    memory[%s] = ~memory[%s];\n", a, a); break;
+        case OP_NAND:    fprintf(out, "    memory[%s] = ~(memory[%s] & memory[%s]);\n", c, a, b); break;
+        case OP_AND:     fprintf(out, "    memory[%s] = memory[%s] & memory[%s];\n", c, a, b); break;
+        case OP_OR:      fprintf(out, "    memory[%s] = memory[%s] | memory[%s];\n", c, a, b); break;
+        case OP_XOR:     fprintf(out, "    memory[%s] = memory[%s] ^ memory[%s];\n", c, a, b); break;
+        case OP_INC:     fprintf(out, "    memory[%s]++;\n", a); break;
+        case OP_DEC:     fprintf(out, "    memory[%s]--;\n", a); break;
+        case OP_CMP:     fprintf(out, "    memory[%s] = (memory[%s] == memory[%s]) ? 1 : 0;\n", c, a, b); break;
+        case OP_PUTC:    fprintf(out, "    putchar(memory[%s]); fflush(stdout);\n", a); break;
+        case OP_PUTN:    fprintf(out, "    printf(\"%%d\", memory[%s]); fflush(stdout);\n", a); break;
+        case OP_GETC:    fprintf(out, "    { int ch = getchar(); memory[%s] = (ch == EOF) ? 0 : (uint8_t)ch; }\n", a); break;
+        case OP_ADD:
+        case OP_MUL:
+            fprintf(out, "    { uint16_t r = (uint16_t)memory[%s] %c (uint16_t)memory[%s];"
+                         " memory[%s] = (uint8_t)r; overflow_flag = (r > 255) ? 1 : 0; }\n",
+                    a, opcode == OP_ADD ? '+' : '*', b, c);
+            break;
+        case OP_SUB:
+            fprintf(out, "    { int16_t r = (int16_t)memory[%s] - (int16_t)memory[%s];"
+                         " memory[%s] = (uint8_t)r; overflow_flag = (r < 0) ? 1 : 0; }\n", a, b, c);
+            break;
+        case OP_DIV:
+            fprintf(out, "    if (memory[%s] == 0) ", b);
+            c_fault(e, "Division by zero at 0x%04X", here);
+            fprintf(out, "\n    memory[%s] = memory[%s] / memory[%s];\n", c, a, b);
+            break;
+        case OP_SHL:     fprintf(out, "    memory[%s] = memory[%s] << (memory[%s] & 0x07);\n", c, a, b); break;
+        case OP_SHR:     fprintf(out, "    memory[%s] = memory[%s] >> (memory[%s] & 0x07);\n", c, a, b); break;
+        case OP_POKE16:
+            c_operand16(e, 1, a);
+            fprintf(out, "    memory[%s] = %s;\n", a, c);
+            break;
+        case OP_MOVE16:
+            c_operand16(e, 1, a);
+            c_operand16(e, 3, b);
+            fprintf(out, "    memory[%s] = memory[%s];\n", b, a);
+            break;
+        case OP_PUSH:
+        case OP_PUSH16_MEM:
+            if (opcode == OP_PUSH16_MEM) c_operand16(e, 1, a);
+            fprintf(out, "    if (data_pointer >= DATA_STACK_SIZE) ");
+            c_fault(e, "Data stack overflow (max depth: %u) at instruction %llu",
+                    "(unsigned)DATA_STACK_SIZE, (unsigned long long)instruction_count");
+            if (opcode == OP_PUSH) fprintf(out, "\n    data_stack[data_pointer++] = memory[%s];\n", a);
+            else fprintf(out, "\n    data_stack[data_pointer++] = (uint16_t)((memory[%s] << 8) | memory[%s + 1]);\n", a, a);
+            break;
+        case OP_POP:
+        case OP_POP16_MEM:
+            if (opcode == OP_POP16_MEM) c_operand16(e, 1, a);
+            fprintf(out, "    if (data_pointer == 0) ");
+            c_fault(e, "Data stack underflow at instruction %llu", "(unsigned long long)instruction_count");
+            fprintf(out, "\n    data_pointer--;\n");
+            if (opcode == OP_POP) {
+                fprintf(out, "    memory[%s] = (uint8_t)data_stack[data_pointer];\n", a);
+            } else {
+                fprintf(out, "    memory[%s] = (uint8_t)(data_stack[data_pointer] >> 8);\n", a);
+                fprintf(out, "    memory[%s + 1] = (uint8_t)data_stack[data_pointer];\n", a);
+            }
+            break;
+        case OP_BAND16:
+        case OP_BOR16:
+        case OP_BXOR16:
+        case OP_BNOT16:
+        case OP_BNAND16:
+        case OP_LT16_CMP:
+        case OP_GT16_CMP: {
+            static const char *const word_expr[256] = {
+                [OP_BAND16] = "wa & wb", [OP_BOR16] = "wa | wb", [OP_BXOR16] = "wa ^ wb",
+                [OP_BNOT16] = "~wa", [OP_BNAND16] = "~(wa & wb)",
+                [OP_LT16_CMP] = "wa < wb", [OP_GT16_CMP] = "wa > wb",
+            };
+            char dest[C_EXPR_LEN];
+            int compare = (opcode == OP_LT16_CMP || opcode == OP_GT16_CMP);
+            c_operand16(e, 1, a);
+            if (opcode == OP_BNOT16) {
+                snprintf(b, C_EXPR_LEN, "%s", a);
+                snprintf(dest, C_EXPR_LEN, "%s", a);
+            } else {
+                c_operand16(e, 3, b);
+                if (compare) c_operand8(e, 5, dest);
+                else c_operand16(e, 5, dest);
+            }
+            if (e->dynamic) {
+                fprintf(out, "    if (%s + 2 > MEMORY_SIZE || %s + 2 > MEMORY_SIZE", a, b);
+                if (!compare) fprintf(out, " || %s + 2 > MEMORY_SIZE", dest);
+                fprintf(out, ") ");
+                char fmt[C_EXPR_LEN];
+                snprintf(fmt, sizeof(fmt), "%s out of bounds at 0x%%04X", op_table[opcode].name);
+                c_fault(e, fmt, here);
+                fprintf(out, "\n");
+            }
+            fprintf(out, "    { uint16_t wa = (uint16_t)((memory[%s] << 8) | memory[%s + 1]);", a, a);
+            fprintf(out, " uint16_t wb = (uint16_t)((memory[%s] << 8) | memory[%s + 1]); (void)wb;\n", b, b);
+            if (compare) {
+                fprintf(out, "      memory[%s] = (%s) ? 1 : 0; }\n", dest, word_expr[opcode]);
+            } else {
+                fprintf(out, "      uint16_t wr = (uint16_t)(%s);", word_expr[opcode]);
+                fprintf(out, " memory[%s] = (uint8_t)(wr >> 8); memory[%s + 1] = (uint8_t)wr; }\n", dest, dest);
+            }
+            break;
+        }
+        case OP_BCOPY:
+        case OP_BCMP: {
+            char len[C_EXPR_LEN], dest[C_EXPR_LEN];
+            c_operand16(e, 1, a);
+            c_operand16(e, 3, b);
+            c_operand16(e, 5, len);
+            c_operand8(e, 7, dest);
+            // static code passed check_insn(), so only the interpreter checks ranges
+            if (e->dynamic) {
+                fprintf(out, "    if (%s + %s > MEMORY_SIZE || %s + %s > MEMORY_SIZE) ", a, len, b, len);
+                c_fault(e, opcode == OP_BCOPY ? "BCOPY out of bounds at 0x%04X" : "BCMP out of bounds at 0x%04X", here);
+                fprintf(out, "\n");
+            }
+            if (opcode == OP_BCOPY) fprintf(out, "    memmove(&memory[%s], &memory[%s], %s);\n", b, a, len);
+            else fprintf(out, "    memory[%s] = (memcmp(&memory[%s], &memory[%s], %s) == 0) ? 1 : 0;\n", dest, a, b, len);
+            break;
+        }
+        case OP_BFILL: {
+            char value[C_EXPR_LEN];
+            c_operand16(e, 1, a);
+            c_operand16(e, 3, b);
+            c_operand8(e, 5, value);
+            if (e->dynamic) {
+                fprintf(out, "    if (%s + %s > MEMORY_SIZE) ", a, b);
+                c_fault(e, "BFILL out of bounds at 0x%04X", here);
+                fprintf(out, "\n");
+            }
+            fprintf(out, "    memset(&memory[%s], %s, %s);\n", a, value, b);
+            break;
+        }
+        // the translation has no bank files: BANK can only put plain memory
+        // back, which it already is, and every file is 0 pages long
+        case OP_BANK: {
+            char fault[C_EXPR_LEN * 2 + 2];
+            if (e->dynamic) {
+                fprintf(out, "    if (%s >= %uU) ", a, (unsigned)BANK_WINDOWS);
+                c_fault(e, "BANK out of bounds at 0x%04X", here);
+                fprintf(out, "\n");
+            }
+            snprintf(fault, sizeof(fault), "%s, %s", b, here);
+            fprintf(out, "    if (%s != 0xFF) ", b);
+            c_fault(e, "BANK file 0x%02X not attached at 0x%04X", fault);
+            fprintf(out, "\n");
+            break;
+        }
+        case OP_BANKLEN:
+            c_operand16(e, 2, b);
+            if (e->dynamic) {
+                fprintf(out, "    if (%s + 2 > MEMORY_SIZE) ", b);
+                c_fault(e, "BANKLEN out of bounds at 0x%04X", here);
+                fprintf(out, "\n");
+            }
+            fprintf(out, "    memory[%s] = 0; memory[%s + 1] = 0;\n", b, b);
+            break;
+        case OP_COMMENT:
+            if (e->dynamic) {
+                fprintf(out, "    if (ip + 2 + %s > MEMORY_SIZE) ", a);
+                c_fault(e, "COMMENT overflows memory at 0x%04X", here);
+                fprintf(out, "\n    ip += 2 + %s; continue;\n", a);
+            } else {
+                fprintf(out, "    goto L_%04X;\n", (unsigned)(e->ip + 2 + e->memory[e->ip + 1]));
+            }
+            return;
+        case OP_JMP:
+        case OP_JMP16:
+            fprintf(out, "    ");
+            c_jump(e, 1, opcode == OP_JMP16);
+            fprintf(out, "\n");
+            return;
+        case OP_JZ:
+            fprintf(out, "    if (memory[%s] == 0) { ", b);
+            c_jump(e, 1, 0);
+            fprintf(out, " }\n");
+            break;
+        case OP_JZ16:
+            fprintf(out, "    if (memory[%s] == 0) { ", c);
+            c_jump(e, 1, 1);
+            fprintf(out, " }\n");
+            break;
+        case OP_RUN:
+        case OP_RUN16:
+            c_here(e, length, ret);
+            fprintf(out, "    if (stack_pointer >= STACK_SIZE) ");
+            c_fault(e, "Stack overflow (max depth: %u) at instruction %llu",
+                    "(unsigned)STACK_SIZE, (unsigned long long)instruction_count");
+            fprintf(out, "\n    call_stack[stack_pointer++] = (uint16_t)%s;\n    ", ret);
+            c_jump(e, 1, opcode == OP_RUN16);
+            fprintf(out, "\n");
+            return;
+        case OP_IF:
+        case OP_FOR:
+            if (e->dynamic) {
+                fprintf(out, "    { int32_t end = ctrl_resolve(ip); if (end < 0) goto done;\n");
+                fprintf(out, "      if (memory[%s] != 0) { ip += 2; continue; }\n", a);
+                if (opcode == OP_FOR) {
+                    fprintf(out, "      ip = (uint32_t)end + 1; continue; }\n");
+                } else {
+                    fprintf(out, "      uint32_t k = (uint32_t)ctrl_next(ip);\n");
+                    fprintf(out, "      while (memory[k] == OP_ELSEIF && memory[memory[k + 1]] == 0) k = (uint32_t)ctrl_next(k);\n");
+                    fprintf(out, "      ip = (memory[k] == OP_ELSEIF) ? k + 2 : k + 1; continue; }\n");
+                }
+                return;
+            } else {
+                uint32_t bad;
+                int32_t end = ctrl_match(e->memory, e->ip, &bad);
+                fprintf(out, "    if (memory[%s] == 0) { ", a);
+                if (opcode == OP_IF) {
+                    int32_t k = ctrl_next_clause(e->memory, e->ip);
+                    for (; e->memory[k] == OP_ELSEIF; k = ctrl_next_clause(e->memory, (uint32_t)k)) {
+                        fprintf(out, "if (memory[0x%02X] != 0) goto L_%04X; ", e->memory[k + 1], (unsigned)k + 2);
+                    }
+                    fprintf(out, "goto L_%04X; }\n", (unsigned)k + 1);
+                } else {
+                    fprintf(out, "goto L_%04X; }\n", (unsigned)end + 1);
+                }
+            }
+            break;
+        case OP_ELSE:
+        case OP_ELSEIF:
+        case OP_THEN: {
+            char fmt[C_EXPR_LEN];
+            snprintf(fmt, sizeof(fmt), "%s outside IF/FOR at 0x%%04X", op_table[opcode].name);
+            if (e->dynamic) {
+                fprintf(out, "    { uint32_t opener; int32_t end = ctrl_clause(ip, &opener); if (end < 0) goto done;\n");
+                if (opcode == OP_THEN) {
+                    fprintf(out, "      if (memory[opener] == OP_FOR && --memory[memory[opener + 1]] != 0) { ip = opener + 2; continue; }\n");
+                    fprintf(out, "      ip += 1; continue; }\n");
+                } else {
+                    fprintf(out, "      (void)opener; ip = (uint32_t)end + 1; continue; }\n");
+                }
+                return;
+            }
+            if (!(e->reach[e->ip] & AOT_CLAUSE)) {
+                fprintf(out, "    ");
+                c_fault(e, fmt, here);
+                fprintf(out, "\n");
+                return;
+            }
+            uint32_t opener = e->opener[e->ip], bad;
+            if (opcode != OP_THEN) {
+                fprintf(out, "    goto L_%04X;\n", (unsigned)ctrl_match(e->memory, opener, &bad) + 1);
+                return;
+            }
+            if (e->memory[opener] == OP_FOR) {
+                fprintf(out, "    if (--memory[0x%02X] != 0) goto L_%04X;\n",
+                        e->memory[opener + 1], (unsigned)opener + 2);
+            }
+            break;
+        }
+        case OP_ERROR: {
+            char args[2 * C_EXPR_LEN + 2];
+            snprintf(args, sizeof(args), "%s, %s", a, here);
+            fprintf(out, "    ");
+            c_fault(e, "ERROR 0x%02X at 0x%04X", args);
+            fprintf(out, "\n");
+            return;
+        }
+        case OP_HALT:
+            fprintf(out, "    if (stack_pointer == 0) goto done;\n");
+            fprintf(out, "    ip = call_stack[--stack_pointer]; ");
+            c_jump_ip(e);
+            fprintf(out, "\n");
+            return;
+        case OP_RET:
+            fprintf(out, "    if (stack_pointer == 0) ");
+            c_fault(e, "RET with empty stack at 0x%04X", here);
+            fprintf(out, "\n    ip = call_stack[--stack_pointer]; ");
+            c_jump_ip(e);
+            fprintf(out, "\n");
+            return;
+        default:
+            break;
+    }
+    c_next(e, length);
+}
+
+static void emit_c_prologue(FILE *out, const uint8_t *memory, uint64_t limit, const char *source) {
+    uint32_t image_len = MEMORY_SIZE;
+    while (image_len > 0 && memory[image_len - 1] == 0) image_len--;
+
+    fprintf(out, "/* Generated by shredder --emit-c from '%s' */\n", source);
+    fprintf(out, "#include <stdio.h>\n#include <stdint.h>\n#include <string.h>\n\n");
+    fprintf(out, "#if defined(__GNUC__)\n#pragma GCC diagnostic ignored \"-Wunused-label\"\n#endif\n\n");
+    fprintf(out, "#define MEMORY_SIZE       %uU\n", (unsigned)MEMORY_SIZE);
+    fprintf(out, "#define STACK_SIZE        %uU\n", (unsigned)STACK_SIZE);
+    fprintf(out, "#define DATA_STACK_SIZE   %uU\n", (unsigned)DATA_STACK_SIZE);
+    fprintf(out, "#define MAX_INSTRUCTIONS  %lluULL\n\n", (unsigned long long)limit);
+    fprintf(out, "static uint8_t  memory[MEMORY_SIZE] = {");
+    if (image_len == 0) fprintf(out, " 0");
+    for (uint32_t i = 0; i < image_len; i++) {
+        fprintf(out, "%s0x%02X,", (i % 16 == 0) ? "\n    " : " ", memory[i]);
+    }
+    fprintf(out, "\n};\n");
+    fprintf(out, "static uint16_t call_stack[STACK_SIZE];\n");
+    fprintf(out, "static uint16_t stack_pointer = 0;\n");
+    fprintf(out, "static uint16_t data_stack[DATA_STACK_SIZE];\n");
+    fprintf(out, "static uint16_t data_pointer = 0;\n");
+    fprintf(out, "static uint8_t  overflow_flag = 0;\n");
+    fprintf(out, "static uint64_t instruction_count = 0;\n\n");
+}
+
+ // start of main(), shared by both modes
+static void emit_c_main(FILE *out, uint32_t entry) {
+    fprintf(out, "int main(void) {\n    uint32_t ip = 0x%04XU;\n", (unsigned)entry);
+    fprintf(out, "    (void)memory; (void)call_stack; (void)stack_pointer; (void)overflow_flag;\n");
+    fprintf(out, "    (void)data_stack; (void)data_pointer;\n");
+}
+
+static void emit_c_static(FILE *out, const uint8_t *memory, uint32_t entry, const uint8_t *reach,
+                          const uint16_t *opener) {
+    c_emitter e = { out, 0, 0, memory, reach, opener };
+
+    emit_c_main(out, entry);
+    fprintf(out, "    goto L_%04X;\n\n", (unsigned)entry);
+    for (uint32_t ip = 0; ip <= MEMORY_SIZE; ip++) {
+        if (!(reach[ip] & (AOT_INSN | AOT_FAULT))) continue;
+
+        fprintf(out, "L_%04X:", (unsigned)ip);
+        if (reach[ip] & AOT_FAULT) {
+            fprintf(out, " /* fault */\n    if (++instruction_count > MAX_INSTRUCTIONS) goto limit;\n    ");
+            if (!is_valid_address(ip)) {
+                fprintf(out, "fprintf(stderr, \"CPU Fault: IP 0x%04X out of bounds\\n\");", (unsigned)ip);
+            } else if (op_table[memory[ip]].length == 0) {
+                fprintf(out, "fprintf(stderr, \"CPU Fault: Unknown opcode 0x%02X at 0x%04X\\n\");",
+                        memory[ip], (unsigned)ip);
+            } else if (memory[ip] == OP_COMMENT && ensure_operands(ip, 2)) {
+                fprintf(out, "fprintf(stderr, \"CPU Fault: COMMENT overflows memory at 0x%04X\\n\");", (unsigned)ip);
+            } else if ((memory[ip] == OP_IF || memory[ip] == OP_FOR) && ensure_operands(ip, 2)) {
+                uint32_t bad = ip;
+                ctrl_match(memory, ip, &bad);
+                fprintf(out, "fprintf(stderr, \"CPU Fault: %s %s at 0x%04X\\n\");", op_table[memory[bad]].name,
+                        (bad == ip) ? "without THEN" : "out of place", (unsigned)bad);
+            } else if (ensure_operands(ip, op_table[memory[ip]].length)) {
+                fprintf(out, "fprintf(stderr, \"CPU Fault: %s out of bounds at 0x%04X\\n\");",
+                        op_table[memory[ip]].name, (unsigned)ip);
+            } else {
+                fprintf(out, "fprintf(stderr, \"CPU Fault: %s truncated at 0x%04X\\n\");",
+                        op_table[memory[ip]].name, (unsigned)ip);
+            }
+            fprintf(out, "\n    goto done;\n");
+            continue;
+        }
+
+        uint8_t opcode = memory[ip];
+        uint32_t next = ip + op_table[opcode].length;
+        fprintf(out, " /* %s */\n    if (++instruction_count > MAX_INSTRUCTIONS) goto limit;\n",
+                op_table[opcode].name);
+        e.ip = ip;
+        emit_c_insn(&e, opcode);
+
+        // fall through to the next reachable instruction, or jump if it isn't next in the file
+        switch (opcode) {
+            case OP_JMP: case OP_JMP16: case OP_RUN: case OP_RUN16:
+            case OP_HALT: case OP_RET: case OP_COMMENT:
+            case OP_ELSE: case OP_ELSEIF: case OP_ERROR:
+                break;
+            default: {
+                uint32_t following = ip + 1;
+                while (following <= MEMORY_SIZE && !(reach[following] & (AOT_INSN | AOT_FAULT))) following++;
+                if (following != next) fprintf(out, "    goto L_%04X;\n", (unsigned)next);
+                break;
+            }
+        }
+    }
+
+    fprintf(out, "\ndispatch:\n    switch (ip) {\n");
+    for (uint32_t ip = 0; ip < MEMORY_SIZE; ip++) {
+        if (reach[ip] & AOT_RETURN) fprintf(out, "        case 0x%04XU: goto L_%04X;\n", (unsigned)ip, (unsigned)ip);
+    }
+    fprintf(out, "        default: goto done;\n    }\n");
+}
+
+static void emit_c_interpreter(FILE *out, uint32_t entry) {
+    c_emitter e = { out, 1, 0, NULL, NULL, NULL };
+
+    fprintf(out, "static const uint8_t op_length[256] = {");
+    for (int i = 0; i < 256; i++) fprintf(out, "%s%u,", (i % 16 == 0) ? "\n    " : " ", op_table[i].length);
+    fprintf(out, "\n};\nstatic const char *const op_name[256] = {\n");
+    for (int i = 0; i < 256; i++) {
+        if (op_table[i].length) fprintf(out, "    [0x%02X] = \"%s\",\n", i, op_table[i].name);
+    }
+    fprintf(out, "};\n\n");
+
+    // IF/FOR: code may change under them at any time here, so they scan on every run
+    fprintf(out, "#define OP_COMMENT 0x%02X\n#define OP_IF 0x%02X\n#define OP_THEN 0x%02X\n#define OP_ELSE 0x%02X\n"
+                 "#define OP_ELSEIF 0x%02X\n#define OP_FOR 0x%02X\n\n",
+            OP_COMMENT, OP_IF, OP_THEN, OP_ELSE, OP_ELSEIF, OP_FOR);
+    fprintf(out,
+        "static uint16_t ctrl_opener[MEMORY_SIZE];   /* the IF/FOR that last claimed each clause */\n"
+        "static uint32_t ctrl_stamp[MEMORY_SIZE], ctrl_clock;\n\n"
+        "/* next ELSEIF/ELSE/THEN of the same IF/FOR after from, -1 if there is none */\n"
+        "static int32_t ctrl_next(uint32_t from) {\n"
+        "    uint32_t depth = 0, q = from + op_length[memory[from]];\n"
+        "    while (q < MEMORY_SIZE) {\n"
+        "        uint8_t op = memory[q];\n"
+        "        uint32_t len = op_length[op];\n"
+        "        if (op == OP_COMMENT && q + 1 < MEMORY_SIZE) len = 2 + memory[q + 1];\n"
+        "        if (len == 0 || q + len > MEMORY_SIZE) return -1;\n"
+        "        if (op == OP_IF || op == OP_FOR) depth++;\n"
+        "        else if (op == OP_THEN) { if (depth == 0) return (int32_t)q; depth--; }\n"
+        "        else if ((op == OP_ELSE || op == OP_ELSEIF) && depth == 0) return (int32_t)q;\n"
+        "        q += len;\n"
+        "    }\n"
+        "    return -1;\n"
+        "}\n\n"
+        "/* the THEN closing the IF/FOR at opener; -1 - the clause out of place, or -1 - opener without a THEN */\n"
+        "static int32_t ctrl_match(uint32_t opener) {\n"
+        "    uint8_t prev = memory[opener];\n"
+        "    int32_t k = (int32_t)opener;\n"
+        "    for (;;) {\n"
+        "        k = ctrl_next((uint32_t)k);\n"
+        "        if (k < 0) return -1 - (int32_t)opener;\n"
+        "        if (memory[k] == OP_THEN) return k;\n"
+        "        if (memory[opener] == OP_FOR || prev == OP_ELSE) return -1 - k;\n"
+        "        prev = memory[k];\n"
+        "    }\n"
+        "}\n\n"
+        "/* match the IF/FOR at opener and claim its clauses: its THEN, or -1 after a fault */\n"
+        "static int32_t ctrl_resolve(uint32_t opener) {\n"
+        "    int32_t k = ctrl_match(opener);\n"
+        "    if (k < 0) {\n"
+        "        uint32_t bad = (uint32_t)(-1 - k);\n"
+        "        fprintf(stderr, \"CPU Fault: %%s %%s at 0x%%04X\\n\", op_name[memory[bad]],\n"
+        "                (bad == opener) ? \"without THEN\" : \"out of place\", (unsigned)bad);\n"
+        "        return -1;\n"
+        "    }\n"
+        "    if (++ctrl_clock == 0) ctrl_clock = 1;\n"
+        "    for (int32_t c = ctrl_next(opener); ; c = ctrl_next((uint32_t)c)) {\n"
+        "        ctrl_opener[c] = (uint16_t)opener;\n"
+        "        ctrl_stamp[c] = ctrl_clock;\n"
+        "        if (c == k) return k;\n"
+        "    }\n"
+        "}\n\n"
+        "/* the closest IF/FOR before a clause nothing has claimed yet that it belongs to */\n"
+        "static int32_t ctrl_claimant(uint32_t ip) {\n"
+        "    for (uint32_t a = ip; a-- > 0;) {\n"
+        "        if (memory[a] != OP_IF && memory[a] != OP_FOR) continue;\n"
+        "        int32_t k = ctrl_next(a);\n"
+        "        while (k >= 0 && (uint32_t)k < ip && memory[k] != OP_THEN) k = ctrl_next((uint32_t)k);\n"
+        "        if (k == (int32_t)ip && ctrl_match(a) >= 0) return (int32_t)a;\n"
+        "    }\n"
+        "    return -1;\n"
+        "}\n\n"
+        "/* a clause's IF/FOR (matched again) and its THEN, or -1 after a fault */\n"
+        "static int32_t ctrl_clause(uint32_t ip, uint32_t *opener) {\n"
+        "    int32_t found = ctrl_stamp[ip] ? (int32_t)ctrl_opener[ip] : ctrl_claimant(ip);\n"
+        "    *opener = (uint32_t)found;\n"
+        "    if (found >= 0 && (memory[found] == OP_IF || memory[found] == OP_FOR)) {\n"
+        "        int32_t end = ctrl_resolve(*opener);\n"
+        "        if (end < 0) return -1;\n"
+        "        if (ctrl_stamp[ip] == ctrl_clock && ctrl_opener[ip] == *opener) return end;\n"
+        "    }\n"
+        "    fprintf(stderr, \"CPU Fault: %%s outside IF/FOR at 0x%%04X\\n\", op_name[memory[ip]], (unsigned)ip);\n"
+        "    return -1;\n"
+        "}\n\n");
+
+    emit_c_main(out, entry);
+    fprintf(out, "    for (;;) {\n");
+    fprintf(out, "        if (++instruction_count > MAX_INSTRUCTIONS) goto limit;\n");
+    fprintf(out, "        if (ip >= MEMORY_SIZE) { fprintf(stderr, \"CPU Fault: IP 0x%%04X out of bounds\\n\", (unsigned)ip); goto done; }\n");
+    fprintf(out, "        uint8_t opcode = memory[ip];\n");
+    fprintf(out, "        if (op_length[opcode] == 0) { fprintf(stderr, \"CPU Fault: Unknown opcode 0x%%02X at 0x%%04X\\n\", opcode, (unsigned)ip); goto done; }\n");
+    fprintf(out, "        if (ip + op_length[opcode] > MEMORY_SIZE) { fprintf(stderr, \"CPU Fault: %%s truncated at 0x%%04X\\n\", op_name[opcode], (unsigned)ip); goto done; }\n");
+    fprintf(out, "        switch (opcode) {\n");
+    for (int op = 0; op < 256; op++) {
+        if (!op_table[op].length) continue;
+        fprintf(out, "        case 0x%02X: /* %s */\n", op, op_table[op].name);
+        emit_c_insn(&e, (uint8_t)op);
+    }
+    fprintf(out, "        }\n    }\n");
+}
+
+ // --profile-out: CSV for *.csv, JSON for anything else
+ // Returns 0 on success, -1 on error
+static int write_profile(const shred_vm *vm, const char *path) {
+    const char *dot = strrchr(path, '.');
+    int format = (dot && strcmp(dot, ".csv") == 0) ? SHRED_PROFILE_CSV : SHRED_PROFILE_JSON;
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Error: Cannot open '%s' for writing\n", path);
+        perror("fopen");
+        return -1;
+    }
+    int rc = shred_vm_profile_write(vm, out, format);
+    if (fclose(out) != 0) rc = -1;
+    if (rc != 0) fprintf(stderr, "Error: Failed writing '%s'\n", path);
+    return rc;
+}
+
+ // Returns 0 on success, -1 on error
+static int emit_c(const shred_vm *vm, const char *path, const char *source) {
+    static code_analysis analysis;
+    FILE *out = (strcmp(path, "-") == 0) ? stdout : fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Error: Cannot open '%s' for writing\n", path);
+        perror("fopen");
+        return -1;
+    }
+
+    int immutable = aot_analyze(vm->memory, vm->entry, &analysis);
+    if (!immutable) {
+        fprintf(stderr, "Note: '%s' may modify its own code, embedding the interpreter\n", source);
+    }
+
+    emit_c_prologue(out, vm->memory, vm->max_instructions, source);
+    if (immutable) emit_c_static(out, vm->memory, vm->entry, analysis.reach, analysis.opener);
+    else emit_c_interpreter(out, vm->entry);
+
+    fprintf(out, "\nlimit:\n    fprintf(stderr, \"CPU Fault: Instruction limit exceeded (%%llu), possible infinite loop\\n\",\n"
+                 "            (unsigned long long)MAX_INSTRUCTIONS);\n");
+    fprintf(out, "done:\n    return 0;\n}\n");
+
+    if (out != stdout && fclose(out) != 0) {
+        perror("fclose");
+        return -1;
+    }
+    return 0;
+}
+
+ // starts the next "; a, b" note on an --analyze line
+static const char *analyze_note(int *notes) {
+    return (*notes)++ ? ", " : "  ; ";
+}
+
+ // --analyze: a listing of everything reachable, one basic block at a time
+ // with where each jump goes and what each store writes, then whether the
+ // program can ever store onto its own code
+static int analyze_program(const shred_vm *vm, const char *source) {
+    code_analysis *a = malloc(sizeof(code_analysis));
+    if (!a) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return -1;
+    }
+    const uint8_t *memory = vm->memory;
+    int fixed = aot_analyze(memory, vm->entry, a);
+    uint32_t insns = 0, blocks = 0, code_len = 0, past_image = 0;
+
+    printf("Analysis of '%s', entry %04X\n", source, (unsigned)vm->entry);
+    for (uint32_t ip = 0; ip < MEMORY_SIZE; ip++) {
+        if (a->code[ip]) {
+            code_len++;
+            if (ip >= vm->image_len) past_image++;
+        }
+        uint8_t r = a->reach[ip];
+        if (!(r & (AOT_INSN | AOT_FAULT))) continue;
+        insns++;
+        if (r & AOT_LEADER) {
+            blocks++;
+            printf("\nblock %04X%s\n", (unsigned)ip, (ip == vm->entry) ? " (entry)" : "");
+        }
+        printf("  %04X  ", (unsigned)ip);
+        if (!check_insn(memory, ip, NULL)) {
+            check_insn(memory, ip, stdout);
+            continue;
+        }
+        print_instruction(stdout, &memory[ip], MEMORY_SIZE - ip);
+
+        const uint8_t *p = &memory[ip + 1];
+        uint8_t opcode = memory[ip];
+        uint32_t next = ip + op_table[opcode].length;
+        int wide = (opcode == OP_JMP16 || opcode == OP_JZ16 || opcode == OP_RUN16);
+        uint32_t to = wide ? operand16(&memory[ip], 1) : p[0];
+        uint32_t bad;
+        int notes = 0;
+        switch (opcode) {
+            case OP_JMP:
+            case OP_JMP16:
+                printf("%s-> %04X", analyze_note(&notes), (unsigned)to);
+                break;
+            case OP_JZ:
+            case OP_JZ16:
+                printf("%s-> %04X or %04X", analyze_note(&notes), (unsigned)to, (unsigned)next);
+                break;
+            case OP_RUN:
+            case OP_RUN16:
+                printf("%scall %04X, back at %04X", analyze_note(&notes), (unsigned)to, (unsigned)(next & 0xFFFF));
+                break;
+            case OP_COMMENT:
+                printf("%s-> %04X", analyze_note(&notes), (unsigned)(ip + 2 + p[0]));
+                break;
+            case OP_RET:
+                printf("%sreturn", analyze_note(&notes));
+                break;
+            case OP_HALT:
+                printf("%shalt, or return if called", analyze_note(&notes));
+                break;
+            case OP_IF:
+            case OP_FOR: {
+                int32_t end = ctrl_match(memory, ip, &bad);
+                if (end >= 0) {
+                    printf("%sends at THEN %04X", analyze_note(&notes), (unsigned)end);
+                } else {
+                    printf("%sfaults: %s %04X", analyze_note(&notes),
+                           (bad == ip) ? "no THEN after" : "out of place at", (unsigned)bad);
+                }
+                break;
+            }
+            case OP_ELSE:
+            case OP_ELSEIF:
+                if (r & AOT_CLAUSE) {
+                    printf("%s-> %04X", analyze_note(&notes),
+                           (unsigned)ctrl_match(memory, a->opener[ip], &bad) + 1U);
+                }
+                break;
+            default:
+                break;
+        }
+
+        uint32_t span;
+        int32_t target = store_span(&memory[ip], &span);
+        if (opcode == OP_THEN && (r & AOT_CLAUSE) && memory[a->opener[ip]] == OP_FOR) {
+            target = memory[a->opener[ip] + 1];
+            printf("%s-> %04X while [%02X] counts down", analyze_note(&notes),
+                   (unsigned)a->opener[ip] + 2U, (unsigned)target);
+        }
+        if (target >= 0 && span > 0) {
+            uint32_t hit = 0;
+            for (uint32_t k = 0; k < span; k++) hit += a->code[target + k];
+            if (span == 1) {
+                printf("%swrites %04X", analyze_note(&notes), (unsigned)target);
+            } else {
+                printf("%swrites %04X-%04X", analyze_note(&notes), (unsigned)target, (unsigned)(target + span - 1));
+            }
+            if (hit) printf(" (%u code byte%s)", (unsigned)hit, (hit == 1) ? "" : "s");
+        }
+        if ((opcode == OP_ELSE || opcode == OP_ELSEIF || opcode == OP_THEN) && !(r & AOT_CLAUSE)) {
+            // reached without running its IF/FOR first
+            int32_t claimant = ctrl_claimant(memory, ip);
+            if (claimant < 0) printf("%sfaults: outside any IF/FOR", analyze_note(&notes));
+            else printf("%sbelongs to %s %04X", analyze_note(&notes), op_table[memory[claimant]].name, (unsigned)claimant);
+        }
+        printf("\n");
+    }
+
+    printf("\n%u reachable instructions in %u blocks, %u edges, %u calls, %u stores; %u bytes of code\n",
+           (unsigned)insns, (unsigned)blocks, (unsigned)a->edges, (unsigned)a->calls, (unsigned)a->stores,
+           (unsigned)code_len);
+    if (!fixed && a->smc_target >= 0) {
+        printf("Self-modifying: %s at %04X can write code at %04X\n",
+               op_table[memory[a->smc_at]].name, (unsigned)a->smc_at, (unsigned)a->smc_target);
+    } else if (!fixed) {
+        printf("Self-modifying: which IF/FOR the %s at %04X belongs to depends on the path taken\n",
+               op_table[memory[a->smc_at]].name, (unsigned)a->smc_at);
+    } else if (past_image) {
+        printf("Fixed code: no store can reach it, but %u bytes of it lie past the image\n", (unsigned)past_image);
+    } else {
+        printf("Fixed code: no store can reach it (a .shbin from --compile runs without store checks)\n");
+    }
+    free(a);
+    return 0;
+}
+
+ // mem/addr Dump
+static void dump_memory(const shred_vm *vm, uint32_t start, uint32_t end) {
+    if (start >= MEMORY_SIZE) start = 0;
+    if (end >= MEMORY_SIZE) end = MEMORY_SIZE - 1;
+    if (start > end) {
+        uint32_t tmp = start; start = end; end = tmp;
+    }
+
+    printf("\n--- Memory Dump (0x%04X-0x%04X) ---\n", (unsigned)start, (unsigned)end);
+    for (uint32_t i = start; i <= end; i++) {
+        if ((i - start) % 16 == 0) printf("\n%04X: ", (unsigned)i);
+        printf("%02X ", vm->memory[i]);
+    }
+    printf("\n");
+}
+
+ // Batch mode (--batch)
+ // Runs a directory of .shred files (or a manifest listing one path per line)
+ // on a pool of worker threads. Each worker owns one VM and resets it between
+ // jobs. Jobs are dealt round-robin into one queue per worker; a worker whose
+ // queue runs dry steals from the far end of the others. GETC reads EOF, and
+ // each job's output and faults are captured in memory and printed in job
+ // order once everything has finished, followed by a summary.
+#if HAVE_BATCH
+typedef struct {
+    const char   *path;
+    char         *out, *err;          // captured output and faults (open_memstream)
+    size_t        out_len, err_len;
+    shred_status  status;
+    int           load_failed;
+    uint64_t      instructions;
+    double        seconds;
+} batch_job;
+
+typedef struct {
+    pthread_mutex_t lock;
+    uint32_t       *jobs;             // indices into the job list
+    uint32_t        head, tail;       // owner takes from head, thieves from tail
+} batch_queue;
+
+typedef struct {
+    batch_job   *jobs;
+    batch_queue *queues;
+    uint32_t     workers;
+    int          engine;
+    int          fuse;                // superinstructions, see shred_vm_set_fusion()
+    int          debug_level;
+    uint64_t     max_insns;           // 0 = unlimited
+} batch_ctx;
+
+typedef struct {
+    batch_ctx *ctx;
+    uint32_t   id;
+    int        failed;                // couldn't create a VM
+    pthread_t  thread;
+} batch_worker;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+ // next job for worker id: its own queue first, then steal
+ // Returns 1 and sets *job, or 0 once every queue is empty
+static int batch_next(batch_ctx *ctx, uint32_t id, uint32_t *job) {
+    for (uint32_t n = 0; n < ctx->workers; n++) {
+        batch_queue *q = &ctx->queues[(id + n) % ctx->workers];
+        int found = 0;
+        pthread_mutex_lock(&q->lock);
+        if (q->head < q->tail) {
+            *job = (n == 0) ? q->jobs[q->head++] : q->jobs[--q->tail];
+            found = 1;
+        }
+        pthread_mutex_unlock(&q->lock);
+        if (found) return 1;
+    }
+    return 0;
+}
+
+static void batch_run_job(shred_vm *vm, batch_job *job) {
+    FILE *out = open_memstream(&job->out, &job->out_len);
+    FILE *err = open_memstream(&job->err, &job->err_len);
+    double start = now_seconds();
+
+    if (!out || !err) {
+        job->load_failed = 1;
+    } else {
+        shred_vm_reset(vm, SHRED_RESET_CLEAR_MEMORY);
+        shred_vm_set_io(vm, NULL, out, err);
+        if (shred_vm_load_file(vm, job->path) != 0) {
+            job->load_failed = 1;
+        } else {
+            job->status = shred_vm_run(vm, 0);
+        }
+        job->instructions = shred_vm_instruction_count(vm);
+    }
+    job->seconds = now_seconds() - start;
+
+    if (out) fclose(out);
+    if (err) fclose(err);
+}
+
+static void *batch_worker_main(void *arg) {
+    batch_worker *w = arg;
+    batch_ctx *ctx = w->ctx;
+    shred_vm *vm = shred_vm_create();
+    if (!vm) {
+        w->failed = 1;
+        return NULL;
+    }
+    shred_vm_set_engine(vm, ctx->engine);
+    shred_vm_set_fusion(vm, ctx->fuse);
+    shred_vm_set_debug(vm, ctx->debug_level);
+    shred_vm_set_limit(vm, ctx->max_insns);
+    shred_vm_set_output(vm, SHRED_OUTPUT_BLOCK, 0);   // memstream output, nobody is watching
+
+    uint32_t job;
+    while (batch_next(ctx, w->id, &job)) {
+        batch_run_job(vm, &ctx->jobs[job]);
+    }
+    shred_vm_destroy(vm);
+    return NULL;
+}
+
+ // growable list of job paths
+typedef struct {
+    char     **paths;
+    uint32_t   count, cap;
+} path_list;
+
+static int path_list_add(path_list *list, const char *path) {
+    if (list->count == list->cap) {
+        uint32_t cap = list->cap ? list->cap * 2 : 64;
+        char **bigger = realloc(list->paths, cap * sizeof(char *));
+        if (!bigger) return -1;
+        list->paths = bigger;
+        list->cap = cap;
+    }
+    char *copy = malloc(strlen(path) + 1);
+    if (!copy) return -1;
+    strcpy(copy, path);
+    list->paths[list->count++] = copy;
+    return 0;
+}
+
+static int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+ // every *.shred and *.shbin in a directory (sorted), or every line of a manifest file
+ // Returns 0 on success, -1 on error
+static int batch_collect(const char *source, path_list *list) {
+    DIR *dir = opendir(source);
+    if (dir) {
+        struct dirent *entry;
+        char path[MAX_FILENAME_LEN];
+        while ((entry = readdir(dir)) != NULL) {
+            const char *ext = strrchr(entry->d_name, '.');
+            if (!ext || (strcmp(ext, ".shred") != 0 && strcmp(ext, ".shbin") != 0)) continue;
+            if (snprintf(path, sizeof(path), "%s/%s", source, entry->d_name) >= (int)sizeof(path)) {
+                fprintf(stderr, "Warning: Skipping '%s/%s', path too long\n", source, entry->d_name);
+                continue;
+            }
+            if (path_list_add(list, path) != 0) {
+                closedir(dir);
+                return -1;
+            }
+        }
+        closedir(dir);
+        qsort(list->paths, list->count, sizeof(char *), compare_paths);
+        return 0;
+    }
+
+    FILE *manifest = fopen(source, "r");
+    if (!manifest) {
+        fprintf(stderr, "Error: Cannot open batch directory or manifest '%s'\n", source);
+        return -1;
+    }
+    char line[MAX_FILENAME_LEN + 2];
+    while (fgets(line, sizeof(line), manifest)) {
+        size_t len = strlen(line);
+        while (len > 0 && isspace((unsigned char)line[len - 1])) line[--len] = '\0';
+        if (len == 0 || line[0] == '#' || line[0] == ';') continue;
+        if (path_list_add(list, line) != 0) {
+            fclose(manifest);
+            return -1;
+        }
+    }
+    fclose(manifest);
+    return 0;
+}
+
+static const char *batch_status_name(const batch_job *job) {
+    if (job->load_failed) return "load error";
+    switch (job->status) {
+        case SHRED_HALTED: return "halted";
+        case SHRED_PAUSED: return "paused";
+        default:           return "fault";
+    }
+}
+
+ // every job's output in job order, then the summary table
+ // Returns the number of jobs that couldn't be loaded
+static uint32_t batch_report(const char *title, const batch_job *jobs, uint32_t count, uint32_t threads, double wall) {
+    uint32_t halted = 0, faulted = 0, failed = 0;
+    uint64_t total = 0;
+    for (uint32_t j = 0; j < count; j++) {
+        const batch_job *job = &jobs[j];
+        printf("==> %s <==\n", job->path);
+        if (job->out_len) fwrite(job->out, 1, job->out_len, stdout);
+        if (job->out_len && job->out[job->out_len - 1] != '\n') putchar('\n');
+        fflush(stdout);
+        if (job->err_len) {
+            fprintf(stderr, "==> %s <==\n", job->path);
+            fwrite(job->err, 1, job->err_len, stderr);
+        }
+        if (job->load_failed) failed++;
+        else if (job->status == SHRED_HALTED) halted++;
+        else faulted++;
+        total += job->instructions;
+    }
+
+    printf("\n--- %s summary: %u jobs on %u threads, %.3f s wall ---\n",
+           title, (unsigned)count, (unsigned)threads, wall);
+    printf("%-10s %12s %10s  %s\n", "STATUS", "INSTRUCTIONS", "TIME(ms)", "FILE");
+    for (uint32_t j = 0; j < count; j++) {
+        const batch_job *job = &jobs[j];
+        printf("%-10s %12llu %10.3f  %s\n", batch_status_name(job), (unsigned long long)job->instructions,
+               job->seconds * 1000.0, job->path);
+    }
+    printf("--- %u halted, %u faulted, %u not loaded; %llu instructions (%.1f M/s) ---\n",
+           (unsigned)halted, (unsigned)faulted, (unsigned)failed, (unsigned long long)total,
+           (wall > 0) ? (double)total / wall / 1e6 : 0.0);
+    return failed;
+}
+
+ // Returns EXIT_SUCCESS, or EXIT_FAILURE if anything couldn't be loaded or run
+static int run_batch(const char *source, uint32_t workers, int engine, int fuse, int debug_level,
+                     uint64_t max_insns) {
+    path_list list = { NULL, 0, 0 };
+    if (batch_collect(source, &list) != 0) {
+        fprintf(stderr, "Error: Out of memory collecting batch jobs\n");
+        return EXIT_FAILURE;
+    }
+    if (list.count == 0) {
+        fprintf(stderr, "Error: No .shred jobs found in '%s'\n", source);
+        free(list.paths);
+        return EXIT_FAILURE;
+    }
+    if (workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = (cpus > 0) ? (uint32_t)cpus : 1;
+    }
+    if (workers > list.count) workers = list.count;
+
+    batch_ctx ctx;
+    ctx.jobs = calloc(list.count, sizeof(batch_job));
+    ctx.queues = calloc(workers, sizeof(batch_queue));
+    ctx.workers = workers;
+    ctx.engine = engine;
+    ctx.fuse = fuse;
+    ctx.debug_level = debug_level;
+    ctx.max_insns = max_insns;
+    batch_worker *pool = calloc(workers, sizeof(batch_worker));
+    uint32_t *slots = malloc(list.count * sizeof(uint32_t));
+    int rc = EXIT_SUCCESS;
+    if (!ctx.jobs || !ctx.queues || !pool || !slots) {
+        fprintf(stderr, "Error: Out of memory\n");
+        rc = EXIT_FAILURE;
+        goto cleanup;
+    }
+
+    // deal the jobs out round-robin, each queue gets a contiguous slice of slots
+    uint32_t used = 0;
+    for (uint32_t w = 0; w < workers; w++) {
+        batch_queue *q = &ctx.queues[w];
+        pthread_mutex_init(&q->lock, NULL);
+        q->jobs = &slots[used];
+        q->head = q->tail = 0;
+        for (uint32_t j = w; j < list.count; j += workers) q->jobs[q->tail++] = j;
+        used += q->tail;
+    }
+    for (uint32_t j = 0; j < list.count; j++) ctx.jobs[j].path = list.paths[j];
+
+    double start = now_seconds();
+    uint32_t started = 0;
+    for (uint32_t w = 0; w < workers; w++) {
+        pool[w].ctx = &ctx;
+        pool[w].id = w;
+        if (pthread_create(&pool[w].thread, NULL, batch_worker_main, &pool[w]) != 0) break;
+        started++;
+    }
+    if (started == 0) {
+        // no threads at all, do it on this one
+        pool[0].ctx = &ctx;
+        batch_worker_main(&pool[0]);
+    }
+    for (uint32_t w = 0; w < started; w++) pthread_join(pool[w].thread, NULL);
+    double wall = now_seconds() - start;
+
+    for (uint32_t w = 0; w < workers; w++) {
+        if (pool[w].failed) {
+            fprintf(stderr, "Error: Out of memory creating a VM for worker %u\n", (unsigned)w);
+            rc = EXIT_FAILURE;
+        }
+        pthread_mutex_destroy(&ctx.queues[w].lock);
+    }
+
+    uint32_t failed = batch_report("Batch", ctx.jobs, list.count, workers, wall);
+    if (failed) rc = EXIT_FAILURE;
+
+cleanup:
+    if (ctx.jobs) {
+        for (uint32_t j = 0; j < list.count; j++) {
+            free(ctx.jobs[j].out);
+            free(ctx.jobs[j].err);
+        }
+    }
+    for (uint32_t j = 0; j < list.count; j++) free(list.paths[j]);
+    free(list.paths);
+    free(slots);
+    free(pool);
+    free(ctx.queues);
+    free(ctx.jobs);
+    return rc;
+}
+
+ // Fork mode (--fork-at N --fork-input FILE ...)
+ // Runs the program to instruction N, then clones the VM once per input file
+ // and runs every clone to the end on its own thread, with GETC reading that
+ // file. Clones share the parent's memory copy-on-write (see shred_vm_clone).
+
+typedef struct {
+    shred_vm  *vm;
+    batch_job *job;
+    FILE      *in, *out, *err;
+    pthread_t  thread;
+} fork_child;
+
+static void *fork_child_main(void *arg) {
+    fork_child *c = arg;
+    double start = now_seconds();
+    c->job->status = shred_vm_run(c->vm, 0);
+    c->job->instructions = shred_vm_instruction_count(c->vm);
+    c->job->seconds = now_seconds() - start;
+    return NULL;
+}
+
+static int run_forks(shred_vm *vm, const char *const *inputs, uint32_t count) {
+    batch_job *jobs = calloc(count, sizeof(batch_job));
+    fork_child *children = calloc(count, sizeof(fork_child));
+    int rc = EXIT_SUCCESS;
+    if (!jobs || !children) {
+        fprintf(stderr, "Error: Out of memory\n");
+        free(jobs);
+        free(children);
+        return EXIT_FAILURE;
+    }
+
+    double start = now_seconds();
+    for (uint32_t i = 0; i < count; i++) {
+        children[i].vm = shred_vm_clone(vm);
+        if (!children[i].vm) {
+            fprintf(stderr, "Error: Out of memory cloning the VM\n");
+            rc = EXIT_FAILURE;
+            break;
+        }
+    }
+    double clone_time = now_seconds() - start;
+
+    uint32_t started = 0;
+    start = now_seconds();
+    for (uint32_t i = 0; i < count && rc == EXIT_SUCCESS; i++) {
+        fork_child *c = &children[i];
+        c->job = &jobs[i];
+        c->job->path = inputs[i];
+        c->in = fopen(inputs[i], "rb");
+        c->out = open_memstream(&c->job->out, &c->job->out_len);
+        c->err = open_memstream(&c->job->err, &c->job->err_len);
+        if (!c->in || !c->out || !c->err) {
+            if (!c->in && c->err) fprintf(c->err, "Error: Cannot open input '%s': %s\n", inputs[i], strerror(errno));
+            c->job->load_failed = 1;
+            continue;
+        }
+        shred_vm_set_io(c->vm, c->in, c->out, c->err);
+        shred_vm_set_output(c->vm, SHRED_OUTPUT_BLOCK, 0);
+        if (pthread_create(&c->thread, NULL, fork_child_main, c) == 0) {
+            started++;
+        } else {
+            fork_child_main(c);   // out of threads, run it here
+            c->thread = pthread_self();
+        }
+    }
+    for (uint32_t i = 0; i < count && rc == EXIT_SUCCESS; i++) {
+        if (children[i].job->load_failed || pthread_equal(children[i].thread, pthread_self())) continue;
+        pthread_join(children[i].thread, NULL);
+    }
+    double wall = now_seconds() - start;
+
+    if (rc == EXIT_SUCCESS) {
+        for (uint32_t i = 0; i < count; i++) {
+            if (children[i].out) fclose(children[i].out);
+            if (children[i].err) fclose(children[i].err);
+        }
+        if (batch_report("Fork", jobs, count, started, wall)) rc = EXIT_FAILURE;
+        printf("--- %u clones at instruction %llu in %.1f us (%.2f us each) ---\n",
+               (unsigned)count, (unsigned long long)shred_vm_instruction_count(vm),
+               clone_time * 1e6, clone_time * 1e6 / count);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (children[i].in) fclose(children[i].in);
+        shred_vm_destroy(children[i].vm);
+        free(jobs[i].out);
+        free(jobs[i].err);
+    }
+    free(children);
+    free(jobs);
+    return rc;
+}
+
+ // Benchmark mode (--bench SRC)
+ // Runs each kernel in SRC (same rules as --batch) BENCH_RUNS_DEFAULT times
+ // on this thread, one after the other so they don't compete, and keeps the
+ // fastest load and the fastest run. Program output goes to /dev/null and
+ // GETC reads EOF. A baseline file is one "name instructions ns/insn load-us"
+ // line per kernel, from --save-baseline; --baseline compares against it.
+
+typedef struct {
+    char     name[64];
+    uint64_t instructions;
+    double   ns_per_insn;
+    double   load_us;
+} bench_result;
+
+static const char *bench_name(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+ // best of runs; status is the last run's, -1 if the kernel didn't load
+static int bench_kernel(shred_vm *vm, const char *path, uint32_t runs, bench_result *r, double *seconds) {
+    int status = -1;
+    double best_load = 0, best_run = 0;
+    snprintf(r->name, sizeof(r->name), "%s", bench_name(path));
+
+    for (uint32_t i = 0; i < runs; i++) {
+        shred_vm_reset(vm, SHRED_RESET_CLEAR_MEMORY);
+        double start = now_seconds();
+        if (shred_vm_load_file(vm, path) != 0) return -1;
+        double loaded = now_seconds();
+        status = shred_vm_run(vm, 0);
+        double done = now_seconds();
+
+        if (i == 0 || loaded - start < best_load) best_load = loaded - start;
+        if (i == 0 || done - loaded < best_run) best_run = done - loaded;
+        if (status != SHRED_HALTED) break;   // it isn't timed, once is enough to see why
+    }
+
+    r->instructions = shred_vm_instruction_count(vm);
+    r->ns_per_insn = r->instructions ? best_run * 1e9 / (double)r->instructions : 0.0;
+    r->load_us = best_load * 1e6;
+    *seconds = best_run;
+    return status;
+}
+
+ // Returns the number of entries read, or -1 if the file can't be read
+static int bench_read_baseline(const char *path, bench_result **out) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot open baseline '%s'\n", path);
+        fprintf(stderr, "fopen: %s\n", strerror(errno));
+        return -1;
+    }
+    bench_result *list = NULL, entry;
+    int count = 0, cap = 0;
+    char line[256];
+    unsigned long long insns;
+    while (fgets(line, sizeof(line), file)) {
+        if (line[0] == '#' || line[0] == ';') continue;
+        if (sscanf(line, "%63s %llu %lf %lf", entry.name, &insns, &entry.ns_per_insn, &entry.load_us) != 4) continue;
+        entry.instructions = insns;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 16;
+            bench_result *bigger = realloc(list, (size_t)cap * sizeof(bench_result));
+            if (!bigger) {
+                fprintf(stderr, "Error: Out of memory reading baseline '%s'\n", path);
+                free(list);
+                fclose(file);
+                return -1;
+            }
+            list = bigger;
+        }
+        list[count++] = entry;
+    }
+    fclose(file);
+    *out = list;
+    return count;
+}
+
+static int bench_write_baseline(const char *path, const bench_result *results, const int *ok, uint32_t count) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot open '%s' for writing\n", path);
+        fprintf(stderr, "fopen: %s\n", strerror(errno));
+        return -1;
+    }
+    fprintf(file, "# shredder --bench baseline: name instructions ns/insn load-us\n");
+    for (uint32_t k = 0; k < count; k++) {
+        if (!ok[k]) continue;
+        fprintf(file, "%s %llu %.4f %.2f\n", results[k].name, (unsigned long long)results[k].instructions,
+                results[k].ns_per_insn, results[k].load_us);
+    }
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Error: Failed writing '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int run_bench(const char *source, uint32_t runs, int engine, int fuse, uint64_t max_insns,
+                     const char *baseline_path, const char *save_path) {
+    path_list list = { NULL, 0, 0 };
+    if (batch_collect(source, &list) != 0) {
+        fprintf(stderr, "Error: Out of memory collecting benchmark kernels\n");
+        return EXIT_FAILURE;
+    }
+    if (list.count == 0) {
+        fprintf(stderr, "Error: No .shred kernels found in '%s'\n", source);
+        free(list.paths);
+        return EXIT_FAILURE;
+    }
+
+    bench_result *baseline = NULL;
+    int base_count = 0;
+    if (baseline_path && (base_count = bench_read_baseline(baseline_path, &baseline)) < 0) {
+        for (uint32_t j = 0; j < list.count; j++) free(list.paths[j]);
+        free(list.paths);
+        return EXIT_FAILURE;
+    }
+
+    FILE *sink = fopen("/dev/null", "w");
+    if (!sink) sink = tmpfile();
+    shred_vm *vm = shred_vm_create();
+    bench_result *results = calloc(list.count, sizeof(bench_result));
+    int *ok = calloc(list.count, sizeof(int));
+    int rc = EXIT_SUCCESS;
+    if (!sink || !vm || !results || !ok) {
+        fprintf(stderr, "Error: Out of memory\n");
+        rc = EXIT_FAILURE;
+        goto cleanup;
+    }
+    shred_vm_set_engine(vm, engine);
+    shred_vm_set_fusion(vm, fuse);
+    shred_vm_set_limit(vm, max_insns);
+    shred_vm_set_io(vm, NULL, sink, stderr);
+
+    uint32_t regressions = 0, failed = 0;
+    printf("%-16s %12s %10s %10s %8s %9s", "KERNEL", "INSTRUCTIONS", "TIME(ms)", "M insn/s", "ns/insn", "LOAD(us)");
+    if (baseline) printf(" %9s %8s", "BASE(ns)", "CHANGE");
+    printf("\n");
+    for (uint32_t k = 0; k < list.count; k++) {
+        bench_result *r = &results[k];
+        double seconds;
+        int status = bench_kernel(vm, list.paths[k], runs, r, &seconds);
+        if (status != SHRED_HALTED) {
+            printf("%-16s %s\n", r->name, (status < 0) ? "load error" : "fault, not timed");
+            failed++;
+            continue;
+        }
+        ok[k] = 1;
+        printf("%-16s %12llu %10.3f %10.1f %8.3f %9.1f", r->name, (unsigned long long)r->instructions,
+               seconds * 1000.0, (seconds > 0) ? (double)r->instructions / seconds / 1e6 : 0.0,
+               r->ns_per_insn, r->load_us);
+
+        for (int b = 0; b < base_count; b++) {
+            if (strcmp(baseline[b].name, r->name) != 0) continue;
+            double change = (baseline[b].ns_per_insn > 0)
+                          ? (r->ns_per_insn / baseline[b].ns_per_insn - 1.0) * 100.0 : 0.0;
+            printf(" %9.3f %+7.1f%%", baseline[b].ns_per_insn, change);
+            if (baseline[b].instructions != r->instructions) printf("  (instruction count changed)");
+            if (change > BENCH_TOLERANCE) {
+                printf("  SLOWER");
+                regressions++;
+            }
+            break;
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    printf("--- %u kernels, best of %u runs, %u failed", (unsigned)list.count, (unsigned)runs, (unsigned)failed);
+    if (baseline) printf(", %u more than %.0f%% slower than '%s'", (unsigned)regressions, BENCH_TOLERANCE, baseline_path);
+    printf(" ---\n");
+    if (failed || regressions) rc = EXIT_FAILURE;
+    if (save_path && bench_write_baseline(save_path, results, ok, list.count) != 0) rc = EXIT_FAILURE;
+
+cleanup:
+    shred_vm_destroy(vm);
+    if (sink) fclose(sink);
+    for (uint32_t j = 0; j < list.count; j++) free(list.paths[j]);
+    free(list.paths);
+    free(baseline);
+    free(results);
+    free(ok);
+    return rc;
+}
+#endif
+
+ // Stream mode (--stream)
+ // For programs run as filters over big inputs. GETC reads stdin through
+ // shred_vm_lend_input(): a regular file is mapped whole, anything else is
+ // read ahead by a reader thread into a ring of STREAM_CHUNK buffers that the
+ // VM reads in place, so GETC is a pointer bump and the VM only stops once
+ // per chunk. Output leaves in STREAM_CHUNK blocks through a second ring and
+ // a writer thread, so reading, running and writing all overlap.
+#if HAVE_BATCH
+#define STREAM_CHUNK   65536U
+#define STREAM_SLOTS   16U      // per ring, a power of two
+
+ // Single producer, single consumer, no locks: only the producer moves head
+ // and only the consumer moves tail. A slot of length 0 ends the stream.
+typedef struct {
+    uint8_t  *data;                   // STREAM_SLOTS * STREAM_CHUNK bytes
+    uint32_t  len[STREAM_SLOTS];
+    uint32_t  head, tail;             // slots filled / emptied so far
+    int       stop;                   // the consumer is done, the producer should quit
+} stream_ring;
+
+typedef struct {
+    stream_ring in, out;
+    int         write_error;          // errno of the first failed write, output is dropped after it
+} stream_ctx;
+
+ // the other side hasn't caught up: yield for a while, then sleep
+static void stream_pause(uint32_t *spins) {
+    if (++*spins < 64) {
+        sched_yield();
+    } else {
+        struct timespec ts = { 0, 50000 };
+        nanosleep(&ts, NULL);
+    }
+}
+
+static uint8_t *ring_slot(stream_ring *r, uint32_t n) {
+    return r->data + (size_t)(n & (STREAM_SLOTS - 1)) * STREAM_CHUNK;
+}
+
+ // producer: the next slot to fill, once there is one. NULL if told to stop
+static uint8_t *ring_claim(stream_ring *r) {
+    uint32_t spins = 0;
+    while (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == STREAM_SLOTS) {
+        if (__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) return NULL;
+        stream_pause(&spins);
+    }
+    return ring_slot(r, r->head);
+}
+
+static void ring_publish(stream_ring *r, uint32_t len) {
+    r->len[r->head & (STREAM_SLOTS - 1)] = len;
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+ // consumer: the oldest filled slot and its length, once there is one
+static uint8_t *ring_peek(stream_ring *r, uint32_t *len) {
+    uint32_t spins = 0;
+    while (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail) stream_pause(&spins);
+    *len = r->len[r->tail & (STREAM_SLOTS - 1)];
+    return ring_slot(r, r->tail);
+}
+
+static void ring_release(stream_ring *r) {
+    __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+static void *stream_reader_main(void *arg) {
+    stream_ring *r = arg;
+    for (;;) {
+        uint8_t *slot = ring_claim(r);
+        if (!slot) return NULL;
+        // don't sit in read() forever on a terminal after the program is done
+        struct pollfd p = { STDIN_FILENO, POLLIN, 0 };
+        if (poll(&p, 1, 100) == 0) {
+            if (__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) return NULL;
+            continue;
+        }
+        ssize_t n;
+        do {
+            n = read(STDIN_FILENO, slot, STREAM_CHUNK);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) {   // end of input, or an error that GETC can only see as one
+            ring_publish(r, 0);
+            return NULL;
+        }
+        ring_publish(r, (uint32_t)n);
+    }
+}
+
+static void *stream_writer_main(void *arg) {
+    stream_ctx *ctx = arg;
+    for (;;) {
+        uint32_t len;
+        const uint8_t *slot = ring_peek(&ctx->out, &len);
+        if (len == 0) return NULL;
+        for (uint32_t done = 0; done < len && !ctx->write_error; ) {
+            ssize_t n = write(STDOUT_FILENO, slot + done, len - done);
+            if (n > 0) done += (uint32_t)n;
+            else if (n < 0 && errno != EINTR) ctx->write_error = errno;
+        }
+        ring_release(&ctx->out);
+    }
+}
+
+ // the VM's output stream: whole blocks straight into the output ring
+static ssize_t stream_write(void *cookie, const char *buf, size_t size) {
+    stream_ring *r = cookie;
+    for (size_t done = 0; done < size; ) {
+        uint32_t n = (size - done < STREAM_CHUNK) ? (uint32_t)(size - done) : STREAM_CHUNK;
+        memcpy(ring_claim(r), buf + done, n);
+        ring_publish(r, n);
+        done += n;
+    }
+    return (ssize_t)size;
+}
+
+ // Runs vm to the end on stdin/stdout. Returns 0, or -1 if the streams
+ // couldn't be set up or the output couldn't all be written
+static int run_stream(shred_vm *vm) {
+    stream_ctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.in.data = malloc((size_t)STREAM_SLOTS * STREAM_CHUNK);
+    ctx.out.data = malloc((size_t)STREAM_SLOTS * STREAM_CHUNK);
+    cookie_io_functions_t io = { NULL, stream_write, NULL, NULL };
+    FILE *out = fopencookie(&ctx.out, "w", io);
+    pthread_t reader, writer;
+    int reading = 0;
+
+    if (!ctx.in.data || !ctx.out.data || !out || setvbuf(out, NULL, _IONBF, 0) != 0 ||
+        shred_vm_set_output(vm, SHRED_OUTPUT_BLOCK, STREAM_CHUNK) != 0 ||
+        pthread_create(&writer, NULL, stream_writer_main, &ctx) != 0) {
+        fprintf(stderr, "Error: Cannot set up the streams: %s\n", strerror(errno));
+        if (out) fclose(out);
+        free(ctx.in.data);
+        free(ctx.out.data);
+        return -1;
+    }
+    shred_vm_set_io(vm, NULL, out, stderr);
+
+    void *map = NULL;
+#if HAVE_MMAP
+    size_t map_len = 0;
+    struct stat st;
+    if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+        (uint64_t)st.st_size <= SIZE_MAX) {
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, STDIN_FILENO, 0);
+        if (map == MAP_FAILED) {
+            map = NULL;
+        } else {
+            map_len = (size_t)st.st_size;
+            madvise(map, map_len, MADV_SEQUENTIAL);
+            shred_vm_lend_input(vm, map, map_len);
+            shred_vm_close_input(vm);
+        }
+    }
+#endif
+    if (!map) {
+        shred_vm_lend_input(vm, ctx.in.data, 0);   // GETC waits for the first chunk
+        if (pthread_create(&reader, NULL, stream_reader_main, &ctx.in) == 0) {
+            reading = 1;
+        } else {
+            shred_vm_close_input(vm);   // no reader, GETC reads 0
+        }
+    }
+
+    // the VM waits once it has read a whole chunk (never once input is closed)
+    int lent = 0;
+    while (shred_vm_run(vm, 0) == SHRED_WAITING) {
+        if (lent) ring_release(&ctx.in);
+        uint32_t len;
+        const uint8_t *chunk = ring_peek(&ctx.in, &len);
+        lent = (len != 0);
+        if (lent) shred_vm_lend_input(vm, chunk, len);
+        else shred_vm_close_input(vm);
+    }
+
+    if (reading) {
+        __atomic_store_n(&ctx.in.stop, 1, __ATOMIC_RELEASE);   // in case the program ended first
+        pthread_join(reader, NULL);
+    }
+#if HAVE_MMAP
+    if (map) munmap(map, map_len);
+#endif
+    fflush(out);
+    ring_claim(&ctx.out);
+    ring_publish(&ctx.out, 0);
+    pthread_join(writer, NULL);
+    shred_vm_set_io(vm, NULL, stdout, stderr);
+    fclose(out);
+    free(ctx.in.data);
+    free(ctx.out.data);
+    if (ctx.write_error) {
+        fprintf(stderr, "Error: Cannot write output: %s\n", strerror(ctx.write_error));
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+ // Fuzz mode (--fuzz N)
+ // Generates N programs (or mutations of the one given) and checks each with
+ // diff_run(). A program the engines disagree on is minimized and written to
+ // fuzz-SEED.shred, with what differed in a comment at the top. Program k
+ // uses seed --fuzz-seed + k, so --fuzz 1 --fuzz-seed SEED replays it.
+#if HAVE_BATCH
+ // A random program: mostly valid instructions on a data area at
+ // FUZZ_CODE_END..0xFF, counted loops, calls, structured blocks, stores and
+ // block copies into the code itself, and the odd stray byte
+static uint32_t fuzz_generate(uint8_t *image, uint64_t *rng) {
+    static const uint8_t ops3[] = { OP_NAND, OP_AND, OP_OR, OP_XOR, OP_CMP, OP_ADD, OP_SUB,
+                                    OP_MUL, OP_DIV, OP_SHL, OP_SHR };
+    uint32_t labels[64], label_count = 0, n = 0, open = 0;
+    uint32_t count = 5 + fuzz_below(rng, 56);
+    memset(image, 0, FUZZ_IMAGE_LEN);
+
+#define EMIT(b)  do { uint8_t b_ = (uint8_t)(b); if (n < FUZZ_CODE_END - 1) image[n++] = b_; } while (0)
+#define DATA()   (FUZZ_CODE_END + fuzz_below(rng, FUZZ_IMAGE_LEN - FUZZ_CODE_END))
+#define CODE(k)  fuzz_below(rng, (n + (k) < FUZZ_CODE_END) ? n + (k) + 1 : FUZZ_CODE_END)
+    for (uint32_t i = 0; i < count && n < FUZZ_CODE_END - 16; i++) {
+        if (label_count < 64) labels[label_count++] = n;
+        uint32_t r = fuzz_below(rng, 100), c = DATA(), d = DATA();
+        if (r < 10) {   // structured control flow, mostly well formed
+            uint32_t k = fuzz_below(rng, 10);
+            if (k < 4) { EMIT(k < 2 ? OP_IF : OP_FOR); EMIT(c); open++; }
+            else if (k < 6 && open) { EMIT(OP_THEN); open--; }
+            else if (k < 7) { EMIT(OP_ELSEIF); EMIT(c); }
+            else if (k < 8) EMIT(OP_ELSE);
+            else if (k < 9) EMIT(OP_THEN);
+            else { EMIT(OP_ERROR); EMIT(fuzz_below(rng, 256)); }
+        } else if (r < 35) {
+            EMIT(ops3[fuzz_below(rng, sizeof(ops3))]); EMIT(c); EMIT(d); EMIT(DATA());
+        } else if (r < 43) {
+            EMIT(OP_POKE); EMIT(c); EMIT(fuzz_below(rng, 256));
+        } else if (r < 47) {
+            EMIT(OP_MOVE); EMIT(c); EMIT(d);
+        } else if (r < 52) {
+            static const uint8_t ops1[] = { OP_NOT, OP_INC, OP_DEC };
+            EMIT(ops1[fuzz_below(rng, 3)]); EMIT(c);
+        } else if (r < 55) {
+            static const uint8_t pages[] = { 0x00, 0x80, 0xFF };
+            EMIT(OP_POKE16); EMIT(pages[fuzz_below(rng, 3)]); EMIT(c); EMIT(fuzz_below(rng, 256));
+        } else if (r < 58) {
+            EMIT(OP_MOVE16); EMIT(0); EMIT(c); EMIT(0); EMIT(d);
+        } else if (r < 62) {
+            EMIT(fuzz_below(rng, 2) ? OP_PUTN : OP_PUTC); EMIT(c);
+        } else if (r < 64) {
+            EMIT(OP_GETC); EMIT(c);
+        } else if (r < 69) {   // self-modifying: a store into code
+            EMIT(OP_POKE); EMIT(CODE(10)); EMIT(fuzz_below(rng, OP_BCMP + 1));
+        } else if (r < 77) {   // a counted loop back to an earlier label
+            uint32_t t = labels[fuzz_below(rng, label_count)];
+            switch (fuzz_below(rng, 4)) {
+                case 0:   // DEC/JZ, JMP
+                    EMIT(OP_DEC); EMIT(c); EMIT(OP_JZ); EMIT(n + 4); EMIT(c); EMIT(OP_JMP); EMIT(t);
+                    break;
+                case 1:   // DEC/JZ16, JMP16
+                    EMIT(OP_DEC); EMIT(c); EMIT(OP_JZ16); EMIT(0); EMIT(n + 5); EMIT(c);
+                    EMIT(OP_JMP16); EMIT(0); EMIT(t);
+                    break;
+                case 2:   // INC, CMP/JZ, INC/JMP
+                    EMIT(OP_INC); EMIT(d); EMIT(OP_CMP); EMIT(d); EMIT(c); EMIT(d);
+                    EMIT(OP_JZ); EMIT(n + 6); EMIT(d); EMIT(OP_INC); EMIT(c); EMIT(OP_JMP); EMIT(t);
+                    break;
+                default:  // FOR
+                    EMIT(OP_FOR); EMIT(c); EMIT(OP_INC); EMIT(d); EMIT(OP_THEN);
+                    break;
+            }
+        } else if (r < 80) {
+            uint32_t len = fuzz_below(rng, 4);
+            EMIT(OP_COMMENT); EMIT(len);
+            for (uint32_t k = 0; k < len; k++) EMIT(fuzz_below(rng, 256));
+        } else if (r < 83) {
+            EMIT(OP_RUN); EMIT(CODE(20));
+        } else if (r < 84) {
+            EMIT(OP_RUN16); EMIT(0); EMIT(CODE(20));
+        } else if (r < 86) {
+            EMIT(OP_RET);
+        } else if (r < 89) {
+            EMIT(OP_HALT);
+        } else if (r < 91) {
+            EMIT(OP_JZ16); EMIT(0); EMIT(CODE(5)); EMIT(c);
+        } else if (r < 94) {   // data stack and words, sometimes over code
+            uint32_t w = fuzz_below(rng, 2) ? c : fuzz_below(rng, FUZZ_CODE_END - 8);
+            switch (fuzz_below(rng, 6)) {
+                case 0: EMIT(OP_PUSH); EMIT(c); break;
+                case 1: EMIT(OP_POP); EMIT(fuzz_below(rng, 2) ? c : CODE(8)); break;
+                case 2: EMIT(OP_PUSH16_MEM); EMIT(0); EMIT(w); break;
+                case 3: EMIT(OP_POP16_MEM); EMIT(0); EMIT(w); break;
+                case 4: {
+                    uint32_t op = OP_BAND16 + fuzz_below(rng, 5);
+                    EMIT(op); EMIT(0); EMIT(w);
+                    if (op != OP_BNOT16) { EMIT(0); EMIT(d); EMIT(0); EMIT(DATA()); }
+                    break;
+                }
+                default: EMIT(fuzz_below(rng, 2) ? OP_LT16_CMP : OP_GT16_CMP);
+                         EMIT(0); EMIT(w); EMIT(0); EMIT(d); EMIT(DATA());
+                         break;
+            }
+        } else if (r < 98) {   // block ops, sometimes over code
+            uint32_t len = fuzz_below(rng, 9);
+            uint32_t src = fuzz_below(rng, 2) ? c : CODE(0);
+            uint32_t dest = fuzz_below(rng, 2) ? (d < 0xF8 ? d : 0xF8) : CODE(0);
+            switch (fuzz_below(rng, 3)) {
+                case 0:  EMIT(OP_BCOPY); EMIT(0); EMIT(src); EMIT(0); EMIT(dest); EMIT(0); EMIT(len); break;
+                case 1:  EMIT(OP_BFILL); EMIT(0); EMIT(dest); EMIT(0); EMIT(len); EMIT(fuzz_below(rng, OP_BCMP + 1)); break;
+                default: EMIT(OP_BCMP); EMIT(0); EMIT(src); EMIT(0); EMIT(c); EMIT(0); EMIT(len); EMIT(d); break;
+            }
+        } else {
+            EMIT(fuzz_below(rng, 256));   // anything, unknown opcodes included
+        }
+    }
+    while (open--) EMIT(OP_THEN);
+    image[n] = OP_HALT;
+#undef EMIT
+#undef DATA
+#undef CODE
+
+    for (uint32_t i = FUZZ_CODE_END; i < FUZZ_IMAGE_LEN; i++) image[i] = (uint8_t)fuzz_below(rng, 256);
+    return FUZZ_IMAGE_LEN;
+}
+
+ // a few random edits: new bytes, opcodes, inserts, deletes and copies
+static void fuzz_mutate(uint8_t *image, uint32_t len, uint64_t *rng) {
+    uint32_t edits = 1 + fuzz_below(rng, 8);
+    for (uint32_t e = 0; e < edits && len > 1; e++) {
+        uint32_t at = fuzz_below(rng, len), other = fuzz_below(rng, len);
+        switch (fuzz_below(rng, 5)) {
+            case 0: image[at] = (uint8_t)fuzz_below(rng, 256); break;
+            case 1: image[at] = (uint8_t)fuzz_below(rng, OP_BCMP + 1); break;
+            case 2:   // insert, the last byte falls off
+                memmove(image + at + 1, image + at, len - at - 1);
+                image[at] = (uint8_t)fuzz_below(rng, 256);
+                break;
+            case 3:   // delete, a 0 comes in at the end
+                memmove(image + at, image + at + 1, len - at - 1);
+                image[len - 1] = 0;
+                break;
+            default: {
+                uint32_t n = 1 + fuzz_below(rng, 8);
+                if (at + n > len) n = len - at;
+                if (other + n > len) n = len - other;
+                memmove(image + at, image + other, n);
+                break;
+            }
+        }
+    }
+}
+
+ // did the run fail the same way, with the same engine disagreeing?
+static int same_failure(const diff_case *t, int rc, const char *engine) {
+    size_t n = strlen(engine);
+    return rc == 1 && strncmp(t->why, engine, n) == 0 && t->why[n] == ':';
+}
+
+ // Shrink a failing image while it keeps failing the same way: cut out ever
+ // smaller runs of bytes, then zero what's left byte by byte. Returns the
+ // new length
+static uint32_t diff_minimize(diff_case *c, uint8_t *image) {
+    char why[sizeof(c->why)];
+    char engine[64];
+    uint32_t tries = 0;
+    memcpy(why, c->why, sizeof(why));
+    snprintf(engine, sizeof(engine), "%.*s", (int)strcspn(why, ":"), why);
+
+    diff_case t = *c;
+    t.image = image;
+    uint8_t *saved = malloc(c->len ? c->len : 1);
+    if (!saved) return c->len;
+
+    for (uint32_t chunk = c->len / 2; chunk >= 1 && tries < 4000; chunk /= 2) {
+        for (uint32_t at = 0; at + chunk <= t.len && tries < 4000; ) {
+            memcpy(saved, image, t.len);
+            memmove(image + at, image + at + chunk, t.len - at - chunk);
+            t.len -= chunk;
+            tries++;
+            if (same_failure(&t, diff_run(&t), engine)) {
+                memcpy(why, t.why, sizeof(why));   // keep the cut, try the same spot again
+            } else {
+                t.len += chunk;
+                memcpy(image, saved, t.len);
+                at += chunk;
+            }
+        }
+    }
+    for (uint32_t at = 0; at < t.len && tries < 8000; at++) {
+        if (image[at] == 0) continue;
+        uint8_t old = image[at];
+        image[at] = 0;
+        tries++;
+        if (same_failure(&t, diff_run(&t), engine)) {
+            memcpy(why, t.why, sizeof(why));
+        } else {
+            image[at] = old;
+        }
+    }
+    while (t.len > 1 && image[t.len - 1] == 0 && t.len - 1 > t.entry) t.len--;   // memory is 0 there anyway
+
+    free(saved);
+    memcpy(c->why, why, sizeof(why));
+    return t.len;
+}
+
+static int write_fuzz_case(const char *path, const diff_case *c, const uint8_t *image, uint32_t len, uint64_t seed) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot open '%s' for writing\n", path);
+        return -1;
+    }
+    fprintf(file, "; engines disagree: %s\n", c->why);
+    fprintf(file, "; --fuzz 1 --fuzz-seed %llu (and the same program, if one was given) rebuilds the original\n",
+            (unsigned long long)seed);
+    fprintf(file, "; entry %04X, GETC reads \"Shredder fuzz\\n\"\n", (unsigned)c->entry);
+    for (uint32_t i = 0; i < len; i++) {
+        fprintf(file, "%02X%c", image[i], (i % 16 == 15 || i + 1 == len) ? '\n' : ' ');
+    }
+    return (fclose(file) == 0) ? 0 : -1;
+}
+
+ // base, if not NULL, is the loaded program to mutate instead of generating
+ // Returns EXIT_SUCCESS if every engine agreed on every program
+static int run_fuzz(const shred_vm *base, uint32_t programs, uint64_t first_seed, uint64_t limit) {
+    uint32_t cap = base ? (base->image_len ? base->image_len : 1) : FUZZ_IMAGE_LEN;
+    uint8_t *image = malloc(cap);
+    uint32_t failed = 0;
+    uint64_t total = 0;
+    if (!image) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    double start = now_seconds();
+    for (uint32_t k = 0; k < programs; k++) {
+        uint64_t seed = first_seed + k;
+        uint64_t rng = fuzz_seed_state(seed);
+        diff_case c;
+        memset(&c, 0, sizeof(c));
+        c.image = image;
+        c.limit = limit;
+        c.schedule = seed;
+        if (base) {
+            c.len = base->image_len ? base->image_len : 1;
+            c.entry = base->entry;
+            memcpy(image, base->memory, c.len);
+            fuzz_mutate(image, c.len, &rng);
+        } else {
+            c.len = fuzz_generate(image, &rng);
+            if (fuzz_below(&rng, 4) == 0) fuzz_mutate(image, c.len, &rng);   // now and then a broken one
+        }
+
+        int rc = diff_run(&c);
+        if (rc < 0) {
+            fprintf(stderr, "Error: Out of memory\n");
+            failed++;
+            break;
+        }
+        total += c.instructions;
+        if (rc == 0) continue;
+
+        failed++;
+        char path[64];
+        printf("Seed %llu: %s\n", (unsigned long long)seed, c.why);
+        uint32_t len = diff_minimize(&c, image);
+        snprintf(path, sizeof(path), "fuzz-%llu.shred", (unsigned long long)seed);
+        if (write_fuzz_case(path, &c, image, len, seed) == 0) {
+            printf("  minimized from %u to %u bytes in %s: %s\n", (unsigned)c.len, (unsigned)len, path, c.why);
+        }
+        fflush(stdout);
+    }
+
+    printf("--- %u programs (seeds %llu-%llu), %llu instructions on the switch engine, %u failed, %.1fs ---\n",
+           (unsigned)programs, (unsigned long long)first_seed, (unsigned long long)(first_seed + programs - 1),
+           (unsigned long long)total, (unsigned)failed, now_seconds() - start);
+    free(image);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
+
+ // Serve mode (--serve [ADDR:]PORT)
+ // One VM per TCP connection, cloned from the loaded program, with GETC fed
+ // from the socket (shred_vm_feed_input) and output and faults written back
+ // to it. A session whose GETC finds nothing to read comes back
+ // SHRED_WAITING and is parked on its worker's epoll set until the socket is
+ // readable, so the -j workers carry any number of sessions. Sessions that
+ // are running get SERVE_SLICE instructions per turn, so a busy one can't
+ // starve the rest of its worker. Every worker watches the listening socket
+ // and keeps the sessions it accepts; nothing is shared after the clone.
+ // Sockets never block: output collects in the session and goes out after
+ // each turn as fast as the client takes it. A session with SERVE_OUT_MAX
+ // bytes still to send stops running and is parked until the socket is
+ // writable, so a slow reader only holds up itself.
+#if HAVE_SERVE
+#define SERVE_SLICE         100000U
+#define SERVE_EVENTS        64U
+#define SERVE_READ          4096U
+#define SERVE_OUT_MAX       65536U  // unsent output that stops a session running
+#define SERVE_SEND_TIMEOUT  10      // seconds a client can stop reading before it's dropped
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE      0       // older headers: every worker wakes for a connection
+#endif
+
+typedef struct serve_session {
+    shred_vm             *vm;
+    FILE                 *out;        // the VM's output and faults, into buf
+    char                 *buf;        // output the client hasn't taken yet
+    size_t                len, cap;
+    int                   fd;         // the connection, closing it ends the session
+    int                   armed;      // in the worker's epoll set (EPOLLONESHOT)
+    int                   waiting;    // the last turn ended SHRED_WAITING
+    int                   done;       // halted or faulted, ends once buf is sent
+    int                   blocked;    // on the worker's blocked list
+    double                since;      // last time the client took output
+    struct serve_session *next;       // ready list
+    struct serve_session *blocked_prev, *blocked_next;
+} serve_session;
+
+typedef struct {
+    shred_vm        *base;            // the loaded program, only ever cloned
+    pthread_mutex_t  clone_lock;      // the first clone sets up the base's memfd
+    int              listen_fd;
+} serve_ctx;
+
+typedef struct {
+    serve_ctx     *ctx;
+    int            epfd;
+    serve_session *ready, *ready_tail;   // SHRED_PAUSED, each gets another slice
+    serve_session *blocked;              // parked until the client reads some output
+    double         swept;                // last check of blocked for SERVE_SEND_TIMEOUT
+    pthread_t      thread;
+} serve_worker;
+
+ // the session's output stream: everything goes into buf for serve_flush()
+static ssize_t serve_write(void *cookie, const char *bytes, size_t size) {
+    serve_session *s = cookie;
+    if (s->len + size > s->cap) {
+        size_t cap = s->cap ? s->cap : SERVE_READ;
+        while (cap < s->len + size) cap *= 2;
+        char *bigger = realloc(s->buf, cap);
+        if (!bigger) {
+            errno = ENOMEM;
+            return -1;
+        }
+        s->buf = bigger;
+        s->cap = cap;
+    }
+    memcpy(s->buf + s->len, bytes, size);
+    s->len += size;
+    return (ssize_t)size;
+}
+
+ // send as much of buf as the socket takes without blocking
+ // Returns 0, or -1 if the client went away
+static int serve_flush(serve_session *s) {
+    size_t sent = 0;
+    while (sent < s->len) {
+        ssize_t n = send(s->fd, s->buf + sent, s->len - sent, MSG_DONTWAIT);
+        if (n > 0) {
+            sent += (size_t)n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            return -1;
+        }
+    }
+    if (sent) {
+        memmove(s->buf, s->buf + sent, s->len - sent);
+        s->len -= sent;
+        s->since = now_seconds();
+    }
+    return 0;
+}
+
+static void serve_unblock(serve_worker *w, serve_session *s) {
+    if (!s->blocked) return;
+    if (s->blocked_prev) s->blocked_prev->blocked_next = s->blocked_next;
+    else w->blocked = s->blocked_next;
+    if (s->blocked_next) s->blocked_next->blocked_prev = s->blocked_prev;
+    s->blocked = 0;
+}
+
+static void serve_end(serve_worker *w, serve_session *s) {
+    serve_unblock(w, s);
+    fclose(s->out);
+    close(s->fd);   // also takes it out of the epoll set
+    shred_vm_destroy(s->vm);
+    free(s->buf);
+    free(s);
+}
+
+ // Returns 0, or -1 if the fd couldn't be added to the epoll set
+static int serve_park(serve_worker *w, serve_session *s, uint32_t events) {
+    struct epoll_event ev;
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = s;
+    if (epoll_ctl(w->epfd, s->armed ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, s->fd, &ev) != 0) return -1;
+    s->armed = 1;
+    return 0;
+}
+
+ // one slice unless the client is behind on output, then send what it
+ // takes and park, queue or end the session
+static void serve_step(serve_worker *w, serve_session *s) {
+    if (!s->done && s->len < SERVE_OUT_MAX) {
+        shred_status status = shred_vm_run(s->vm, SERVE_SLICE);
+        s->waiting = (status == SHRED_WAITING);
+        s->done = (status != SHRED_PAUSED && !s->waiting);
+    }
+    if (ferror(s->out) || serve_flush(s) != 0) {   // out of memory, or the client went away
+        serve_end(w, s);
+        return;
+    }
+
+    if (s->len >= SERVE_OUT_MAX || (s->done && s->len)) {
+        if (!s->blocked) {   // the clock for SERVE_SEND_TIMEOUT starts now
+            s->since = now_seconds();
+            s->blocked_prev = NULL;
+            s->blocked_next = w->blocked;
+            if (w->blocked) w->blocked->blocked_prev = s;
+            w->blocked = s;
+            s->blocked = 1;
+        }
+        if (serve_park(w, s, EPOLLOUT) != 0) serve_end(w, s);
+        return;
+    }
+    serve_unblock(w, s);
+    if (s->done) {
+        serve_end(w, s);
+    } else if (!s->waiting) {
+        s->next = NULL;
+        if (w->ready_tail) w->ready_tail->next = s;
+        else w->ready = s;
+        w->ready_tail = s;
+    } else if (serve_park(w, s, EPOLLIN | (s->len ? EPOLLOUT : 0)) != 0) {
+        serve_end(w, s);
+    }
+}
+
+ // the socket of a parked session is readable or writable
+static void serve_event(serve_worker *w, serve_session *s) {
+    if (s->waiting && !s->done) {
+        uint8_t buf[SERVE_READ];
+        ssize_t n = recv(s->fd, buf, sizeof(buf), MSG_DONTWAIT);
+        if (n > 0) {
+            if (shred_vm_feed_input(s->vm, buf, (size_t)n) != 0) {
+                serve_end(w, s);
+                return;
+            }
+        } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            shred_vm_close_input(s->vm);   // GETC reads 0 from here on, as at EOF
+        }
+    }
+    serve_step(w, s);
+}
+
+ // drop the blocked sessions whose client hasn't taken any output for
+ // SERVE_SEND_TIMEOUT seconds; looks at most once a second
+static void serve_sweep(serve_worker *w) {
+    double now = now_seconds();
+    if (now - w->swept < 1.0) return;
+    w->swept = now;
+    for (serve_session *s = w->blocked; s; ) {
+        serve_session *next = s->blocked_next;
+        if (now - s->since >= SERVE_SEND_TIMEOUT) {
+            // reset rather than close, or the kernel keeps trying to
+            // deliver what it already holds to a client that won't read it
+            struct linger reset = { 1, 0 };
+            setsockopt(s->fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+            serve_end(w, s);
+        }
+        s = next;
+    }
+}
+
+static void serve_accept(serve_worker *w) {
+    serve_ctx *ctx = w->ctx;
+    for (;;) {
+        int fd = accept4(ctx->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            return;   // EAGAIN: none left, or another worker took it
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        serve_session *s = calloc(1, sizeof(serve_session));
+        cookie_io_functions_t io = { NULL, serve_write, NULL, NULL };
+        FILE *out = s ? fopencookie(s, "w", io) : NULL;
+        if (!out || setvbuf(out, NULL, _IONBF, 0) != 0) {
+            if (out) fclose(out);
+            free(s);
+            close(fd);
+            continue;
+        }
+        s->out = out;
+        s->fd = fd;
+        pthread_mutex_lock(&ctx->clone_lock);
+        s->vm = shred_vm_clone(ctx->base);
+        pthread_mutex_unlock(&ctx->clone_lock);
+        if (!s->vm || shred_vm_feed_input(s->vm, NULL, 0) != 0) {
+            fprintf(out, "Error: Out of memory\n");
+            serve_flush(s);
+            serve_end(w, s);
+            continue;
+        }
+        shred_vm_set_io(s->vm, NULL, out, out);
+        serve_step(w, s);
+    }
+}
+
+static void *serve_worker_main(void *arg) {
+    serve_worker *w = arg;
+    struct epoll_event events[SERVE_EVENTS];
+    for (;;) {
+        // don't sleep while sessions are waiting for a slice, and wake up
+        // to time out the blocked ones
+        int n = epoll_wait(w->epfd, events, SERVE_EVENTS, w->ready ? 0 : w->blocked ? 1000 : -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Error: epoll_wait: %s\n", strerror(errno));
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            serve_session *s = events[i].data.ptr;
+            if (s) serve_event(w, s);
+            else serve_accept(w);
+        }
+
+        // a slice for each session that was ready before this round
+        serve_session *s = w->ready;
+        w->ready = w->ready_tail = NULL;
+        while (s) {
+            serve_session *next = s->next;
+            serve_step(w, s);
+            s = next;
+        }
+        if (w->blocked) serve_sweep(w);
+    }
+    return NULL;
+}
+
+ // Runs until killed. Returns EXIT_FAILURE if it couldn't start
+static int run_serve(shred_vm *vm, const char *address, uint32_t workers) {
+    char host[64] = "127.0.0.1";
+    const char *port_text = address;
+    const char *colon = strrchr(address, ':');
+    if (colon) {
+        size_t len = (size_t)(colon - address);
+        if (len >= sizeof(host)) len = 0;   // an empty host is rejected below
+        memcpy(host, address, len);
+        host[len] = '\0';
+        port_text = colon + 1;
+    }
+    char *end;
+    unsigned long port = strtoul(port_text, &end, 10);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    if (!isdigit((unsigned char)port_text[0]) || *end != '\0' || port > 65535 ||
+        inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Error: Invalid address '%s'. Use --serve [ADDR:]PORT (IPv4, default 127.0.0.1)\n", address);
+        return EXIT_FAILURE;
+    }
+
+    serve_ctx ctx;
+    ctx.base = vm;
+    ctx.listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    if (ctx.listen_fd < 0 ||
+        setsockopt(ctx.listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+        bind(ctx.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(ctx.listen_fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Error: Cannot listen on %s:%lu: %s\n", host, port, strerror(errno));
+        if (ctx.listen_fd >= 0) close(ctx.listen_fd);
+        return EXIT_FAILURE;
+    }
+    pthread_mutex_init(&ctx.clone_lock, NULL);
+    signal(SIGPIPE, SIG_IGN);   // a client that hangs up shows up as a write error instead
+
+    if (workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = (cpus > 0) ? (uint32_t)cpus : 1;
+    }
+    serve_worker *pool = calloc(workers, sizeof(serve_worker));
+    if (!pool) {
+        fprintf(stderr, "Error: Out of memory\n");
+        close(ctx.listen_fd);
+        return EXIT_FAILURE;
+    }
+
+    uint32_t started = 0;
+    for (uint32_t i = 0; i < workers; i++) {
+        serve_worker *w = &pool[i];
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = NULL;   // the listening socket
+        w->ctx = &ctx;
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (w->epfd < 0 || epoll_ctl(w->epfd, EPOLL_CTL_ADD, ctx.listen_fd, &ev) != 0 ||
+            pthread_create(&w->thread, NULL, serve_worker_main, w) != 0) {
+            if (w->epfd >= 0) close(w->epfd);
+            break;
+        }
+        started++;
+    }
+    if (started == 0) {
+        fprintf(stderr, "Error: Cannot start any worker: %s\n", strerror(errno));
+        free(pool);
+        close(ctx.listen_fd);
+        return EXIT_FAILURE;
+    }
+    fprintf(stderr, "Serving on %s:%lu with %u threads\n", host, port, (unsigned)started);
+
+    for (uint32_t i = 0; i < started; i++) pthread_join(pool[i].thread, NULL);
+    for (uint32_t i = 0; i < started; i++) close(pool[i].epfd);
+    free(pool);
+    close(ctx.listen_fd);
+    return EXIT_FAILURE;   // only gets here if every worker failed
+}
+#endif
+
+ // Main Entry Point
+ int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printf("Shredder - A Minimal Hexadecimal Virtual Machine\n");
+        printf("================================================\n");
+        printf("Usage: %s [OPTIONS] <program.shred|program.shbin>\n\n", argv[0]);
+        printf("Options:\n");
+        printf("  -d, --debug      Enable debug mode\n");
+        printf("  -t, --trace      Enable trace mode (verbose)\n");
+        printf("  -m START:END     Dump memory range (hex, no 0x prefix)\n");
+        printf("  -e, --engine E   Execution engine: threaded (default), jit or switch\n");
+        printf("  --no-fuse        Don't run common instruction pairs as superinstructions\n");
+        printf("  --emit-c FILE    Translate the program to C source (- for stdout) and exit\n");
+        printf("  --compile FILE   Write the program as a .shbin binary image and exit\n");
+        printf("  --analyze        List the reachable code and check it can't modify itself, then exit\n");
+        printf("  --entry ADDR     Start execution at ADDR (hex) instead of 0000\n");
+        printf("  --max-insns N    Fault after N instructions (default: %u), or \"unlimited\"\n",
+               (unsigned)MAX_INSTRUCTIONS);
+        printf("  --profile        Count what runs and print a profile report to stderr afterwards\n");
+        printf("  --profile-out FILE  Also write every counter to FILE (CSV if it ends in .csv, else JSON)\n");
+        printf("  --perf-counters  Sample cycles, branch and cache misses per opcode and call target (Linux)\n");
+        printf("  --trace-file FILE   Record every instruction to a binary trace in FILE\n");
+        printf("  --trace-records N   Keep the last N instructions in the trace (default: %u)\n",
+               (unsigned)TRACE_RECORDS_DEFAULT);
+        printf("  --decode-trace FILE Print a binary trace as text and exit\n");
+        printf("  --snapshot-at N  Run until instruction N, save the VM state and exit\n");
+        printf("  --save-snapshot FILE  Where --snapshot-at saves the state\n");
+        printf("  --restore FILE   Carry on from a snapshot instead of loading a program\n");
+        printf("  --fork-at N      Run until instruction N, then clone the VM for each --fork-input\n");
+        printf("  --fork-input FILE  GETC input for one clone (repeat for more, up to %u)\n", MAX_FORKS);
+        printf("  --batch SRC      Run every .shred/.shbin in directory SRC (or listed in file SRC)\n");
+        printf("  -j N             Worker threads for --batch and --serve (default: one per CPU)\n");
+        printf("  --serve [ADDR:]PORT  Run a session of the program for every TCP connection, GETC reads from it\n");
+        printf("  --bench SRC      Time every kernel in SRC (a directory or manifest like --batch)\n");
+        printf("  --bench-runs N   Runs per kernel, the fastest counts (default: %u)\n", BENCH_RUNS_DEFAULT);
+        printf("  --baseline FILE  Compare --bench results with FILE, fail if >%.0f%% slower\n", BENCH_TOLERANCE);
+        printf("  --save-baseline FILE  Write --bench results to FILE for later --baseline runs\n");
+        printf("  --fuzz N         Check N random programs (or mutations of the one given) on every engine\n");
+        printf("  --fuzz-seed S    Seed of the first --fuzz program (default: 1)\n");
+        printf("  --stream         Read stdin and write stdout in big blocks on their own threads\n");
+        printf("  --bank FILE      Attach FILE read-only as the next bank for BANK (slot 0, 1, ...)\n");
+        printf("  --bank-rw FILE   The same, but writes through BANK windows go to FILE\n");
+        printf("  --output MODE    When program output is written: interactive, line (default) or block\n");
+        printf("  --output-buffer N  Output buffer size in bytes (default: %u)\n", SHRED_OUTPUT_BUFFER_DEFAULT);
+        printf("  -h, --help       Show this help\n\n");
+        printf("Memory: 64K bytes (0x0000-0xFFFF)\n");
+        printf("Stack:  64 levels\n");
+        return EXIT_SUCCESS;
+    }
+
+    const char *filename = NULL;
+    const char *emit_c_path = NULL;
+    const char *compile_path = NULL;
+    int analyze = 0;
+    int entry = -1;
+    uint64_t max_insns = MAX_INSTRUCTIONS;   // 0 = unlimited
+    uint64_t snapshot_at = 0;
+    const char *snapshot_path = NULL;
+    const char *restore_path = NULL;
+    uint64_t fork_at = 0;
+    const char *fork_inputs[MAX_FORKS];
+    uint32_t fork_count = 0;
+    int dump_start = -1, dump_end = -1;
+    int debug_mode = 0, trace_mode = 0;
+    int engine = SHRED_ENGINE_THREADED;
+    int fuse = 1;
+    const char *batch_source = NULL;
+    const char *serve_address = NULL;
+    int stream = 0;
+    unsigned fuzz_programs = 0;
+    uint64_t fuzz_seed = 1;
+    unsigned batch_workers = 0;
+    int output_mode = SHRED_OUTPUT_LINE;
+    unsigned output_buffer = 0;
+    const char *bench_source = NULL;
+    unsigned bench_runs = 0;
+    const char *baseline_path = NULL;
+    const char *save_baseline_path = NULL;
+    int max_insns_given = 0;
+    int profile = 0;
+    const char *profile_path = NULL;
+    int perf_counters = 0;
+    const char *trace_path = NULL;
+    unsigned trace_records = 0;
+    const char *bank_paths[SHRED_BANK_FILES];
+    int bank_writable[SHRED_BANK_FILES];
+    uint32_t bank_count = 0;
+
+    // Parse arguments
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--debug") == 0) {
+            debug_mode = 1;
+        } else if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--trace") == 0) {
+            trace_mode = 1;
+            debug_mode = 1;
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            if (sscanf(argv[i + 1], "%x:%x", &dump_start, &dump_end) == 2) {
+                i++;
+            } else {
+                fprintf(stderr, "Error: Invalid memory range. Use -m START:END (hex)\n");
+                return EXIT_FAILURE;
+            }
+        } else if ((strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "--engine") == 0) && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "switch") == 0) {
+                engine = SHRED_ENGINE_SWITCH;
+            } else if (strcmp(argv[i], "threaded") == 0) {
+                engine = SHRED_ENGINE_THREADED;
+            } else if (strcmp(argv[i], "jit") == 0) {
+                engine = SHRED_ENGINE_JIT;
+                if (!HAVE_JIT) {
+                    fprintf(stderr, "Warning: JIT not available in this build, using threaded\n");
+                    engine = SHRED_ENGINE_THREADED;
+                }
+            } else {
+                fprintf(stderr, "Error: Unknown engine '%s' (use threaded, jit or switch)\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--no-fuse") == 0) {
+            fuse = 0;
+        } else if (strcmp(argv[i], "--emit-c") == 0 && i + 1 < argc) {
+            emit_c_path = argv[++i];
+        } else if (strcmp(argv[i], "--compile") == 0 && i + 1 < argc) {
+            compile_path = argv[++i];
+        } else if (strcmp(argv[i], "--analyze") == 0) {
+            analyze = 1;
+        } else if (strcmp(argv[i], "--entry") == 0 && i + 1 < argc) {
+            if (sscanf(argv[i + 1], "%x", &entry) == 1 && entry >= 0 && entry < (int)MEMORY_SIZE) {
+                i++;
+            } else {
+                fprintf(stderr, "Error: Invalid entry address. Use --entry ADDR (hex, 0-FFFF)\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--max-insns") == 0 && i + 1 < argc) {
+            char *end;
+            i++;
+            max_insns_given = 1;
+            if (strcmp(argv[i], "unlimited") == 0) {
+                max_insns = 0;
+            } else if (isdigit((unsigned char)argv[i][0]) &&
+                       (max_insns = strtoull(argv[i], &end, 10)) > 0 && *end == '\0') {
+                // ok
+            } else {
+                fprintf(stderr, "Error: Invalid instruction limit. Use --max-insns N (N >= 1) or unlimited\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--snapshot-at") == 0 && i + 1 < argc) {
+            char *end;
+            i++;
+            if (!isdigit((unsigned char)argv[i][0]) || (snapshot_at = strtoull(argv[i], &end, 10)) == 0 || *end != '\0') {
+                fprintf(stderr, "Error: Invalid instruction number. Use --snapshot-at N (N >= 1)\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--save-snapshot") == 0 && i + 1 < argc) {
+            snapshot_path = argv[++i];
+        } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+            restore_path = argv[++i];
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profile = 1;
+        } else if (strcmp(argv[i], "--perf-counters") == 0) {
+            perf_counters = 1;
+        } else if (strcmp(argv[i], "--profile-out") == 0 && i + 1 < argc) {
+            profile = 1;
+            profile_path = argv[++i];
+        } else if (strcmp(argv[i], "--trace-file") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--trace-records") == 0 && i + 1 < argc) {
+            if (sscanf(argv[i + 1], "%u", &trace_records) == 1 && trace_records > 0 &&
+                trace_records <= TRACE_RECORDS_MAX) {
+                i++;
+            } else {
+                fprintf(stderr, "Error: Invalid record count. Use --trace-records N (1 to %u)\n",
+                        (unsigned)TRACE_RECORDS_MAX);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--decode-trace") == 0 && i + 1 < argc) {
+            return (shred_trace_decode(argv[i + 1], stdout) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+        } else if (strcmp(argv[i], "--fork-at") == 0 && i + 1 < argc) {
+            char *end;
+            i++;
+            if (!isdigit((unsigned char)argv[i][0]) || (fork_at = strtoull(argv[i], &end, 10)) == 0 || *end != '\0') {
+                fprintf(stderr, "Error: Invalid instruction number. Use --fork-at N (N >= 1)\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--fork-input") == 0 && i + 1 < argc) {
+            if (fork_count == MAX_FORKS) {
+                fprintf(stderr, "Error: Too many --fork-input files (max %u)\n", MAX_FORKS);
+                return EXIT_FAILURE;
+            }
+            fork_inputs[fork_count++] = argv[++i];
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch_source = argv[++i];
+        } else if (strcmp(argv[i], "--fuzz") == 0 && i + 1 < argc) {
+            if (sscanf(argv[i + 1], "%u", &fuzz_programs) == 1 && fuzz_programs > 0) {
+                i++;
+            } else {
+                fprintf(stderr, "Error: Invalid program count. Use --fuzz N (N >= 1)\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--fuzz-seed") == 0 && i + 1 < argc) {
+            char *end;
+            i++;
+            if (!isdigit((unsigned char)argv[i][0]) || ((fuzz_seed = strtoull(argv[i], &end, 10)), *end != '\0')) {
+                fprintf(stderr, "Error: Invalid seed. Use --fuzz-seed S (a number)\n");
+                return EXIT_FAILURE;
+            }
+        } else if ((strcmp(argv[i], "--bank") == 0 || strcmp(argv[i], "--bank-rw") == 0) && i + 1 < argc) {
+            if (bank_count == SHRED_BANK_FILES) {
+                fprintf(stderr, "Error: Too many bank files (max %u)\n", SHRED_BANK_FILES);
+                return EXIT_FAILURE;
+            }
+            bank_writable[bank_count] = (strcmp(argv[i], "--bank-rw") == 0);
+            bank_paths[bank_count++] = argv[++i];
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            stream = 1;
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve_address = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            if (sscanf(argv[i + 1], "%u", &batch_workers) == 1 && batch_workers > 0) {
+                i++;
+            } else {
+                fprintf(stderr, "Error: Invalid thread count. Use -j N (N >= 1)\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            bench_source = argv[++i];
+        } else if (strcmp(argv[i], "--bench-runs") == 0 && i + 1 < argc) {
+            if (sscanf(argv[i + 1], "%u", &bench_runs) == 1 && bench_runs > 0) {
+                i++;
+            } else {
+                fprintf(stderr, "Error: Invalid run count. Use --bench-runs N (N >= 1)\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baseline_path = argv[++i];
+        } else if (strcmp(argv[i], "--save-baseline") == 0 && i + 1 < argc) {
+            save_baseline_path = argv[++i];
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "interactive") == 0) {
+                output_mode = SHRED_OUTPUT_INTERACTIVE;
+            } else if (strcmp(argv[i], "line") == 0) {
+                output_mode = SHRED_OUTPUT_LINE;
+            } else if (strcmp(argv[i], "block") == 0) {
+                output_mode = SHRED_OUTPUT_BLOCK;
+            } else {
+                fprintf(stderr, "Error: Unknown output mode '%s' (use interactive, line or block)\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--output-buffer") == 0 && i + 1 < argc) {
+            if (sscanf(argv[i + 1], "%u", &output_buffer) == 1 && output_buffer > 0) {
+                i++;
+            } else {
+                fprintf(stderr, "Error: Invalid output buffer size. Use --output-buffer N (N >= 1)\n");
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            return EXIT_SUCCESS;
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "Error: Unknown option '%s'\n", argv[i]);
+            return EXIT_FAILURE;
+        } else {
+            filename = argv[i];
+        }
+    }
+
+    if (bench_source) {
+#if HAVE_BATCH
+        // kernels run for a while on purpose, so no limit unless one was asked for
+        return run_bench(bench_source, bench_runs ? bench_runs : BENCH_RUNS_DEFAULT, engine, fuse,
+                         max_insns_given ? max_insns : 0, baseline_path, save_baseline_path);
+#else
+        (void)max_insns_given;
+        (void)baseline_path;
+        (void)save_baseline_path;
+        fprintf(stderr, "Error: --bench needs the POSIX batch support, not available in this build\n");
+        return EXIT_FAILURE;
+#endif
+    }
+
+    if (batch_source) {
+#if HAVE_BATCH
+        return run_batch(batch_source, batch_workers, engine, fuse, trace_mode ? 2 : debug_mode, max_insns);
+#else
+        fprintf(stderr, "Error: --batch needs POSIX threads, not available in this build\n");
+        return EXIT_FAILURE;
+#endif
+    }
+
+    if (fuzz_programs) {
+#if HAVE_BATCH
+        shred_vm *base = NULL;
+        int rc;
+        if (max_insns_given && max_insns == 0) {
+            fprintf(stderr, "Error: --fuzz needs an instruction limit, not \"unlimited\"\n");
+            return EXIT_FAILURE;
+        }
+        if (filename) {
+            base = shred_vm_create();
+            if (!base) {
+                fprintf(stderr, "Error: Out of memory\n");
+                return EXIT_FAILURE;
+            }
+            if (shred_vm_load_file(base, filename) != 0) {
+                shred_vm_destroy(base);
+                return EXIT_FAILURE;
+            }
+            if (entry >= 0) shred_vm_set_entry(base, (uint32_t)entry);
+        }
+        rc = run_fuzz(base, fuzz_programs, fuzz_seed, max_insns_given ? max_insns : FUZZ_LIMIT);
+        shred_vm_destroy(base);   // NULL without a program
+        return rc;
+#else
+        (void)fuzz_seed;
+        fprintf(stderr, "Error: --fuzz needs the POSIX batch support, not available in this build\n");
+        return EXIT_FAILURE;
+#endif
+    }
+
+    if (!snapshot_at != !snapshot_path) {
+        fprintf(stderr, "Error: --snapshot-at and --save-snapshot have to be used together\n");
+        return EXIT_FAILURE;
+    }
+    if (!fork_at != !fork_count) {
+        fprintf(stderr, "Error: --fork-at needs at least one --fork-input (and the other way round)\n");
+        return EXIT_FAILURE;
+    }
+    if (restore_path && filename) {
+        fprintf(stderr, "Error: --restore takes the place of the program file, give one or the other\n");
+        return EXIT_FAILURE;
+    }
+    if (!filename && !restore_path) {
+        fprintf(stderr, "Error: No .shred file specified\n");
+        return EXIT_FAILURE;
+    }
+
+    // Check file extension
+    const char *ext = filename ? strrchr(filename, '.') : ".shred";
+    if (!ext || (strcmp(ext, ".shred") != 0 && strcmp(ext, ".shbin") != 0)) {
+        fprintf(stderr, "Warning: File '%s' doesn't have .shred or .shbin extension\n", filename);
+    }
+
+    // Initialize VM
+    shred_vm *vm = shred_vm_create();
+    if (!vm) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    shred_vm_set_engine(vm, engine);
+    shred_vm_set_fusion(vm, fuse);
+    shred_vm_set_debug(vm, trace_mode ? 2 : debug_mode);
+    shred_vm_set_limit(vm, max_insns);
+    if (shred_vm_set_output(vm, output_mode, output_buffer) != 0 ||
+        (profile && shred_vm_set_profile(vm, 1) != 0)) {
+        fprintf(stderr, "Error: Out of memory\n");
+        shred_vm_destroy(vm);
+        return EXIT_FAILURE;
+    }
+    if (trace_path && shred_vm_set_trace(vm, trace_path, trace_records) != 0) {
+        shred_vm_destroy(vm);
+        return EXIT_FAILURE;
+    }
+    if (perf_counters && shred_vm_set_perf_counters(vm, 1) != 0) {
+        shred_vm_destroy(vm);
+        return EXIT_FAILURE;
+    }
+    for (uint32_t b = 0; b < bank_count; b++) {
+        if (shred_vm_attach_bank(vm, b, bank_paths[b], bank_writable[b]) != 0) {
+            shred_vm_destroy(vm);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Load and execute
+    if (restore_path) {
+        if (shred_vm_restore_snapshot(vm, restore_path) != 0) {
+            shred_vm_destroy(vm);
+            return EXIT_FAILURE;
+        }
+        filename = restore_path;
+    } else {
+        if (shred_vm_load_file(vm, filename) != 0) {
+            shred_vm_destroy(vm);
+            return EXIT_FAILURE;
+        }
+        if (entry >= 0) shred_vm_set_entry(vm, (uint32_t)entry);
+    }
+
+    if (compile_path) {
+        int rc = shred_vm_save_shbin(vm, compile_path);
+        shred_vm_destroy(vm);
+        return (rc == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (analyze) {
+        int rc = analyze_program(vm, filename);
+        shred_vm_destroy(vm);
+        return (rc == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (emit_c_path) {
+        int rc = emit_c(vm, emit_c_path, filename);
+        shred_vm_destroy(vm);
+        return (rc == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (serve_address) {
+#if HAVE_SERVE
+        int rc = run_serve(vm, serve_address, batch_workers);
+#else
+        int rc = EXIT_FAILURE;
+        fprintf(stderr, "Error: --serve needs Linux epoll and POSIX threads, not available in this build\n");
+#endif
+        shred_vm_destroy(vm);
+        return rc;
+    }
+
+    if (debug_mode) {
+        printf("\n=== Starting execution ===\n\n");
+    }
+
+    if (fork_at) {
+#if HAVE_BATCH
+        int rc = EXIT_FAILURE;
+        uint64_t done = shred_vm_instruction_count(vm);
+        if (done >= fork_at) {
+            fprintf(stderr, "Error: Already %llu instructions in, can't fork at %llu\n",
+                    (unsigned long long)done, (unsigned long long)fork_at);
+        } else if (shred_vm_run(vm, fork_at - done) != SHRED_PAUSED) {
+            fprintf(stderr, "Error: Program ended before instruction %llu, nothing to fork\n",
+                    (unsigned long long)fork_at);
+        } else {
+            rc = run_forks(vm, fork_inputs, fork_count);
+        }
+        shred_vm_destroy(vm);
+        return rc;
+#else
+        (void)fork_inputs;
+        fprintf(stderr, "Error: --fork-at needs POSIX threads, not available in this build\n");
+        shred_vm_destroy(vm);
+        return EXIT_FAILURE;
+#endif
+    }
+
+    if (snapshot_at) {
+        int rc = EXIT_FAILURE;
+        uint64_t done = shred_vm_instruction_count(vm);
+        if (done >= snapshot_at) {
+            fprintf(stderr, "Error: Already %llu instructions in, can't snapshot at %llu\n",
+                    (unsigned long long)done, (unsigned long long)snapshot_at);
+        } else if (shred_vm_run(vm, snapshot_at - done) != SHRED_PAUSED) {
+            fprintf(stderr, "Error: Program ended before instruction %llu, no snapshot saved\n",
+                    (unsigned long long)snapshot_at);
+        } else if (shred_vm_save_snapshot(vm, snapshot_path) == 0) {
+            if (debug_mode) {
+                printf("\nSaved snapshot at instruction %llu to '%s'\n",
+                       (unsigned long long)shred_vm_instruction_count(vm), snapshot_path);
+            }
+            rc = EXIT_SUCCESS;
+        }
+        shred_vm_destroy(vm);
+        return rc;
+    }
+
+    if (stream) {
+#if HAVE_BATCH
+        if (run_stream(vm) != 0) {
+            shred_vm_destroy(vm);
+            return EXIT_FAILURE;
+        }
+#else
+        fprintf(stderr, "Error: --stream needs POSIX threads, not available in this build\n");
+        shred_vm_destroy(vm);
+        return EXIT_FAILURE;
+#endif
+    } else {
+        shred_vm_run(vm, 0);
+    }
+
+    // Post-execution
+    if (debug_mode) {
+        if (dump_start < 0) dump_start = 0x00;
+        if (dump_end < 0) dump_end = 0xFF;
+        dump_memory(vm, (uint32_t)dump_start, (uint32_t)dump_end);
+
+        if (vm->overflow_flag) {
+            printf("[!] Overflow flag is SET\n");
+        }
+        if (vm->stack_pointer > 0) {
+            printf("[!] Warning: Stack not empty (depth=%u)\n", (unsigned)vm->stack_pointer);
+        }
+    }
+
+    int rc = EXIT_SUCCESS;
+    if (profile) {
+        fflush(stdout);
+        shred_vm_profile_report(vm, stderr, 0);
+    }
+    if (perf_counters) {
+        fflush(stdout);
+        shred_vm_perf_report(vm, stderr, 0);
     }
+    if (profile_path && write_profile(vm, profile_path) != 0) rc = EXIT_FAILURE;
 
-    return EXIT_SUCCESS;
+    shred_vm_destroy(vm);
+    return rc;
 }
+#endif
@@ -0,0 +1,190 @@
+// Shredder VM as a library
+// Build shredder.c with -DSHREDDER_LIBRARY to leave out main() and link it
+// into your own program. Every shred_vm is independent, so one process can
+// host as many as it likes (one thread per VM at a time).
+#ifndef SHREDDER_H
+#define SHREDDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define SHRED_MEMORY_SIZE       65536U
+#define SHRED_STACK_SIZE        64U
+#define SHRED_DATA_STACK_SIZE   256U    // PUSH/POP stack, separate from the call stack
+#define SHRED_BANK_FILES        16U     // slots for shred_vm_attach_bank()
+
+ // Execution engines
+#define SHRED_ENGINE_SWITCH     0   // reference switch loop, supports debug/trace
+#define SHRED_ENGINE_THREADED   1   // threaded handlers, no debug/trace hooks
+#define SHRED_ENGINE_JIT        2   // threaded + native code for hot blocks (x86-64 only)
+
+ // Output modes for PUTC/PUTN, see shred_vm_set_output()
+#define SHRED_OUTPUT_INTERACTIVE  0   // write out every character
+#define SHRED_OUTPUT_LINE         1   // on newline or a full buffer (default)
+#define SHRED_OUTPUT_BLOCK        2   // only on a full buffer, or when shred_vm_run() returns
+#define SHRED_OUTPUT_BUFFER_DEFAULT 4096U
+
+ // shred_vm_profile_write() formats
+#define SHRED_PROFILE_JSON        0
+#define SHRED_PROFILE_CSV         1
+
+ // shred_vm_reset() flags
+#define SHRED_RESET_KEEP_MEMORY   0
+#define SHRED_RESET_CLEAR_MEMORY  1
+
+ // Why shred_vm_run() returned
+typedef enum {
+    SHRED_HALTED = 0,   // HALT with an empty stack
+    SHRED_PAUSED,       // step budget used up, call shred_vm_run() again to continue
+    SHRED_FAULT,        // CPU fault, the message went to stderr
+    SHRED_WAITING,      // GETC needs fed input that isn't there yet, see shred_vm_feed_input()
+} shred_status;
+
+typedef struct shred_vm shred_vm;
+
+ // New VM with zeroed memory, NULL if out of memory
+shred_vm *shred_vm_create(void);
+void      shred_vm_destroy(shred_vm *vm);
+
+ // Back to ip 0 with an empty stack and cleared flags. Memory is only
+ // zeroed with SHRED_RESET_CLEAR_MEMORY, so a pooled VM can be reused for
+ // programs that don't depend on memory outside their image being 0.
+void shred_vm_reset(shred_vm *vm, int flags);
+
+ // Copy a program into memory starting at address 0 (bytes past the image
+ // are left alone). A .shbin image (from shred_vm_save_shbin) sets the entry
+ // address from its header, anything else starts at 0.
+ // Returns 0 on success, -1 on error (message on stderr)
+int shred_vm_load(shred_vm *vm, const char *text, size_t len);             // .shred hex text
+int shred_vm_load_image(shred_vm *vm, const uint8_t *image, size_t len);  // raw bytes or .shbin
+int shred_vm_load_file(shred_vm *vm, const char *filename);                // .shred or .shbin file
+
+ // Write the loaded program and its entry address as a .shbin image, which
+ // loads without any text parsing. The image also records whether the
+ // program can ever store onto its own code (the check --analyze does); when
+ // it can't, runs skip the per-store self-modification checks. Getting
+ // memory through shred_vm_memory() or moving the entry drops that again.
+ // Returns 0 on success, -1 on error
+int shred_vm_save_shbin(shred_vm *vm, const char *filename);
+ // Start address for the next run and every reset. Returns -1 if it's
+ // outside memory
+int shred_vm_set_entry(shred_vm *vm, uint32_t entry);
+
+ // Save the whole VM (memory, both stacks, flags, ip, instruction count and
+ // status) to a snapshot file, usually after a shred_vm_run() that paused.
+ // Restoring one maps its memory copy-on-write where mmap is available, so
+ // many VMs can start from the same warm image without re-running its setup.
+ // Both return 0 on success, -1 on error (message on stderr)
+int shred_vm_save_snapshot(shred_vm *vm, const char *filename);
+int shred_vm_restore_snapshot(shred_vm *vm, const char *filename);
+
+ // A new VM in the same state as vm: memory, stack, flags, ip, counts,
+ // engine, limits and streams. Memory is shared copy-on-write where the OS
+ // allows it (Linux), so a clone costs a mapping instead of a 64K copy and
+ // only the pages it writes to become its own. The decode cache isn't
+ // copied either, a clone builds its own the first time it runs. Clones are
+ // independent VMs and can run on other threads. NULL if out of memory
+shred_vm *shred_vm_clone(shred_vm *vm);
+
+ // Banked memory: attach a host file as bank slot (0-15) for the BANK and
+ // BANKLEN opcodes. BANK maps 4K pages of it over 4K windows of memory, so
+ // the OS reads in only the pages a program touches and nothing is copied.
+ // Writes to a writable bank go to the file; a read-only bank takes writes
+ // until its window is switched. Resets and loads put every window back to
+ // plain memory but leave files attached, snapshots save what the windows
+ // show as plain memory and clones get the same files and windows. filename
+ // NULL detaches the slot.
+ // Needs mmap and 4K pages. Returns 0, or -1 on error (message on the VM's err)
+int shred_vm_attach_bank(shred_vm *vm, uint32_t slot, const char *filename, int writable);
+
+ // Run at most max_steps instructions (0 = until HALT or a fault). A paused
+ // VM picks up where it stopped on the next call, with ip, the stack and the
+ // overflow flag as they were; a halted or faulted one keeps returning the
+ // same status until it is reset. Slicing many VMs this way is fine.
+shred_status shred_vm_run(shred_vm *vm, uint64_t max_steps);
+
+ // Total instructions a program may run before it faults with "Instruction
+ // limit exceeded" (default 1,000,000, 0 = no limit). Unlike max_steps the
+ // count isn't reset between shred_vm_run() calls, only by shred_vm_reset().
+void shred_vm_set_limit(shred_vm *vm, uint64_t max_instructions);
+
+ // Returns 0, or -1 if the engine isn't available in this build
+int  shred_vm_set_engine(shred_vm *vm, int engine);
+ // Superinstructions (on by default): the threaded and JIT engines run DEC or
+ // CMP followed by a JZ/JZ16 on its result, and INC followed by JMP/JMP16, as
+ // one dispatch. Each half still counts as an instruction, so limits, pauses
+ // and faults land exactly where they would without it.
+void shred_vm_set_fusion(shred_vm *vm, int enabled);
+ // Streams for GETC, program output (and debug/trace) and fault messages.
+ // Defaults are stdin/stdout/stderr; in == NULL makes GETC read EOF.
+void shred_vm_set_io(shred_vm *vm, FILE *in, FILE *out, FILE *err);
+ // Feed GETC from the host instead of the in stream. After the first call
+ // GETC reads the bytes queued here, and one that finds nothing doesn't run:
+ // shred_vm_run() returns SHRED_WAITING with ip still on it, and runs it when
+ // called again after more input (or the end of it) has been fed. So a host
+ // can park a waiting VM on its own event loop instead of blocking a thread.
+ // shred_vm_close_input() marks the end, after which GETC reads 0 as at EOF.
+ // Returns 0, or -1 if out of memory
+int  shred_vm_feed_input(shred_vm *vm, const void *data, size_t len);
+ // The same without the copy: GETC reads straight out of data, which has to
+ // stay put until shred_vm_run() next returns SHRED_WAITING (all of it read)
+ // or the VM is done. Returns -1 if fed input is still unread
+int  shred_vm_lend_input(shred_vm *vm, const void *data, size_t len);
+void shred_vm_close_input(shred_vm *vm);
+ // Output mode and buffer size (0 = default). Buffered output is also
+ // written before GETC reads and before any fault message. Returns 0, or -1
+ // for a bad mode or if the buffer can't be allocated
+int  shred_vm_set_output(shred_vm *vm, int mode, uint32_t buffer_size);
+ // 0 = off, 1 = debug, 2 = trace (both force the switch engine, and
+ // interactive output so it stays in order with the debug lines)
+void shred_vm_set_debug(shred_vm *vm, int level);
+
+ // Execution profile: hits per address and per opcode, taken counts for
+ // JZ/JZ16, calls and inclusive instruction counts per RUN/RUN16 target, and
+ // the hottest blocks (straight runs of code starting after a jump, call or
+ // return). Counting is a few increments per instruction, nothing is written
+ // until a report is asked for. Works with every engine; the JIT is left
+ // out while profiling. Enabling it again clears the counters.
+ // Returns 0, or -1 if out of memory
+int  shred_vm_set_profile(shred_vm *vm, int enabled);
+ // Sorted text report, top entries of each table (0 = 20)
+void shred_vm_profile_report(const shred_vm *vm, FILE *out, uint32_t top);
+ // Every non-zero counter, for other tools. Returns 0, or -1 if profiling
+ // is off, the format is unknown or the write failed
+int  shred_vm_profile_write(const shred_vm *vm, FILE *out, int format);
+
+ // Binary trace: one 24 byte record per instruction (ip, opcode and
+ // operands, call stack depth, overflow flag, and the address and value it
+ // stored) in a ring that keeps the last records (0 = 1M, rounded up to a
+ // power of two). Where there is mmap the ring lives in the file itself, so
+ // a crashed run still leaves its trace behind; otherwise the file is written
+ // when tracing stops. Like profiling it works with every engine and leaves
+ // the JIT out; clones don't inherit it. filename NULL stops tracing.
+ // Returns 0, or -1 if the file can't be created (message on the VM's err)
+int  shred_vm_set_trace(shred_vm *vm, const char *filename, uint32_t records);
+ // Print a trace file as text, oldest record first, with the same mnemonics
+ // as the debug trace. Returns 0, or -1 if it isn't a readable trace
+int  shred_trace_decode(const char *filename, FILE *out);
+
+ // Performance counters (Linux): cycles, branch misses and L1 data cache
+ // misses from perf_event_open, sampled and booked to the opcode running and
+ // the RUN/RUN16 target it was called from. Without a PMU (containers, most
+ // VMs) it samples CPU time in nanoseconds instead. The counters belong to
+ // the thread that turns them on and count only inside shred_vm_run(); one
+ // VM per process can have them, since they report through SIGPROF. The JIT
+ // is left out like with profiling.
+ // Returns 0, or -1 if they can't be set up (message on the VM's err)
+int  shred_vm_set_perf_counters(shred_vm *vm, int enabled);
+ // Per opcode: executed, events, events per instruction; per call target:
+ // inclusive and self events. Top entries of the call table (0 = 20)
+void shred_vm_perf_report(const shred_vm *vm, FILE *out, uint32_t top);
+
+uint8_t  *shred_vm_memory(shred_vm *vm);                 // SHRED_MEMORY_SIZE bytes; drops cached code
+uint64_t  shred_vm_instruction_count(const shred_vm *vm);
+uint32_t  shred_vm_ip(const shred_vm *vm);               // next instruction to run
+uint32_t  shred_vm_stack_depth(const shred_vm *vm);      // return addresses on the call stack
+uint32_t  shred_vm_data_depth(const shred_vm *vm);       // values on the PUSH/POP data stack
+int       shred_vm_overflow(const shred_vm *vm);         // overflow flag
+
+#endif